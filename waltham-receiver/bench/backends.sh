@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Compares the epoll and io_uring event backends: the receiver is started on
+# each in turn and wth-bench times sync round trips against it. The CPU time
+# the receiver spent during the run and its wait stats follow each result.
+#
+# usage: bench/backends.sh build-dir [connections [rounds]]
+#
+# The receiver needs a Wayland compositor like on any other run. Extra
+# receiver options go in RECEIVER_ARGS, e.g. RECEIVER_ARGS="-t 4 -e".
+
+set -e
+
+build=${1:?usage: $0 build-dir [connections [rounds]]}
+connections=${2:-16}
+rounds=${3:-10000}
+port=${PORT:-34400}
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+# utime + stime of a process, in clock ticks
+cpu_ticks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+for backend in epoll io_uring; do
+	echo "== $backend"
+	"$build/waltham-receiver" -p $port -k $backend $RECEIVER_ARGS \
+		> "$log" 2>&1 &
+	pid=$!
+	sleep 1
+
+	before=$(cpu_ticks $pid)
+	"$build/wth-bench" -p $port -c $connections -n $rounds
+	after=$(cpu_ticks $pid)
+
+	kill -INT $pid
+	wait $pid || true
+	echo "receiver cpu: $(( (after - before) * 1000 / $(getconf CLK_TCK) )) ms"
+	grep 'waits' "$log"
+done
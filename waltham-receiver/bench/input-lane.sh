@@ -0,0 +1,32 @@
+#!/bin/sh
+#
+# Shows what blob uploads do to input latency on either path to the
+# transmitter. Every round, each connection times a sync over its Waltham
+# connection, the path seat events take by default, and a hello echoed on
+# the input lane. The first run has no other traffic; in the second one a
+# blob buffer is uploaded ahead of every sync on the same connection.
+#
+# usage: bench/input-lane.sh build-dir [blob-bytes [connections [rounds]]]
+#
+# The receiver needs a Wayland compositor like on any other run. Extra
+# receiver options go in RECEIVER_ARGS.
+
+set -e
+
+build=${1:?usage: $0 build-dir [blob-bytes [connections [rounds]]]}
+blob=${2:-4194304}
+connections=${3:-4}
+rounds=${4:-1000}
+port=${PORT:-34400}
+lane=${LANE_PORT:-34401}
+log=$(mktemp)
+
+"$build/waltham-receiver" -p $port -I $lane $RECEIVER_ARGS > "$log" 2>&1 &
+pid=$!
+trap 'kill -INT $pid; wait $pid || true; rm -f "$log"' EXIT
+sleep 1
+
+echo "== idle"
+"$build/wth-bench" -p $port -l $lane -c $connections -n $rounds
+echo "== $blob bytes blobs"
+"$build/wth-bench" -p $port -l $lane -b $blob -c $connections -n $rounds
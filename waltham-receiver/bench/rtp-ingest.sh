@@ -0,0 +1,36 @@
+#!/bin/sh
+#
+# Compares udpsrc with the RTP ingest on loopback. rtp-ingest-bench receives
+# the same RTP/JPEG stream with either, gst-launch-1.0 sends it as fast as
+# it can: one 1080p frame encoded up front and paid out frames times.
+#
+# usage: bench/rtp-ingest.sh build-dir [frames]
+#
+# Needs gst-launch-1.0 with the good plugins (jpegenc, rtpjpegpay).
+
+set -e
+
+build=${1:?usage: $0 build-dir [frames]}
+frames=${2:-3000}
+port=${PORT:-5005}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+gst-launch-1.0 -q videotestsrc num-buffers=1 pattern=smpte \
+	! video/x-raw,width=1920,height=1080 ! jpegenc \
+	! filesink location="$dir/frame.jpg"
+
+for source in udpsrc ingest; do
+	args=
+	[ $source = ingest ] && args=-G
+
+	"$build/rtp-ingest-bench" -o $port $args &
+	pid=$!
+	sleep 1
+
+	gst-launch-1.0 -q multifilesrc location="$dir/frame.jpg" loop=true \
+		num-buffers=$frames caps="image/jpeg,framerate=(fraction)30/1" \
+		! rtpjpegpay ! udpsink host=127.0.0.1 port=$port sync=false
+
+	wait $pid
+done
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Shows what the default TCP socket profile buys: sync round trips are timed
+# with Nagle and delayed ACKs left on at both ends, then with the defaults
+# (TCP_NODELAY, TCP_QUICKACK re-armed after every read).
+#
+# usage: bench/socket-profile.sh build-dir [connections [rounds]]
+#
+# The receiver needs a Wayland compositor like on any other run. Extra
+# receiver options go in RECEIVER_ARGS, extra wth-bench options in BENCH_ARGS.
+
+set -e
+
+build=${1:?usage: $0 build-dir [connections [rounds]]}
+connections=${2:-1}
+rounds=${3:-10000}
+port=${PORT:-34400}
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+for profile in nodelay=0,quickack=0 nodelay=1,quickack=1; do
+	echo "== $profile"
+	"$build/waltham-receiver" -p $port -s $profile $RECEIVER_ARGS \
+		> "$log" 2>&1 &
+	pid=$!
+	sleep 1
+
+	"$build/wth-bench" -p $port -s $profile -c $connections -n $rounds \
+		$BENCH_ARGS
+
+	kill -INT $pid
+	wait $pid || true
+done
@@ -0,0 +1,28 @@
+#!/bin/sh
+#
+# Compares transmitters on the AF_UNIX socket with transmitters on loopback
+# TCP: one receiver listens on both and wth-bench times sync round trips over
+# each in turn.
+#
+# usage: bench/unix-vs-tcp.sh build-dir [connections [rounds]]
+#
+# The receiver needs a Wayland compositor like on any other run. Extra
+# receiver options go in RECEIVER_ARGS.
+
+set -e
+
+build=${1:?usage: $0 build-dir [connections [rounds]]}
+connections=${2:-1}
+rounds=${3:-10000}
+port=${PORT:-34400}
+dir=$(mktemp -d)
+path="$dir/waltham"
+
+"$build/waltham-receiver" -p $port -u "$path" $RECEIVER_ARGS \
+	> "$dir/log" 2>&1 &
+pid=$!
+trap 'kill -INT $pid; wait $pid || true; rm -rf "$dir"' EXIT
+sleep 1
+
+"$build/wth-bench" -u "$path" -c $connections -n $rounds
+"$build/wth-bench" -p $port -c $connections -n $rounds
@@ -0,0 +1,97 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Admission control of incoming connections: a limit on the     **
+**  number of clients and a token bucket per source address. Connections      **
+**  that are turned down are reset right away, before any Waltham state is    **
+**  set up for them.                                                          **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_ADMISSION_H_
+#define WTH_SERVER_WALTHAM_ADMISSION_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct receiver;
+struct admission_bucket;
+
+enum admission_verdict {
+    ADMISSION_ACCEPT,
+    ADMISSION_REJECT_FULL,      /* max clients reached */
+    ADMISSION_REJECT_RATE,      /* source connects too often */
+};
+
+int
+admission_init(struct receiver *srv);
+
+void
+admission_fini(struct receiver *srv);
+
+/**
+* admission_check
+*
+* Decides whether a new connection may become a client. An accepted
+* connection counts against the client limit until admission_release().
+*
+* @param names        struct receiver *srv
+*                     const struct sockaddr *addr
+* @param value        reactor the connection was accepted on
+*                     peer address, NULL or AF_UNIX are not rate limited
+* @return             the verdict
+*/
+enum admission_verdict
+admission_check(struct receiver *srv, const struct sockaddr *addr);
+
+/* a client admitted by admission_check() went away */
+void
+admission_release(void);
+
+/**
+* admission_reject
+*
+* Closes a connection that was turned down with a reset, so that neither
+* side keeps any state for it
+*
+* @param names        struct receiver *srv
+*                     int fd
+*                     enum admission_verdict verdict
+* @param value        reactor the connection was accepted on
+*                     accepted socket
+*                     reason it was turned down
+* @return             none
+*/
+void
+admission_reject(struct receiver *srv, int fd, enum admission_verdict verdict);
+
+#endif
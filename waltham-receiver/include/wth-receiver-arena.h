@@ -0,0 +1,123 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Per-client arena for protocol objects. Every object type has  **
+**  its own pool of fixed size slabs with a free list; all slabs go away at   **
+**  once when the client is destroyed.                                        **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_ARENA_H_
+#define WTH_SERVER_WALTHAM_ARENA_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+enum arena_type {
+    ARENA_REGISTRY,
+    ARENA_COMPOSITOR,
+    ARENA_REGION,
+    ARENA_SURFACE,
+    ARENA_WINDOW,           /* struct surface::shm_window */
+    ARENA_IVISURFACE,
+    ARENA_APPLICATION_ID,
+    ARENA_SEAT,
+    ARENA_POINTER,
+    ARENA_TOUCH,
+    ARENA_BLOB_FACTORY,
+    ARENA_BUFFER,
+    ARENA_FRAME_CALLBACK,
+    ARENA_TYPE_COUNT,
+};
+
+struct arena_slab;
+
+struct arena_pool {
+    size_t size;                /* object size, rounded up for alignment */
+    unsigned int per_slab;
+    struct arena_slab *slabs;
+    void *free_list;
+    unsigned int live;
+};
+
+struct arena {
+    struct arena_pool pools[ARENA_TYPE_COUNT];
+    unsigned int slab_count;
+    bool releasing;             /* frees are pointless, all slabs go next */
+};
+
+void
+arena_init(struct arena *arena);
+
+/**
+* arena_zalloc
+*
+* Allocates a zeroed object of the given type
+*
+* @param names        struct arena *arena
+*                     enum arena_type type
+* @param value        arena of the client owning the object
+*                     type of the object
+* @return             the object, or NULL when out of memory
+*/
+void *
+arena_zalloc(struct arena *arena, enum arena_type type);
+
+/**
+* arena_free
+*
+* Returns an object to its pool. The memory goes back to the system only
+* with arena_release().
+*
+* @param names        struct arena *arena
+*                     enum arena_type type
+*                     void *ptr
+* @param value        arena the object was allocated from
+*                     type the object was allocated as
+*                     object to free, may be NULL
+* @return             none
+*/
+void
+arena_free(struct arena *arena, enum arena_type type, void *ptr);
+
+/**
+* arena_release
+*
+* Frees every slab of the arena, whether their objects were freed or not
+*
+* @param names        struct arena *arena
+* @param value        arena to release
+* @return             none
+*/
+void
+arena_release(struct arena *arena);
+
+#endif
@@ -33,11 +33,15 @@ struct blob_factory {
     struct wl_list link; /* struct client::blob_factory_list */
 };
 
-/* wthp_buffer protocol object */
+/*
+ * wthp_buffer protocol object. The pixels are copied once, when the buffer
+ * is created, into a file the session worker wraps in a wl_shm pool.
+ */
 struct buffer {
     struct wthp_buffer *obj;
+    struct client *client;
     uint32_t data_sz;
-    void *data;
+    int fd;                 /* pixels, -1 if the buffer cannot be shown */
     int32_t width;
     int32_t height;
     int32_t stride;
@@ -48,4 +52,44 @@ struct buffer {
 void
 client_bind_blob_factory(struct client *c, struct wthp_blob_factory *obj);
 
+void
+buffer_destroy(struct buffer *buf);
+
+/**
+* blob_damage_add
+*
+* Adds a rectangle to the damage. Empty rectangles and those already
+* covered by a single one of the damage are left out.
+*
+* @param names        struct blob_damage *damage
+*                     int32_t x, int32_t y, int32_t width, int32_t height
+* @param value        damage to grow
+*                     rectangle to add
+* @return             none
+*/
+void
+blob_damage_add(struct blob_damage *damage,
+		int32_t x, int32_t y, int32_t width, int32_t height);
+
+void
+blob_damage_merge(struct blob_damage *damage, const struct blob_damage *other);
+
+/**
+* blob_damage_clip
+*
+* Clips the damage to a buffer, rectangles left empty are dropped
+*
+* @param names        struct blob_damage *damage
+*                     int32_t width, int32_t height
+* @param value        damage to clip
+*                     size of the buffer
+* @return             none
+*/
+void
+blob_damage_clip(struct blob_damage *damage, int32_t width, int32_t height);
+
+/* sum of the damaged areas, overlaps are counted twice */
+uint64_t
+blob_damage_area(const struct blob_damage *damage);
+
 #endif
@@ -46,6 +46,8 @@
 #include <assert.h>
 #include <getopt.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
@@ -60,14 +62,24 @@
 #include <waltham-server.h>
 #include <waltham-connection.h>
 
+#include "wth-receiver-timer.h"
+#include "wth-receiver-arena.h"
+#include "wth-receiver-region.h"
+#include "wth-receiver-rtt.h"
+#include "wth-receiver-input-lane.h"
+
 #define DEBUG 1
 
 struct receiver;
 struct client;
 struct window;
+struct session;
+struct uring;
+struct uring_req;
+struct admission_bucket;
 
 /***** macros *******/
-#define MAX_EPOLL_WATCHES 2
+#define MAX_EPOLL_WATCHES 64
 
 #ifndef container_of
 #define container_of(ptr, type, member) ({                              \
@@ -99,12 +111,22 @@ zalloc(size_t size)
         return calloc(1, size);
 }
 
+static inline uint64_t
+get_monotonic_us(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 
 /***** Data types *****/
 /* wthp_region protocol object */
 struct region {
     struct wthp_region *obj;
-    /* pixman_region32_t region; */
+    struct client *client;
+    struct region_set set;
     struct wl_list link; /* struct client::region_list */
 };
 
@@ -115,23 +137,72 @@ struct compositor {
     struct wl_list link; /* struct client::compositor_list */
 };
 
+#define BLOB_DAMAGE_RECTS 16
+
+/*
+ * Damaged rectangles of a blob buffer, in buffer coordinates. Past
+ * BLOB_DAMAGE_RECTS they are merged into their bounding box.
+ */
+struct blob_damage {
+    uint32_t count;
+    struct {
+        int32_t x, y, width, height;
+    } rects[BLOB_DAMAGE_RECTS];
+};
+
+/* wl_surface.frame callback, done once its commit has been shown */
+struct frame_callback {
+    struct wthp_callback *obj;
+    uint32_t seq;                /* struct surface::frame_seq of the commit */
+    struct wl_list link;         /* struct surface::pending_frames or
+                                    struct surface::frames */
+};
+
 /* wthp_surface protocol object */
 struct surface {
     struct wthp_surface *obj;
+    struct client *client;
     uint32_t ivi_id;
     char *ivi_app_id;
     struct ivisurface *ivisurf;
-    struct wthp_callback *cb;
     struct window *shm_window;
+
+    /* frame callbacks, reported by the session worker per commit */
+    struct wl_list pending_frames; /* struct frame_callback::link */
+    struct wl_list frames;         /* committed, oldest first */
+    uint32_t frame_seq;            /* last commit with frame callbacks */
+    uint32_t frame_unpaced_seq;    /* last one no worker will report */
+    struct timer frame_timer;      /* paces those */
+
+    /* double-buffered state, applied on commit */
+    struct buffer *pending_buffer; /* attached, shown on the next commit */
+    struct blob_damage pending_damage;        /* surface coordinates */
+    struct blob_damage pending_buffer_damage; /* buffer coordinates */
+    int32_t pending_scale;
+    int32_t pending_transform;     /* enum wl_output_transform */
+    int32_t buffer_scale;
+    int32_t buffer_transform;
+    struct region_set pending_opaque;
+    struct region_set pending_input;
+    bool pending_input_infinite;   /* no input region, input everywhere */
+    uint32_t pending_regions;      /* bit per enum session_region set */
+    struct region_set opaque;      /* surface coordinates */
+    struct region_set input;
+    bool input_infinite;
+    uint32_t regions_unsent;       /* bit per enum session_region the
+                                      session worker does not have */
+
     struct wl_list link; /* struct client::surface_list */
 };
 /* wthp_ivi_surface protocol object */
 struct ivisurface {
     struct wthp_ivi_surface *obj;
+    struct client *client;
     struct wthp_callback *cb;
     struct wl_list link; /* struct client::surface_list */
     struct surface *surf;
     struct application_id *appid;
+    struct session *session;
 };
 
 /* wthp_ivi_application protocol object */
@@ -159,17 +230,28 @@ struct watch {
     struct receiver *receiver;
     int fd;
     void (*cb)(struct watch *w, uint32_t events);
+    struct uring_req *req;  /* io_uring backend only */
 };
 
 struct client {
     struct wl_list link; /* struct receiver::client_list */
     struct receiver *receiver;
 
-    pid_t pid;
-    bool pid_destroying;
-
     struct wth_connection *connection;
     struct watch conn_watch;
+    bool tcp;                  /* not an AF_UNIX connection */
+    struct sockaddr_storage peer;
+    uint64_t connect_us;
+    struct rtt_probe rtt;
+    struct input_lane_ref lane;
+
+    struct wl_list dirty_link; /* struct receiver::dirty_list, empty when clean */
+    bool backlogged;           /* socket was full, EPOLLOUT is armed */
+    size_t out_queued;         /* bytes sent since the last complete flush,
+                                  estimated */
+    bool congested;            /* out_queued went over the high watermark */
+    struct wl_list ready_link; /* struct receiver::ready_list, empty unless
+                                  the client ran out of budget */
 
     /* client object lists for clean-up on disconnection */
     struct wl_list registry_list;     /* struct registry::link */
@@ -180,17 +262,112 @@ struct client {
     struct wl_list seat_list;         /* struct seat::link */
     struct wl_list pointer_list;      /* struct pointer::link */
     struct wl_list touch_list;        /* struct touch::link */
+    struct wl_list session_list;      /* struct session::link */
+
+    /* memory of all the objects above */
+    struct arena arena;
+};
+
+/* main loop instrumentation, printed when the receiver exits */
+struct receiver_stats {
+    uint64_t iterations;
+    uint64_t busy_max_us;        /* longest time spent away from epoll_wait() */
+
+    /* iterations that destroyed a session or reaped a child */
+    bool teardown_pending;
+    uint64_t teardown_count;
+    uint64_t teardown_max_us;
+    uint64_t teardown_total_us;
+
+    /* wth_connection_flush() calls */
+    uint64_t flush_calls;
+    uint64_t flush_iter;         /* in the current iteration */
+    uint64_t flush_max_iter;
+    uint64_t flush_eagain;
+
+    /* clients that ran out of read budget and were queued for a turn */
+    uint64_t budget_requeues;
+
+    /* epoll_wait() or io_uring_enter() calls and the events they returned */
+    uint64_t waits;
+    uint64_t events;
+
+    uint64_t timer_wakeups;
+    uint64_t timers_fired;
+
+    /* admission control */
+    uint64_t accepted;
+    uint64_t rejected_full;
+    uint64_t rejected_rate;
+    uint64_t accept_batch_max;   /* most connections accepted in one go */
+
+    /* input events sent over the input lane instead of Waltham */
+    uint64_t lane_events;
+
+    /* output watermarks */
+    uint64_t congestion_events;  /* clients going over the high watermark */
+    uint64_t coalesced_events;   /* motion events merged into a later one */
+
+    /* busy-poll mode: waits that found events while spinning, and those
+     * that gave up and blocked */
+    uint64_t spin_hits;
+    uint64_t spin_misses;
+
+    /* blob buffers copied in, and commits handed over to a session */
+    uint64_t blob_bytes;
+    uint64_t blob_frames;
+    uint64_t blob_dropped;       /* committed with no session to show them */
+    uint64_t blob_frame_bytes;   /* pixels of the frames handed over */
+    uint64_t blob_damaged_bytes; /* the part of them that changed */
+
+    /* frame callbacks done once shown by a session worker, and those
+     * paced by a timer for lack of one */
+    uint64_t frames_shown;
+    uint64_t frames_unpaced;
 };
 
-/* receiver structure */
+enum receiver_backend {
+    RECEIVER_BACKEND_EPOLL,
+    RECEIVER_BACKEND_IO_URING,
+};
+
+/*
+ * receiver structure, one per reactor. A reactor owns its listening socket,
+ * epoll instance and every client it accepted, clients never move between
+ * reactors.
+ */
 struct receiver {
-    int listen_fd;
+    unsigned int index;
+    pthread_t thread;
+
+    int listen_fd;              /* TCP, -1 with --no-tcp */
     struct watch listen_watch;
+    int unix_fd;                /* AF_UNIX, reactor 0 only, -1 if unused */
+    struct watch unix_watch;
+    struct watch quit_watch;    /* shared eventfd, written on SIGINT */
 
     bool running;
     int epoll_fd;
+    struct uring *uring;        /* NULL with the epoll backend */
+    struct timer_wheel *timers;
+    unsigned int spin_us;       /* busy-poll mode, current spin budget */
 
     struct wl_list client_list; /* struct client::link */
+    struct wl_list dirty_list;  /* struct client::dirty_link, output queued */
+    struct wl_list ready_list;  /* struct client::ready_link, input left */
+
+    /* events batch being handled, see watch_ctl() */
+    struct epoll_event *batch;
+    int batch_count;
+    struct wl_list session_table; /* struct session::table_link */
+    unsigned int unwatched_children; /* forked workers without a pidfd */
+    struct wl_list pool_list;   /* struct session::link, idle workers */
+    unsigned int pool_count;
+    struct wl_list parked_list; /* struct session::link, see session_park() */
+
+    struct admission_bucket *admission; /* NULL without a rate limit */
+
+    struct receiver_stats stats;
 };
 
 struct shm_buffer {
@@ -264,23 +441,43 @@ struct window {
 	struct pointer *receiver_pointer;
 	bool ready;
 	uint32_t id_ivisurf;
+
+	int session_fd;		/* worker end of the session channel */
+	bool running;
 };
 
 /**
 * receiver_accept_client
 *
-* Accepts new waltham client connection and instantiates client structure
+* Accepts the pending waltham client connections, up to the accept batch,
+* and instantiates client structures for those passing admission control
+*
+* @param names        struct receiver *srv, int fd
+* @param value        socket connection info and client data, listening socket
+*                     (TCP or AF_UNIX) to accept from
+* @return             none
+*/
+void receiver_accept_client(struct receiver *srv, int fd);
+
+/**
+* receiver_adopt_client
+*
+* Instantiates a client for a connection that was already accepted, if it
+* passes admission control
 *
 * @param names        struct receiver *srv
-* @param value        socket connection info and client data
+*                     int fd
+* @param value        reactor the connection was accepted on
+*                     socket of the connection, owned by the client from now on
 * @return             none
 */
-void receiver_accept_client(struct receiver *srv);
+void receiver_adopt_client(struct receiver *srv, int fd);
 
 /**
 * receiver_flush_clients
 *
-* write all the pending requests from the clients to socket
+* write the pending requests of the clients marked dirty to socket. Clients
+* whose socket is backlogged are left to their EPOLLOUT handler.
 *
 * @param names        struct receiver *srv
 * @param value        socket connection info and client data
@@ -288,6 +485,49 @@ void receiver_accept_client(struct receiver *srv);
 */
 void receiver_flush_clients(struct receiver *srv);
 
+/**
+* receiver_service_ready
+*
+* Gives every client that ran out of read budget one more turn
+*
+* @param names        struct receiver *srv
+* @param value        socket connection info and client data
+* @return             none
+*/
+void receiver_service_ready(struct receiver *srv);
+
+/**
+* client_mark_dirty
+*
+* Queues the client for the next receiver_flush_clients(). Must be called
+* by anything that sends Waltham messages outside of dispatching the
+* client's own requests.
+*
+* @param names        struct client *c
+* @param value        client that has output queued
+* @return             none
+*/
+void client_mark_dirty(struct client *c);
+
+/* libwaltham does not tell how much it has queued: a message is a header
+ * of two words and a word per argument, strings and arrays aside */
+#define CLIENT_MSG_BYTES(nargs) (8 + 4 * (nargs))
+
+/**
+* client_account_output
+*
+* Adds to the output the client has queued, flags the client congested
+* when that goes over the high watermark. Congestion clears once a flush
+* gets everything out.
+*
+* @param names        struct client *c
+*                     size_t bytes
+* @param value        client a message was sent to
+*                     size of the message, see CLIENT_MSG_BYTES()
+* @return             none
+*/
+void client_account_output(struct client *c, size_t bytes);
+
 /**
 * client_destroy
 *
@@ -302,8 +542,38 @@ void client_destroy(struct client *c);
 void
 client_post_out_of_memory(struct client *c);
 
+/**
+* watch_ctl
+*
+* Adds, modifies or removes a watch from the receiver's epoll set
+*
+* @param names        struct watch *w
+*                     int op
+*                     uint32_t events
+* @param value        w      - watch, its receiver owns the epoll set
+*                     op     - EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+*                     events - epoll events to wait for
+* @return             0 on success, -1 on error
+*/
+int
+watch_ctl(struct watch *w, int op, uint32_t events);
+
+/**
+* wth_receiver_weston_main
+*
+* Runs a streaming session worker: connects to the local compositor and
+* brings the gstreamer pipeline to PAUSED, then waits on the session channel
+* for a surface to show. Once started it creates the window, plays the
+* pipeline and forwards input over the session channel until told to stop.
+*
+* @param names        int session_fd
+*                     int port
+* @param value        session_fd - worker end of the session channel
+*                     port       - UDP port to prepare the pipeline for
+* @return             0 on success, -1 on error
+*/
 int
-wth_receiver_weston_main(struct window *window, const char *app_id, int port);
+wth_receiver_weston_main(int session_fd, int port);
 
 
 #endif
@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : RTP ingest. Replaces udpsrc in the session pipelines with an  **
+**  appsrc fed by a thread that reads the RTP socket in batches with          **
+**  recvmmsg(), lets the kernel coalesce datagrams with UDP_GRO and grows     **
+**  the receive buffer when the kernel reports drops.                         **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_INGEST_H_
+#define WTH_SERVER_WALTHAM_INGEST_H_
+
+#include <stdbool.h>
+
+#include <gst/gst.h>
+
+struct rtp_ingest;
+
+struct rtp_ingest_config {
+    int port;                     /* UDP port the RTP stream arrives on */
+    bool timestamps;              /* stamp the packets with their kernel
+                                     receive time, see wth-receiver-latency.h */
+    const char *group;            /* IPv4 multicast group to join, or NULL */
+    const char *iface;            /* interface to join it on, NULL for the
+                                     one the kernel picks */
+    unsigned int busy_poll;       /* us to spin before sleeping, 0 for off */
+};
+
+/**
+* rtp_ingest_create
+*
+* Binds the RTP port and starts pushing what arrives on it into an appsrc
+*
+* @param names        GstElement *appsrc
+*                     const struct rtp_ingest_config *config
+* @param value        appsrc of the session pipeline, a reference is taken
+*                     where the stream comes from, the strings are not
+*                     copied
+* @return             the ingest, or NULL on error
+*/
+struct rtp_ingest *
+rtp_ingest_create(GstElement *appsrc, const struct rtp_ingest_config *config);
+
+/**
+* rtp_ingest_destroy
+*
+* Stops the ingest thread, closes the socket and prints what the ingest
+* went through
+*
+* @param names        struct rtp_ingest *ingest
+* @param value        ingest to destroy, may be NULL
+* @return             none
+*/
+void
+rtp_ingest_destroy(struct rtp_ingest *ingest);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Input fast lane. A transmitter that registers on the input    **
+**  port gets its seat events as UDP datagrams marked with their own socket   **
+**  priority, instead of behind everything else on the Waltham connection.    **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_INPUT_LANE_H_
+#define WTH_SERVER_WALTHAM_INPUT_LANE_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+struct receiver;
+struct client;
+struct session_msg;
+
+#define INPUT_LANE_MAGIC	0x57494c31	/* "WIL1" */
+#define INPUT_LANE_HELLO	0xffffffff
+
+/* a lane is forgotten when the transmitter stops saying hello */
+#define INPUT_LANE_TIMEOUT_MS	10000
+
+/*
+ * Wire format, every field in network byte order. The transmitter
+ * registers, and keeps its lane alive, by sending a header with type
+ * INPUT_LANE_HELLO from the port it wants the events on; the hello is
+ * echoed back. Events follow with the type of the session message, the
+ * input fields, and the app_id of the surface they are for. seq lets the
+ * transmitter notice lost events, e.g. to cancel touch sequences.
+ */
+struct input_lane_msg {
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t type;          /* enum session_msg_type or INPUT_LANE_HELLO */
+    uint32_t serial;
+    uint32_t time;
+    int32_t id;
+    uint32_t button;
+    uint32_t state;
+    int32_t x;              /* wl_fixed_t */
+    int32_t y;
+    uint32_t app_id_len;    /* bytes of app_id after the header */
+};
+
+/* what a client knows about the lane of its transmitter */
+struct input_lane_ref {
+    unsigned int generation;      /* of the lane table when looked up */
+    int slot;                     /* -1 without a lane */
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t expires_ms;
+};
+
+/**
+* input_lane_init
+*
+* Opens the input lane socket on the given reactor, which then handles
+* registrations. Events are sent from whichever reactor relays them.
+*
+* @param names        struct receiver *srv
+*                     uint16_t port
+*                     int tos
+*                     int priority
+* @param value        reactor handling the registrations
+*                     UDP port transmitters register on
+*                     IP_TOS of the events
+*                     SO_PRIORITY of the events
+* @return             0 on success, -1 on error
+*/
+int
+input_lane_init(struct receiver *srv, uint16_t port, int tos, int priority);
+
+void
+input_lane_fini(struct receiver *srv);
+
+/**
+* input_lane_send
+*
+* Sends an input event over the lane of the client's transmitter
+*
+* @param names        struct client *c
+*                     const char *app_id
+*                     const struct session_msg *msg
+* @param value        client the event is for
+*                     app_id of the surface the event is for
+*                     input event relayed by a session
+* @return             0 when sent, -1 when the event has to go over the
+*                     Waltham connection instead
+*/
+int
+input_lane_send(struct client *c, const char *app_id,
+		const struct session_msg *msg);
+
+#endif
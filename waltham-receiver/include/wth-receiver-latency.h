@@ -0,0 +1,106 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Latency accounting of the session pipelines. Every stage      **
+**  stamps the buffers going through it with a reference timestamp meta,     **
+**  which the depayloader and the decoder carry over to the frames they      **
+**  output; the sink adds up the time spent between stamps per frame.        **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_LATENCY_H_
+#define WTH_SERVER_WALTHAM_LATENCY_H_
+
+#include <stdint.h>
+
+#include <gst/gst.h>
+
+/* the pipelines name their elements after these */
+#define LATENCY_ELEMENT_SRC	"src"
+#define LATENCY_ELEMENT_DEPAY	"depay"
+#define LATENCY_ELEMENT_DECODER	"dec"
+#define LATENCY_ELEMENT_SINK	"sink"
+
+enum latency_stamp {
+    LATENCY_STAMP_RX,           /* kernel receive time, RTP ingest only */
+    LATENCY_STAMP_SRC,          /* pushed by the source element */
+    LATENCY_STAMP_DEPAY,        /* out of the jitter buffer */
+    LATENCY_STAMP_DECODE,       /* frame out of the depayloader */
+    LATENCY_STAMP_SINK,         /* decoded frame at the sink */
+    LATENCY_STAMP_COUNT,
+};
+
+struct latency_probe;
+
+/**
+* latency_stamp_buffer
+*
+* Attaches a timestamp to a buffer for the sink to find
+*
+* @param names        GstBuffer *buffer
+*                     enum latency_stamp stamp
+*                     uint64_t ns
+* @param value        writable buffer
+*                     stage the buffer went through
+*                     when, CLOCK_MONOTONIC
+* @return             none
+*/
+void
+latency_stamp_buffer(GstBuffer *buffer, enum latency_stamp stamp, uint64_t ns);
+
+/**
+* latency_probe_attach
+*
+* Adds the pad probes stamping and accounting buffers to the elements of a
+* session pipeline named after LATENCY_ELEMENT_*
+*
+* @param names        GstElement *pipeline
+* @param value        session pipeline
+* @return             the probe, or NULL if an element is missing
+*/
+struct latency_probe *
+latency_probe_attach(GstElement *pipeline);
+
+/**
+* latency_probe_detach
+*
+* Prints the latency of the frames shown since the last report and frees
+* the probe. The pipeline must no longer be streaming.
+*
+* @param names        struct latency_probe *probe
+* @param value        probe to free, may be NULL
+* @return             none
+*/
+void
+latency_probe_detach(struct latency_probe *probe);
+
+#endif
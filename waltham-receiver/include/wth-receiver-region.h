@@ -0,0 +1,190 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Rectangle sets for the wthp_region objects and the opaque and **
+**  input regions of the surfaces. The rectangles are kept in y-x bands, as  **
+**  pixman does, so that every operation is a single sweep over both sets.   **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_REGION_H_
+#define WTH_SERVER_WALTHAM_REGION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* x2 and y2 are excluded */
+struct region_box {
+    int32_t x1, y1;
+    int32_t x2, y2;
+};
+
+/*
+ * The boxes are sorted by y1 then x1. Boxes with the same y1 make up a band
+ * and all have the same y2, bands do not overlap, the boxes of a band
+ * neither overlap nor touch, and two adjacent bands never have the same x
+ * spans. Any area has a single representation, which is also the one with
+ * the fewest bands.
+ */
+struct region_set {
+    struct region_box extents;    /* all zero when empty */
+    struct region_box *boxes;
+    uint32_t count;
+    uint32_t size;                /* allocated boxes */
+};
+
+void
+region_set_init(struct region_set *set);
+
+void
+region_set_fini(struct region_set *set);
+
+/**
+* region_set_clear
+*
+* Empties a set, keeping its memory around
+*
+* @param names        struct region_set *set
+* @param value        set to empty
+* @return             none
+*/
+void
+region_set_clear(struct region_set *set);
+
+int
+region_set_copy(struct region_set *dst, const struct region_set *src);
+
+/**
+* region_set_union
+*
+* Stores the union of two sets. The destination may be one of the sources,
+* it is left as it was on error.
+*
+* @param names        struct region_set *dst
+*                     const struct region_set *a
+*                     const struct region_set *b
+* @param value        set receiving the result
+*                     first operand
+*                     second operand
+* @return             0 on success, -1 when out of memory
+*/
+int
+region_set_union(struct region_set *dst, const struct region_set *a,
+		 const struct region_set *b);
+
+/**
+* region_set_intersect
+*
+* Stores the intersection of two sets, as region_set_union()
+*
+* @param names        struct region_set *dst
+*                     const struct region_set *a
+*                     const struct region_set *b
+* @param value        set receiving the result
+*                     first operand
+*                     second operand
+* @return             0 on success, -1 when out of memory
+*/
+int
+region_set_intersect(struct region_set *dst, const struct region_set *a,
+		     const struct region_set *b);
+
+/**
+* region_set_subtract
+*
+* Stores what is in a but not in b, as region_set_union()
+*
+* @param names        struct region_set *dst
+*                     const struct region_set *a
+*                     const struct region_set *b
+* @param value        set receiving the result
+*                     set to subtract from
+*                     set to subtract
+* @return             0 on success, -1 when out of memory
+*/
+int
+region_set_subtract(struct region_set *dst, const struct region_set *a,
+		    const struct region_set *b);
+
+/**
+* region_set_union_rect
+*
+* Adds a rectangle to a set. Empty rectangles are ignored, the ones going
+* past the coordinate range are clipped to it.
+*
+* @param names        struct region_set *set
+*                     int32_t x
+*                     int32_t y
+*                     int32_t width
+*                     int32_t height
+* @param value        set to add to
+*                     left edge of the rectangle
+*                     top edge of the rectangle
+*                     width of the rectangle
+*                     height of the rectangle
+* @return             0 on success, -1 when out of memory
+*/
+int
+region_set_union_rect(struct region_set *set, int32_t x, int32_t y,
+		      int32_t width, int32_t height);
+
+int
+region_set_subtract_rect(struct region_set *set, int32_t x, int32_t y,
+			 int32_t width, int32_t height);
+
+/**
+* region_set_translate
+*
+* Moves a set. Boxes pushed past the coordinate range are clipped to it,
+* those pushed out of it entirely are dropped.
+*
+* @param names        struct region_set *set
+*                     int32_t dx
+*                     int32_t dy
+* @param value        set to move
+*                     horizontal offset
+*                     vertical offset
+* @return             none
+*/
+void
+region_set_translate(struct region_set *set, int32_t dx, int32_t dy);
+
+bool
+region_set_contains_point(const struct region_set *set, int32_t x, int32_t y);
+
+static inline bool
+region_set_is_empty(const struct region_set *set)
+{
+    return set->count == 0;
+}
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Link latency of every transmitter. Waltham has no request     **
+**  the receiver could ping a transmitter with, so the round trip time is     **
+**  sampled from the kernel's TCP state on a timer, and kept over a window    **
+**  of the latest samples.                                                    **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_RTT_H_
+#define WTH_SERVER_WALTHAM_RTT_H_
+
+#include <stdint.h>
+
+#include "wth-receiver-timer.h"
+
+#define RTT_WINDOW 64
+
+struct client;
+
+struct rtt_probe {
+    struct client *client;
+    struct timer timer;
+
+    uint32_t samples[RTT_WINDOW]; /* us, ring of the latest samples */
+    uint64_t count;               /* samples taken in total */
+};
+
+/**
+* rtt_probe_start
+*
+* Starts sampling the round trip time of a TCP client every
+* rtt_probe_interval ms, if probing is enabled
+*
+* @param names        struct rtt_probe *probe
+*                     struct client *c
+* @param value        probe embedded in the client
+*                     client to probe
+* @return             none
+*/
+void
+rtt_probe_start(struct rtt_probe *probe, struct client *c);
+
+/**
+* rtt_probe_stop
+*
+* Stops sampling and prints the figures of the current window
+*
+* @param names        struct rtt_probe *probe
+* @param value        probe to stop, it is fine if it was never started
+* @return             none
+*/
+void
+rtt_probe_stop(struct rtt_probe *probe);
+
+#endif
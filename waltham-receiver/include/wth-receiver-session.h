@@ -0,0 +1,391 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : A session is the streaming side of one ivi surface: a local   **
+**  wayland surface plus the gstreamer pipeline feeding it. It runs either in **
+**  a forked child or in a thread of the receiver and talks to the receiver   **
+**  only through the session channel, never through the Waltham connection.  **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_SESSION_H_
+#define WTH_SERVER_WALTHAM_SESSION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <wayland-client.h>
+
+struct client;
+struct surface;
+struct receiver;
+struct buffer;
+
+enum session_mode {
+    SESSION_MODE_FORK,      /* one child process per ivi surface */
+    SESSION_MODE_THREAD,    /* one thread of the receiver per ivi surface */
+};
+
+/* when to replace workers taken out of the pre-warmed pool */
+enum session_pool_refill {
+    SESSION_POOL_REFILL_EAGER,  /* right away, when a surface takes one */
+    SESSION_POOL_REFILL_LAZY,   /* once a session has been torn down */
+    SESSION_POOL_REFILL_NONE,   /* never, the pool only covers startup */
+};
+
+/*
+ * lifecycle of a session, from the receiver's point of view:
+ * STARTING until the worker reports SESSION_MSG_STARTED, RUNNING until the
+ * surface goes away, DRAINING until the worker is gone (child reaped, or
+ * thread closed its end of the channel), then DEAD.
+ */
+enum session_state {
+    SESSION_STATE_STARTING,
+    SESSION_STATE_RUNNING,
+    SESSION_STATE_DRAINING,
+    SESSION_STATE_DEAD,
+    SESSION_STATE_COUNT,
+};
+
+/* worker startup stages, reported in SESSION_MSG_READY/STARTED */
+enum session_stage {
+    SESSION_STAGE_GST_INIT,
+    SESSION_STAGE_DISPLAY,
+    SESSION_STAGE_PIPELINE,
+    SESSION_STAGE_PAUSED,
+    SESSION_STAGE_WINDOW,
+    SESSION_STAGE_PLAYING,
+    SESSION_STAGE_COUNT,
+};
+
+#define SESSION_APP_ID_MAX 256
+#define SESSION_TOUCH_SLOTS 10
+
+enum session_region {
+    SESSION_REGION_OPAQUE,
+    SESSION_REGION_INPUT,
+    SESSION_REGION_COUNT,
+};
+
+/*
+ * A region goes over in as many SESSION_MSG_REGION as it takes, the first
+ * one resets it and the last one completes it. Past SESSION_REGION_MAX_BOXES
+ * a region is approximated, see session_set_region().
+ */
+#define SESSION_REGION_BOXES     16
+#define SESSION_REGION_MAX_BOXES 256
+
+#define SESSION_REGION_FIRST     (1 << 0)
+#define SESSION_REGION_LAST      (1 << 1)
+#define SESSION_REGION_INFINITE  (1 << 2) /* region unset, no boxes */
+
+/* messages carried over the session channel */
+enum session_msg_type {
+    /* receiver -> session */
+    SESSION_MSG_START,
+    SESSION_MSG_STOP,
+    SESSION_MSG_RESUME,    /* a reconnected transmitter took the surface over */
+    SESSION_MSG_BUFFER,    /* blob pixels to show, comes with a file */
+    SESSION_MSG_REGION,    /* opaque or input region, for the next BUFFER */
+    SESSION_MSG_FRAME,     /* frame callbacks were committed */
+
+    /* session -> receiver, worker lifecycle */
+    SESSION_MSG_READY,
+    SESSION_MSG_STARTED,
+    SESSION_MSG_RESUMED,   /* first frame shown after SESSION_MSG_RESUME */
+    SESSION_MSG_FRAME_DONE, /* commits up to frame.seq have been shown */
+
+    /* session -> receiver, input from the local compositor */
+    SESSION_MSG_POINTER_ENTER,
+    SESSION_MSG_POINTER_LEAVE,
+    SESSION_MSG_POINTER_MOTION,
+    SESSION_MSG_POINTER_BUTTON,
+    SESSION_MSG_POINTER_AXIS,
+    SESSION_MSG_TOUCH_DOWN,
+    SESSION_MSG_TOUCH_UP,
+    SESSION_MSG_TOUCH_MOTION,
+    SESSION_MSG_TOUCH_FRAME,
+    SESSION_MSG_TOUCH_CANCEL,
+};
+
+struct session_msg {
+    uint32_t type; /* enum session_msg_type */
+    union {
+        struct {
+            uint32_t serial;
+            uint32_t time;
+            int32_t id;        /* touch point */
+            uint32_t button;   /* button, or axis for POINTER_AXIS */
+            uint32_t state;
+            wl_fixed_t x;      /* also the axis value */
+            wl_fixed_t y;
+        } input;
+        struct {
+            char app_id[SESSION_APP_ID_MAX];
+            int32_t port;
+        } start;
+        struct {
+            uint32_t stage_us[SESSION_STAGE_COUNT];
+        } timings;
+        struct {
+            int32_t width;
+            int32_t height;
+            int32_t stride;
+            uint32_t format;   /* enum wl_shm_format */
+            uint32_t size;     /* of the file, at least stride * height */
+            struct blob_damage damage; /* what changed since the last one */
+        } buffer;
+        struct {
+            uint32_t kind;     /* enum session_region */
+            uint32_t flags;    /* SESSION_REGION_* */
+            uint32_t count;
+            struct region_box boxes[SESSION_REGION_BOXES]; /* buffer
+                                                              coordinates */
+        } region;
+        struct {
+            uint32_t seq;      /* struct surface::frame_seq */
+            uint32_t buffer;   /* FRAME: comes with the next BUFFER */
+            uint32_t time;     /* FRAME_DONE: of the local wl_callback.done */
+        } frame;
+    };
+};
+
+/* a motion event held back while the client is congested */
+struct session_motion {
+    uint32_t time;
+    int32_t id;            /* touch point */
+    wl_fixed_t x;
+    wl_fixed_t y;
+};
+
+/*
+ * receiver side of a streaming session. Sessions waiting in the pre-warmed
+ * pool have no client nor surface yet, draining ones no longer have any,
+ * parked ones wait for their transmitter to reconnect.
+ * Every session is in the session table of its reactor until its worker
+ * is gone: a surface finds its session through its ivisurface, a child
+ * exit lands on its session through the pidfd watch.
+ */
+struct session {
+    struct receiver *receiver;
+    struct client *client;
+    struct surface *surface;
+    struct wl_list link; /* struct client::session_list or
+                            struct receiver::pool_list */
+    struct wl_list table_link; /* struct receiver::session_table */
+
+    enum session_state state;
+    enum session_mode mode;
+    pid_t pid;             /* SESSION_MODE_FORK only */
+    struct watch pid_watch; /* pidfd, fd is -1 without pidfd support */
+    bool reaped;
+    pthread_t thread;      /* SESSION_MODE_THREAD only */
+
+    int fd;                /* receiver end of the session channel */
+    struct watch watch;
+
+    bool warm;             /* worker reported SESSION_MSG_READY */
+    uint64_t start_us;     /* when the surface was handed over */
+
+    /* resuming after the transmitter reconnected */
+    char app_id[SESSION_APP_ID_MAX];
+    struct sockaddr_storage peer; /* transmitter, only the address counts */
+    bool parked;           /* on struct receiver::parked_list */
+    struct timer park_timer;
+    uint64_t resume_us;    /* when the transmitter reconnected */
+
+    /* latest motion, sent once the client is no longer congested or
+     * before any other input event */
+    bool pointer_held;
+    struct session_motion held_pointer;
+    unsigned int touch_held;
+    struct session_motion held_touch[SESSION_TOUCH_SLOTS];
+    bool frame_held;       /* the held touch motions were framed */
+};
+
+/**
+* session_create
+*
+* Starts streaming for an ivi surface, in a child process or a thread
+* depending on the configured session mode. A session parked by the same
+* transmitter for the same app_id is resumed if there is one, otherwise a
+* pre-warmed worker from the pool is used, or a new worker is spawned.
+*
+* @param names        struct surface *surface
+*                     const char *app_id
+*                     int port
+* @param value        surface - waltham surface the stream is shown for
+*                     app_id  - app_id to set on the local toplevel
+*                     port    - UDP port the RTP stream arrives on
+* @return             the session, or NULL on failure
+*/
+struct session *
+session_create(struct surface *surface, const char *app_id, int port);
+
+/**
+* session_destroy
+*
+* Detaches the session from its surface and asks the worker to stop. The
+* worker tears down its pipeline and window on its own, the session stays
+* in the table, draining, until the worker is gone.
+*
+* @param names        struct session *session
+* @param value        session to destroy
+* @return             none
+*/
+void
+session_destroy(struct session *session);
+
+/**
+* session_park
+*
+* Keeps the session of a transmitter that went away running, window and
+* pipeline included, for the resume grace period. A reconnecting
+* transmitter creating a surface with the same app_id takes it over,
+* otherwise it is stopped once the period is over.
+*
+* @param names        struct session *session
+* @param value        session of a client being destroyed
+* @return             none
+*/
+void
+session_park(struct session *session);
+
+/**
+* session_release_input
+*
+* Sends the motion events held back while the client was congested
+*
+* @param names        struct session *session
+* @param value        session attached to a client
+* @return             none
+*/
+void
+session_release_input(struct session *session);
+
+/**
+* session_present
+*
+* Hands the pixels of a blob buffer over to the worker, which shows them
+* on its window in place of the stream. The worker gets its own reference
+* to the file holding them, the buffer may go away right after.
+*
+* @param names        struct session *session
+*                     struct buffer *buffer
+*                     const struct blob_damage *damage
+* @param value        session of the surface the buffer was committed to
+*                     blob buffer to show
+*                     part of it that changed, clipped to the buffer
+* @return             0 on success, -1 if the worker cannot show it
+*/
+int
+session_present(struct session *session, struct buffer *buffer,
+		const struct blob_damage *damage);
+
+/**
+* session_set_region
+*
+* Hands the opaque or input region of the surface over to the worker,
+* which sets it on its window along with the next blob buffer. An opaque
+* region with too many boxes is cut short and an input region replaced by
+* its extents, both stay correct, only less precise.
+*
+* @param names        struct session *session
+*                     enum session_region kind
+*                     const struct region_set *set
+*                     int32_t scale
+* @param value        session of the surface the region was committed to
+*                     which region of the surface it is
+*                     the region in surface coordinates, NULL when unset
+*                     buffer scale of the surface
+* @return             0 on success, -1 if the worker cannot get it
+*/
+int
+session_set_region(struct session *session, enum session_region kind,
+		   const struct region_set *set, int32_t scale);
+
+/**
+* session_request_frame
+*
+* Asks the worker to report when a commit with frame callbacks is shown.
+* A commit with a blob buffer is shown along with it, otherwise the worker
+* commits on its own. Reports are batched: one for a commit also covers
+* the earlier ones.
+*
+* @param names        struct session *session
+*                     uint32_t seq
+*                     bool with_buffer
+* @param value        session of the surface committed to
+*                     sequence number of the commit
+*                     whether session_present() follows for that commit
+* @return             0 on success, -1 if the worker cannot get it
+*/
+int
+session_request_frame(struct session *session, uint32_t seq, bool with_buffer);
+
+void
+session_reap_children(struct receiver *srv);
+
+void
+session_pool_fill(struct receiver *srv);
+
+/**
+* session_table_release
+*
+* Stops the idle workers and forgets about every session on shutdown,
+* without waiting for the workers
+*
+* @param names        struct receiver *srv
+* @param value        receiver owning the sessions
+* @return             none
+*/
+void
+session_table_release(struct receiver *srv);
+
+/* used by the worker side to talk back to the receiver */
+int
+session_msg_send(int fd, const struct session_msg *msg);
+
+int
+session_msg_recv(int fd, struct session_msg *msg);
+
+/* as above, passfd gets the file sent along with the message, or -1 */
+int
+session_msg_recv_fd(int fd, struct session_msg *msg, int *passfd, int flags);
+
+void
+session_stage_done(struct session_msg *msg, enum session_stage stage,
+		   uint64_t *since);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Socket options of the Waltham connections. Buffer sizes,      **
+**  user timeout and unsent data threshold are set on the listening socket    **
+**  and inherited by accepted connections, the Nagle and delayed ACK          **
+**  settings are applied to every connection.                                 **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_SOCKET_H_
+#define WTH_SERVER_WALTHAM_SOCKET_H_
+
+#include <stdbool.h>
+
+struct socket_profile {
+    bool nodelay;                 /* TCP_NODELAY, no Nagle on small messages */
+    bool quickack;                /* TCP_QUICKACK, re-armed after every read */
+    int sndbuf;                   /* SO_SNDBUF bytes, 0 for the kernel default */
+    int rcvbuf;                   /* SO_RCVBUF bytes, 0 for the kernel default */
+    unsigned int user_timeout;    /* TCP_USER_TIMEOUT ms, 0 for the default */
+    unsigned int notsent_lowat;   /* TCP_NOTSENT_LOWAT bytes, 0 for the default */
+    unsigned int fastopen;        /* TCP_FASTOPEN queue length, 0 for off */
+};
+
+/**
+* socket_profile_parse
+*
+* Parses a comma separated list of key=value settings into a profile.
+* Keys are nodelay, quickack, sndbuf, rcvbuf, user-timeout, notsent-lowat
+* and fastopen.
+*
+* @param names        struct socket_profile *profile
+*                     char *opts
+* @param value        profile to update, keys not listed are left alone
+*                     settings, modified while parsing
+* @return             0 on success, -1 on an unknown key or a bad value
+*/
+int
+socket_profile_parse(struct socket_profile *profile, char *opts);
+
+/**
+* socket_profile_apply_listen
+*
+* Sets the inherited options on a TCP listening socket, before listen() so
+* that the receive buffer size is taken into account for window scaling
+*
+* @param names        const struct socket_profile *profile
+*                     int fd
+* @param value        profile to apply
+*                     listening socket
+* @return             0 on success, -1 on error
+*/
+int
+socket_profile_apply_listen(const struct socket_profile *profile, int fd);
+
+/**
+* socket_profile_apply_client
+*
+* Sets the per connection options on an accepted TCP socket
+*
+* @param names        const struct socket_profile *profile
+*                     int fd
+* @param value        profile to apply
+*                     accepted socket
+* @return             none
+*/
+void
+socket_profile_apply_client(const struct socket_profile *profile, int fd);
+
+/* TCP_QUICKACK is cleared by the kernel, it has to be set again after reads */
+void
+socket_profile_rearm_quickack(int fd);
+
+/**
+* socket_set_busy_poll
+*
+* Lets reads on the socket busy poll the device queue for up to usecs
+* instead of waiting for an interrupt, and asks the kernel to keep device
+* interrupts off while the socket is being polled. Nothing is logged, going
+* over net.core.busy_read needs CAP_NET_ADMIN.
+*
+* @param names        int fd
+*                     unsigned int usecs
+* @param value        TCP or UDP socket
+*                     busy poll time
+* @return             0 on success, -1 if the kernel refused either option
+*/
+int
+socket_set_busy_poll(int fd, unsigned int usecs);
+
+/**
+* socket_profile_report
+*
+* Prints the profile along with the buffer sizes the kernel actually
+* granted on a socket it was applied to
+*
+* @param names        const struct socket_profile *profile
+*                     int fd
+* @param value        profile to report
+*                     socket to read the effective sizes from, or -1
+* @return             none
+*/
+void
+socket_profile_report(const struct socket_profile *profile, int fd);
+
+#endif
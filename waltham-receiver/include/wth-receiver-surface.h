@@ -38,6 +38,23 @@ compositor_destroy(struct compositor *comp);
 void
 surface_destroy(struct surface *surface);
 
+/**
+* surface_frame_done
+*
+* Sends done to the frame callbacks of every commit up to the one the
+* session worker saw shown
+*
+* @param names        struct surface *surface
+*                     uint32_t seq
+*                     uint32_t time
+* @param value        surface the commits were made to
+*                     sequence number of the last commit shown
+*                     timestamp of the local frame callback, in ms
+* @return             none
+*/
+void
+surface_frame_done(struct surface *surface, uint32_t seq, uint32_t time);
+
 void
 client_bind_compositor(struct client *c, struct wthp_compositor *obj);
 
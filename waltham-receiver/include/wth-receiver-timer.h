@@ -0,0 +1,131 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Timers of a reactor. They are kept in a hierarchical timer    **
+**  wheel with a millisecond tick, driven by a single timerfd watched from    **
+**  the main loop, which is only programmed for the earliest expiry.          **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_TIMER_H_
+#define WTH_SERVER_WALTHAM_TIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <wayland-client.h>
+
+struct receiver;
+struct timer_wheel;
+
+/*
+ * A timer is embedded in the object it belongs to, the callback gets back
+ * to that object with container_of(), as for struct watch.
+ */
+struct timer {
+    struct timer_wheel *wheel;
+    struct wl_list link;          /* slot of the wheel */
+    void (*cb)(struct timer *t);
+
+    uint64_t expires;             /* ms, CLOCK_MONOTONIC */
+    uint32_t period;              /* ms, 0 for one-shot timers */
+    int level;                    /* wheel level + 1, 0 when not armed */
+};
+
+/**
+* timer_wheel_create
+*
+* Sets up the timer wheel of a reactor and adds its timerfd to the main loop
+*
+* @param names        struct receiver *srv
+* @param value        reactor the timers run on
+* @return             0 on success, -1 on error
+*/
+int
+timer_wheel_create(struct receiver *srv);
+
+void
+timer_wheel_destroy(struct receiver *srv);
+
+/**
+* timer_init
+*
+* Prepares a timer, it does not fire before being armed
+*
+* @param names        struct timer *t
+*                     struct receiver *srv
+*                     void (*cb)(struct timer *t)
+* @param value        timer to set up
+*                     reactor the timer runs on
+*                     called from the main loop when the timer fires
+* @return             none
+*/
+void
+timer_init(struct timer *t, struct receiver *srv, void (*cb)(struct timer *t));
+
+/**
+* timer_arm
+*
+* (Re)arms a timer. Periodic timers are re-armed before their callback
+* runs, so the callback may cancel them.
+*
+* @param names        struct timer *t
+*                     uint32_t delay
+*                     uint32_t period
+* @param value        timer to arm
+*                     ms until the timer first fires
+*                     ms between subsequent expiries, 0 for a one-shot
+* @return             none
+*/
+void
+timer_arm(struct timer *t, uint32_t delay, uint32_t period);
+
+/**
+* timer_cancel
+*
+* Disarms a timer, it is fine to cancel a timer that is not armed, even
+* one that was zero-initialised and never went through timer_init().
+* Timers must be cancelled before the memory holding them is freed.
+*
+* @param names        struct timer *t
+* @param value        timer to disarm
+* @return             none
+*/
+void
+timer_cancel(struct timer *t);
+
+static inline bool
+timer_is_armed(const struct timer *t)
+{
+    return t->level > 0;
+}
+
+#endif
@@ -0,0 +1,118 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : io_uring event backend. Watches are armed as poll requests on **
+**  a ring instead of being added to the epoll instance, and connections are  **
+**  accepted with a multishot accept request. Completions are handed to the   **
+**  main loop as epoll events so the watch callbacks do not change.           **
+**                                                                            **
+*******************************************************************************/
+
+#ifndef WTH_SERVER_WALTHAM_URING_H_
+#define WTH_SERVER_WALTHAM_URING_H_
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+struct receiver;
+struct watch;
+struct uring;
+
+/**
+* uring_create
+*
+* Sets up a ring for a reactor
+*
+* @param names        struct receiver *srv
+*                     unsigned int entries
+* @param value        reactor the ring serves
+*                     size of the submission queue
+* @return             the ring, or NULL if io_uring is not available
+*/
+struct uring *
+uring_create(struct receiver *srv, unsigned int entries);
+
+void
+uring_destroy(struct uring *ring);
+
+/**
+* uring_watch_ctl
+*
+* io_uring counterpart of epoll_ctl() for a watch. Level-triggered watches
+* are armed as one-shot polls and re-armed after their event was handled,
+* EPOLLET watches as multishot polls.
+*
+* @param names        struct uring *ring
+*                     struct watch *w
+*                     int op
+*                     uint32_t events
+* @param value        ring of the watch's reactor
+*                     watch to add, modify or remove
+*                     EPOLL_CTL_ADD, EPOLL_CTL_MOD or EPOLL_CTL_DEL
+*                     epoll events to poll for
+* @return             0 on success, -1 on error
+*/
+int
+uring_watch_ctl(struct uring *ring, struct watch *w, int op, uint32_t events);
+
+/**
+* uring_accept_start
+*
+* Accepts connections on the reactor's listening socket with a multishot
+* accept request, handing each new socket to receiver_adopt_client()
+*
+* @param names        struct uring *ring
+* @param value        ring of the reactor
+* @return             0 on success, -1 on error
+*/
+int
+uring_accept_start(struct uring *ring);
+
+/**
+* uring_wait
+*
+* Submits what was queued, waits for completions and converts them to
+* epoll events for the main loop
+*
+* @param names        struct uring *ring
+*                     struct epoll_event *ee
+*                     int max
+*                     int timeout
+* @param value        ring of the reactor
+*                     events array to fill
+*                     size of the events array
+*                     -1 to block until there is a completion, 0 not to
+* @return             number of events, or -1 on error
+*/
+int
+uring_wait(struct uring *ring, struct epoll_event *ee, int max, int timeout);
+
+#endif
@@ -29,6 +29,7 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <stdlib.h>
 
@@ -52,6 +53,24 @@ os_fd_set_cloexec(int fd)
 	return 0;
 }
 
+int
+os_fd_set_nonblock(int fd)
+{
+	long flags;
+
+	if (fd == -1)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return -1;
+
+	if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+
+	return 0;
+}
+
 static int
 set_cloexec_or_close(int fd)
 {
@@ -131,7 +150,8 @@ create_tmpfile_cloexec(char *tmpname)
  * CLOEXEC. The file is immediately suitable for mmap()'ing
  * the given size at offset zero.
  *
- * The file should not have a permanent backing store like a disk,
+ * With memfd_create() the file lives in memory only. Otherwise it
+ * should not have a permanent backing store like a disk either,
  * but may have if XDG_RUNTIME_DIR is not properly implemented in OS.
  *
  * The file name is deleted from the file system.
@@ -155,6 +175,17 @@ os_create_anonymous_file(off_t size)
 	int fd;
 	int ret;
 
+#ifdef HAVE_MEMFD_CREATE
+	fd = memfd_create("waltham-receiver-shared", MFD_CLOEXEC);
+	if (fd >= 0) {
+		if (ftruncate(fd, size) < 0) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+#endif
+
 	path = getenv("XDG_RUNTIME_DIR");
 	if (!path) {
 		errno = ENOENT;
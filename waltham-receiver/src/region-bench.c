@@ -0,0 +1,191 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Region micro-benchmark. Times the rectangle set operations    **
+**  on sets made of a given number of random rectangles.                      **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "wth-receiver-region.h"
+
+/*
+ * The rectangles are spread over a 4096x4096 area with sizes up to 64x64,
+ * the way window decorations and widgets would be.
+ */
+#define REGION_BENCH_AREA	4096
+#define REGION_BENCH_SIZE	64
+#define REGION_BENCH_ROUNDS	64
+#define DEFAULT_RECTS		1000
+
+static uint64_t
+region_bench_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint32_t
+region_bench_random(uint32_t *seed)
+{
+	/* any fixed sequence will do, runs have to be comparable */
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static int
+region_bench_fill(struct region_set *set, unsigned int rects, uint32_t *seed,
+		  uint64_t *us)
+{
+	uint64_t start = region_bench_now_us();
+	int32_t x, y, w, h;
+	unsigned int i;
+
+	for (i = 0; i < rects; i++) {
+		x = region_bench_random(seed) % REGION_BENCH_AREA;
+		y = region_bench_random(seed) % REGION_BENCH_AREA;
+		w = region_bench_random(seed) % REGION_BENCH_SIZE + 1;
+		h = region_bench_random(seed) % REGION_BENCH_SIZE + 1;
+
+		if (region_set_union_rect(set, x, y, w, h) < 0)
+			return -1;
+	}
+
+	*us = region_bench_now_us() - start;
+	return 0;
+}
+
+static void
+region_bench_report(const char *name, uint64_t us, unsigned int ops,
+		    const struct region_set *result)
+{
+	fprintf(stdout, "  %-12s %10.2f us/op  %8u boxes\n", name,
+		ops ? (double) us / ops : 0.0, result->count);
+}
+
+static int
+region_bench_run(unsigned int rects)
+{
+	struct region_set a, b, out;
+	uint32_t seed = 1;
+	uint64_t start, us;
+	unsigned int i;
+	int ret = -1;
+
+	region_set_init(&a);
+	region_set_init(&b);
+	region_set_init(&out);
+
+	fprintf(stdout, "Region operations on %u rectangles:\n", rects);
+
+	if (region_bench_fill(&a, rects, &seed, &us) < 0)
+		goto out;
+	region_bench_report("add", us, rects, &a);
+	if (region_bench_fill(&b, rects, &seed, &us) < 0)
+		goto out;
+
+	start = region_bench_now_us();
+	for (i = 0; i < REGION_BENCH_ROUNDS; i++)
+		if (region_set_union(&out, &a, &b) < 0)
+			goto out;
+	region_bench_report("union", region_bench_now_us() - start,
+			    REGION_BENCH_ROUNDS, &out);
+
+	start = region_bench_now_us();
+	for (i = 0; i < REGION_BENCH_ROUNDS; i++)
+		if (region_set_intersect(&out, &a, &b) < 0)
+			goto out;
+	region_bench_report("intersect", region_bench_now_us() - start,
+			    REGION_BENCH_ROUNDS, &out);
+
+	start = region_bench_now_us();
+	for (i = 0; i < REGION_BENCH_ROUNDS; i++)
+		if (region_set_subtract(&out, &a, &b) < 0)
+			goto out;
+	region_bench_report("subtract", region_bench_now_us() - start,
+			    REGION_BENCH_ROUNDS, &out);
+
+	/* as set_opaque_region followed by a commit does */
+	start = region_bench_now_us();
+	for (i = 0; i < REGION_BENCH_ROUNDS; i++)
+		if (region_set_copy(&out, &a) < 0)
+			goto out;
+	region_bench_report("copy", region_bench_now_us() - start,
+			    REGION_BENCH_ROUNDS, &out);
+
+	start = region_bench_now_us();
+	for (i = 0; i < REGION_BENCH_ROUNDS; i++)
+		region_set_translate(&out, i & 1 ? -7 : 7, i & 1 ? 5 : -5);
+	region_bench_report("translate", region_bench_now_us() - start,
+			    REGION_BENCH_ROUNDS, &out);
+
+	start = region_bench_now_us();
+	for (i = 0; i < rects; i++)
+		if (region_set_subtract_rect(&a,
+				region_bench_random(&seed) % REGION_BENCH_AREA,
+				region_bench_random(&seed) % REGION_BENCH_AREA,
+				REGION_BENCH_SIZE, REGION_BENCH_SIZE) < 0)
+			goto out;
+	region_bench_report("subtract box", region_bench_now_us() - start,
+			    rects, &a);
+
+	ret = 0;
+out:
+	if (ret < 0)
+		fprintf(stderr, "Out of memory in the region benchmark\n");
+	region_set_fini(&a);
+	region_set_fini(&b);
+	region_set_fini(&out);
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned int rects = DEFAULT_RECTS;
+
+	if (argc == 2)
+		rects = (unsigned int) atoi(argv[1]);
+	if (argc > 2 || rects == 0) {
+		fprintf(stderr, "Usage: region-bench [rects] (default %d)\n",
+			DEFAULT_RECTS);
+		return EXIT_FAILURE;
+	}
+
+	return region_bench_run(rects) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
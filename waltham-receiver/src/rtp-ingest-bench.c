@@ -0,0 +1,278 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : RTP ingest benchmark. Receives an RTP/JPEG stream with either **
+**  udpsrc or the receiver's ingest into a depayloader, without decoding,    **
+**  and reports packets, frames, kernel drops and the CPU time it took.       **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <gst/gst.h>
+
+#include "wth-receiver-ingest.h"
+
+#define DEFAULT_RTP_PORT	5005
+#define DEFAULT_DURATION	30	/* s */
+#define IDLE_TIMEOUT_MS		1000	/* the stream is over after that */
+#define POLL_INTERVAL_MS	100
+
+/* same caps as the session pipelines, decoding is left out on purpose */
+#define BENCH_PIPELINE "%s caps=\"application/x-rtp,media=(string)video," \
+	"clock-rate=(int)90000,encoding-name=JPEG,payload=26\" " \
+	"! rtpjpegdepay name=depay ! fakesink name=sink sync=false"
+
+static int bench_port = DEFAULT_RTP_PORT;
+static unsigned int bench_duration = DEFAULT_DURATION;
+static bool bench_ingest = false;
+
+static gint bench_packets;
+static gint bench_frames;
+
+static GstPadProbeReturn
+bench_count_packets(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	if (GST_PAD_PROBE_INFO_TYPE(info) & GST_PAD_PROBE_TYPE_BUFFER_LIST)
+		g_atomic_int_add(&bench_packets,
+			gst_buffer_list_length(GST_PAD_PROBE_INFO_BUFFER_LIST(info)));
+	else
+		g_atomic_int_inc(&bench_packets);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static GstPadProbeReturn
+bench_count_frames(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	g_atomic_int_inc(&bench_frames);
+
+	return GST_PAD_PROBE_OK;
+}
+
+static void
+bench_probe(GstElement *pipeline, const char *name, GstPadProbeType type,
+	    GstPadProbeCallback callback)
+{
+	GstElement *element;
+	GstPad *pad;
+
+	element = gst_bin_get_by_name(GST_BIN(pipeline), name);
+	pad = gst_element_get_static_pad(element, "sink");
+	gst_pad_add_probe(pad, type, callback, NULL, NULL);
+	gst_object_unref(pad);
+	gst_object_unref(element);
+}
+
+/*
+ * Datagrams the kernel dropped on every socket bound to port, read from
+ * /proc/net/udp{,6} so both sources are counted the same way. Has to be
+ * read while the socket is still open.
+ */
+static uint64_t
+bench_kernel_drops(int port)
+{
+	static const char *const tables[] = { "/proc/net/udp", "/proc/net/udp6" };
+	unsigned long long drops;
+	uint64_t total = 0;
+	unsigned int local;
+	unsigned int i;
+	char line[512];
+	FILE *f;
+
+	for (i = 0; i < G_N_ELEMENTS(tables); i++) {
+		f = fopen(tables[i], "r");
+		if (!f)
+			continue;
+
+		/* sl local rem st queues tr retrnsmt uid timeout inode ref
+		 * pointer drops, the first line is the header */
+		while (fgets(line, sizeof line, f)) {
+			if (sscanf(line, " %*s %*[0-9A-Fa-f]:%x %*s %*s %*s %*s "
+				   "%*s %*s %*s %*s %*s %*s %llu",
+				   &local, &drops) == 2 && (int) local == port)
+				total += drops;
+		}
+
+		fclose(f);
+	}
+
+	return total;
+}
+
+static uint64_t
+bench_cpu_us(void)
+{
+	struct rusage usage;
+
+	/* every thread: the ingest and the streaming threads alike */
+	getrusage(RUSAGE_SELF, &usage);
+	return (uint64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) *
+		1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+static void
+usage(void)
+{
+	printf("Usage: rtp-ingest-bench [options]\n");
+	printf("Receives an RTP/JPEG stream and reports what it cost\n");
+	printf("Options:\n");
+	printf("  -o --rtp-port number      UDP port the stream arrives on\n");
+	printf("                            (default %d)\n", DEFAULT_RTP_PORT);
+	printf("  -G --rtp-ingest           Read it with the receiver's ingest\n");
+	printf("                            instead of udpsrc\n");
+	printf("  -d --duration seconds     Stop after that long at the latest\n");
+	printf("                            (default %d), or a second after the\n",
+	       DEFAULT_DURATION);
+	printf("                            stream stopped\n");
+	printf("  -h --help                 Usage\n");
+}
+
+static struct option long_options[] = {
+	{"rtp-port",   required_argument, 0, 'o'},
+	{"rtp-ingest", no_argument,       0, 'G'},
+	{"duration",   required_argument, 0, 'd'},
+	{"help",       no_argument,       0, 'h'},
+	{0,            0,                 0,  0}
+};
+
+int
+main(int argc, char **argv)
+{
+	struct rtp_ingest_config config = { 0 };
+	struct rtp_ingest *ingest = NULL;
+	GstElement *pipeline, *src;
+	GError *error = NULL;
+	char source[64];
+	char *desc;
+	uint64_t start, cpu, drops;
+	unsigned int waited = 0, idle = 0;
+	gint packets, last = 0;
+	int c;
+
+	gst_init(&argc, &argv);
+
+	while ((c = getopt_long(argc, argv, "o:Gd:h",
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'o':
+			bench_port = atoi(optarg);
+			break;
+		case 'G':
+			bench_ingest = true;
+			break;
+		case 'd':
+			bench_duration = (unsigned int) atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (bench_ingest)
+		snprintf(source, sizeof source, "appsrc name=src");
+	else
+		snprintf(source, sizeof source, "udpsrc name=src port=%d",
+			 bench_port);
+
+	desc = g_strdup_printf(BENCH_PIPELINE, source);
+	pipeline = gst_parse_launch(desc, &error);
+	g_free(desc);
+	if (!pipeline) {
+		fprintf(stderr, "Could not create the pipeline: %s\n",
+			error ? error->message : "unknown error");
+		return EXIT_FAILURE;
+	}
+
+	bench_probe(pipeline, "depay",
+		    GST_PAD_PROBE_TYPE_BUFFER | GST_PAD_PROBE_TYPE_BUFFER_LIST,
+		    bench_count_packets);
+	bench_probe(pipeline, "sink", GST_PAD_PROBE_TYPE_BUFFER,
+		    bench_count_frames);
+
+	gst_element_set_state(pipeline, GST_STATE_PLAYING);
+
+	/* as in session_source_open(), appsrc takes buffers once it left NULL */
+	if (bench_ingest) {
+		src = gst_bin_get_by_name(GST_BIN(pipeline), "src");
+		config.port = bench_port;
+		ingest = rtp_ingest_create(src, &config);
+		gst_object_unref(src);
+		if (!ingest) {
+			fprintf(stderr, "No RTP ingest on port %d\n", bench_port);
+			gst_element_set_state(pipeline, GST_STATE_NULL);
+			gst_object_unref(pipeline);
+			return EXIT_FAILURE;
+		}
+	}
+
+	fprintf(stdout, "%s on port %d, waiting for the stream\n",
+		bench_ingest ? "rtp ingest" : "udpsrc", bench_port);
+
+	start = bench_cpu_us();
+	while (waited < bench_duration * 1000) {
+		g_usleep(POLL_INTERVAL_MS * 1000);
+		waited += POLL_INTERVAL_MS;
+
+		packets = g_atomic_int_get(&bench_packets);
+		idle = packets && packets == last ? idle + POLL_INTERVAL_MS : 0;
+		last = packets;
+		if (idle >= IDLE_TIMEOUT_MS)
+			break;
+	}
+	cpu = bench_cpu_us() - start;
+	drops = bench_kernel_drops(bench_port);
+
+	rtp_ingest_destroy(ingest);
+	gst_element_set_state(pipeline, GST_STATE_NULL);
+	gst_object_unref(pipeline);
+
+	packets = g_atomic_int_get(&bench_packets);
+	fprintf(stdout, "%s: %d packets, %d frames, %" PRIu64 " dropped by the "
+		"kernel, %" PRIu64 " us of CPU (%.1f us per 1000 packets)\n",
+		bench_ingest ? "rtp ingest" : "udpsrc", packets,
+		g_atomic_int_get(&bench_frames), drops, cpu,
+		packets ? cpu * 1000.0 / packets : 0.0);
+
+	return EXIT_SUCCESS;
+}
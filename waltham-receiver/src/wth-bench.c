@@ -0,0 +1,619 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Benchmark client. It plays a transmitter that only times      **
+**  wth_display.sync round trips, from any number of connections at once,    **
+**  to compare the receiver's transports and event backends under load. It   **
+**  can upload a blob buffer ahead of every sync, and time the input lane     **
+**  alongside, to see what bulk traffic does to input latency.                **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+
+#include <waltham-client.h>
+#include <waltham-connection.h>
+
+#include "wth-receiver-socket.h"
+#include "wth-receiver-input-lane.h"
+
+#ifndef ARRAY_LENGTH
+#define ARRAY_LENGTH(a) (sizeof (a) / sizeof (a)[0])
+#endif
+
+#define DEFAULT_CONNECTIONS	1
+#define DEFAULT_ROUNDS		10000
+
+/* blob buffers are ARGB8888 (WL_SHM_FORMAT_ARGB8888), this many pixels wide */
+#define BLOB_FORMAT		0
+#define BLOB_WIDTH		1024
+
+/* a hello not echoed by then is counted as lost */
+#define LANE_TIMEOUT_MS		1000
+
+/* one transmitter, served from its own thread */
+struct bench_conn {
+    pthread_t thread;
+    int fd;
+    struct wth_connection *connection;
+    struct wth_display *display;
+    struct wthp_blob_factory *blob_factory;
+    int lane_fd;                  /* UDP socket on the input lane, or -1 */
+
+    uint64_t start;               /* of the current round */
+    bool done;                    /* the pending sync came back */
+    bool lane_pending;            /* the hello was not echoed yet */
+    uint32_t seq;                 /* of the last hello */
+    uint32_t *samples;            /* us, one per round trip */
+    uint32_t *lane_samples;       /* us, one per hello echoed */
+    unsigned int count;
+    unsigned int lane_count;
+    unsigned int lane_lost;
+    bool failed;
+};
+
+static const char *bench_host = "127.0.0.1";
+static const char *bench_port = NULL;
+static const char *bench_unix_path = NULL;
+static unsigned int bench_connections = DEFAULT_CONNECTIONS;
+static unsigned int bench_rounds = DEFAULT_ROUNDS;
+static const char *bench_lane_port = NULL;
+static uint32_t bench_blob_size = 0;
+static void *bench_blob;
+
+/* same defaults as the receiver, -s on both sides to compare */
+static struct socket_profile bench_profile = {
+	.nodelay = true,
+	.quickack = true,
+};
+
+static uint64_t
+bench_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+bench_connect_unix(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	if (connect(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+bench_connect_tcp(const char *host, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int
+bench_connect_lane(const char *host, const char *port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (getaddrinfo(host, port, &hints, &res) != 0) {
+		errno = EHOSTUNREACH;
+		return -1;
+	}
+
+	/* connected, so only the receiver's echoes come in */
+	for (ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+			    ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int
+bench_conn_open(struct bench_conn *bc)
+{
+	if (bench_unix_path)
+		bc->fd = bench_connect_unix(bench_unix_path);
+	else
+		bc->fd = bench_connect_tcp(bench_host, bench_port);
+	if (bc->fd < 0)
+		return -1;
+
+	if (!bench_unix_path)
+		socket_profile_apply_client(&bench_profile, bc->fd);
+
+	bc->connection = wth_connection_from_fd(bc->fd,
+						WTH_CONNECTION_SIDE_CLIENT);
+	if (!bc->connection) {
+		close(bc->fd);
+		return -1;
+	}
+
+	bc->display = wth_connection_get_display(bc->connection);
+
+	/* the receiver does not care about global names */
+	if (bench_blob_size)
+		bc->blob_factory = (struct wthp_blob_factory *)
+			wthp_registry_bind(wth_display_get_registry(bc->display),
+					   1, "wthp_blob_factory", 4);
+
+	if (bench_lane_port) {
+		bc->lane_fd = bench_connect_lane(bench_unix_path ? "127.0.0.1" :
+						 bench_host, bench_lane_port);
+		if (bc->lane_fd < 0)
+			return -1;
+	}
+
+	bc->samples = calloc(bench_rounds, sizeof bc->samples[0]);
+	bc->lane_samples = calloc(bench_rounds, sizeof bc->lane_samples[0]);
+	if (!bc->samples || !bc->lane_samples)
+		return -1;
+
+	return 0;
+}
+
+static void
+bench_conn_close(struct bench_conn *bc)
+{
+	if (bc->connection)
+		wth_connection_destroy(bc->connection);
+	if (bc->lane_fd >= 0)
+		close(bc->lane_fd);
+	free(bc->samples);
+	free(bc->lane_samples);
+}
+
+static void
+bench_sync_done(struct wthp_callback *callback, uint32_t time)
+{
+	struct bench_conn *bc =
+		wth_object_get_user_data((struct wth_object *) callback);
+
+	bc->samples[bc->count++] = (uint32_t) (bench_now_us() - bc->start);
+	bc->done = true;
+	wthp_callback_free(callback);
+}
+
+static const struct wthp_callback_listener bench_sync_listener = {
+	bench_sync_done
+};
+
+static int
+bench_lane_hello(struct bench_conn *bc)
+{
+	struct input_lane_msg hello = {
+		.magic = htonl(INPUT_LANE_MAGIC),
+		.seq = htonl(++bc->seq),
+		.type = htonl(INPUT_LANE_HELLO),
+	};
+
+	if (send(bc->lane_fd, &hello, sizeof hello, 0) < 0)
+		return -1;
+
+	bc->lane_pending = true;
+	return 0;
+}
+
+static int
+bench_lane_recv(struct bench_conn *bc)
+{
+	struct input_lane_msg echo;
+	ssize_t len;
+
+	/* a stale echo, from a hello that timed out, is just skipped */
+	while ((len = recv(bc->lane_fd, &echo, sizeof echo, MSG_DONTWAIT)) > 0) {
+		if (len == sizeof echo &&
+		    ntohl(echo.magic) == INPUT_LANE_MAGIC &&
+		    ntohl(echo.type) == INPUT_LANE_HELLO &&
+		    ntohl(echo.seq) == bc->seq && bc->lane_pending) {
+			bc->lane_samples[bc->lane_count++] =
+				(uint32_t) (bench_now_us() - bc->start);
+			bc->lane_pending = false;
+		}
+	}
+
+	return len < 0 && errno != EAGAIN ? -1 : 0;
+}
+
+/* queued ahead of the sync, so the sync waits behind it on the stream */
+static void
+bench_upload_blob(struct bench_conn *bc)
+{
+	struct wthp_buffer *buffer;
+	int32_t height = bench_blob_size / (BLOB_WIDTH * 4);
+
+	buffer = wthp_blob_factory_create_buffer(bc->blob_factory,
+						 bench_blob_size, bench_blob,
+						 BLOB_WIDTH, height,
+						 BLOB_WIDTH * 4, BLOB_FORMAT);
+	if (buffer)
+		wthp_buffer_destroy(buffer);
+}
+
+/*
+ * One round: the blob if any, then the sync, with the hello sent at the
+ * same time on the lane. Both are timed from the start of the round, until
+ * the sync is done and the hello is back.
+ */
+static int
+bench_round(struct bench_conn *bc)
+{
+	struct wthp_callback *callback;
+	struct pollfd fds[2];
+	bool flushing = true;
+	int ret;
+
+	bc->start = bench_now_us();
+
+	if (bc->blob_factory)
+		bench_upload_blob(bc);
+
+	bc->done = false;
+	callback = wth_display_sync(bc->display);
+	if (!callback)
+		return -1;
+	wthp_callback_set_listener(callback, &bench_sync_listener, bc);
+
+	if (bc->lane_fd >= 0 && bench_lane_hello(bc) < 0)
+		return -1;
+
+	fds[0].fd = bc->fd;
+	fds[1].fd = bc->lane_fd;
+	fds[1].events = POLLIN;
+
+	while (!bc->done || bc->lane_pending) {
+		if (flushing) {
+			if (wth_connection_flush(bc->connection) == 0)
+				flushing = false;
+			else if (errno != EAGAIN)
+				return -1;
+		}
+
+		fds[0].events = POLLIN | (flushing ? POLLOUT : 0);
+		ret = poll(fds, ARRAY_LENGTH(fds),
+			   bc->lane_pending ? LANE_TIMEOUT_MS : -1);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (ret == 0) {
+			bc->lane_lost++;
+			bc->lane_pending = false;
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			if (wth_connection_read(bc->connection) < 0 &&
+			    errno != EAGAIN)
+				return -1;
+			if (bench_profile.quickack && !bench_unix_path)
+				socket_profile_rearm_quickack(bc->fd);
+			if (wth_connection_dispatch(bc->connection) < 0)
+				return -1;
+		} else if (fds[0].revents & (POLLERR | POLLHUP)) {
+			return -1;
+		}
+
+		if ((fds[1].revents & POLLIN) && bench_lane_recv(bc) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static void *
+bench_conn_run(void *data)
+{
+	struct bench_conn *bc = data;
+	unsigned int i;
+
+	for (i = 0; i < bench_rounds; i++) {
+		if (bench_round(bc) < 0) {
+			bc->failed = true;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+bench_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_report(const char *name, uint32_t *samples, size_t n, uint64_t us)
+{
+	if (!n) {
+		fprintf(stdout, "%s: no samples\n", name);
+		return;
+	}
+
+	qsort(samples, n, sizeof samples[0], bench_compare);
+
+	fprintf(stdout, "%s: %zu round trips in %.1f ms, %.0f/s\n", name, n,
+		us / 1000.0, us ? n * 1000000.0 / us : 0.0);
+	fprintf(stdout, "  us  min %u  p50 %u  p90 %u  p99 %u  max %u\n",
+		samples[0], samples[n / 2], samples[n * 90 / 100],
+		samples[n * 99 / 100], samples[n - 1]);
+}
+
+static void
+usage(void)
+{
+	printf("Usage: wth-bench [options]\n");
+	printf("Times wth_display.sync round trips to a waltham-receiver\n");
+	printf("Options:\n");
+	printf("  -p --port [host:]number   Connect over TCP (host defaults to\n");
+	printf("                            127.0.0.1)\n");
+	printf("  -u --unix-socket path     Connect to the AF_UNIX socket path\n");
+	printf("  -c --connections number   Transmitters syncing at once, each\n");
+	printf("                            from its own thread (default %d)\n",
+	       DEFAULT_CONNECTIONS);
+	printf("  -n --rounds number        Round trips per connection\n");
+	printf("                            (default %d)\n", DEFAULT_ROUNDS);
+	printf("  -b --blob bytes           Upload a blob buffer of that size\n");
+	printf("                            ahead of every sync\n");
+	printf("  -l --input-port number    Time a hello on the receiver's input\n");
+	printf("                            lane along with every sync\n");
+	printf("  -s --socket-profile opts  nodelay and quickack of the TCP\n");
+	printf("                            connections, as for the receiver\n");
+	printf("                            (default nodelay=1,quickack=1)\n");
+	printf("  -h --help                 Usage\n");
+}
+
+static struct option long_options[] = {
+	{"port",        required_argument, 0, 'p'},
+	{"unix-socket", required_argument, 0, 'u'},
+	{"connections", required_argument, 0, 'c'},
+	{"rounds",      required_argument, 0, 'n'},
+	{"blob",        required_argument, 0, 'b'},
+	{"input-port",  required_argument, 0, 'l'},
+	{"socket-profile", required_argument, 0, 's'},
+	{"help",        no_argument,       0, 'h'},
+	{0,             0,                 0,  0}
+};
+
+int
+main(int argc, char **argv)
+{
+	struct bench_conn *conns;
+	uint32_t *all, *lane;
+	size_t total = 0, lane_total = 0;
+	unsigned int lost = 0;
+	uint64_t start, us;
+	unsigned int i;
+	char *colon;
+	int c, ret = EXIT_FAILURE;
+
+	while ((c = getopt_long(argc, argv, "p:u:c:n:b:l:s:h",
+				long_options, NULL)) != -1) {
+		switch (c) {
+		case 'p':
+			colon = strrchr(optarg, ':');
+			if (colon) {
+				*colon = '\0';
+				bench_host = optarg;
+				bench_port = colon + 1;
+			} else {
+				bench_port = optarg;
+			}
+			break;
+		case 'u':
+			bench_unix_path = optarg;
+			break;
+		case 'c':
+			bench_connections = (unsigned int) atoi(optarg);
+			break;
+		case 'n':
+			bench_rounds = (unsigned int) atoi(optarg);
+			break;
+		case 'b':
+			bench_blob_size = (uint32_t) strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			bench_lane_port = optarg;
+			break;
+		case 's':
+			if (socket_profile_parse(&bench_profile, optarg) < 0) {
+				usage();
+				return EXIT_FAILURE;
+			}
+			break;
+		case 'h':
+			usage();
+			return EXIT_SUCCESS;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (!bench_port == !bench_unix_path || !bench_connections ||
+	    !bench_rounds) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	/* whole rows of pixels, the receiver turns down anything else */
+	bench_blob_size -= bench_blob_size % (BLOB_WIDTH * 4);
+	if (bench_blob_size) {
+		bench_blob = malloc(bench_blob_size);
+		if (!bench_blob)
+			return EXIT_FAILURE;
+		memset(bench_blob, 0x80, bench_blob_size);
+	}
+
+	conns = calloc(bench_connections, sizeof *conns);
+	if (!conns)
+		return EXIT_FAILURE;
+	for (i = 0; i < bench_connections; i++)
+		conns[i].lane_fd = -1;
+
+	/* everybody connected before the clock starts */
+	for (i = 0; i < bench_connections; i++) {
+		if (bench_conn_open(&conns[i]) < 0) {
+			fprintf(stderr, "Failed to connect: %s\n",
+				strerror(errno));
+			goto out;
+		}
+	}
+
+	if (!bench_unix_path)
+		socket_profile_report(&bench_profile, conns[0].fd);
+
+	start = bench_now_us();
+	for (i = 0; i < bench_connections; i++) {
+		if (pthread_create(&conns[i].thread, NULL, bench_conn_run,
+				   &conns[i]) != 0) {
+			fprintf(stderr, "Failed to start a connection thread\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < bench_connections; i++)
+		pthread_join(conns[i].thread, NULL);
+	us = bench_now_us() - start;
+
+	all = calloc((size_t) bench_connections * bench_rounds, sizeof *all);
+	lane = calloc((size_t) bench_connections * bench_rounds, sizeof *lane);
+	if (!all || !lane) {
+		free(all);
+		goto out;
+	}
+
+	ret = EXIT_SUCCESS;
+	for (i = 0; i < bench_connections; i++) {
+		if (conns[i].failed) {
+			fprintf(stderr, "Connection %u failed after %u round "
+				"trips\n", i, conns[i].count);
+			ret = EXIT_FAILURE;
+		}
+		memcpy(all + total, conns[i].samples,
+		       conns[i].count * sizeof *all);
+		total += conns[i].count;
+		memcpy(lane + lane_total, conns[i].lane_samples,
+		       conns[i].lane_count * sizeof *lane);
+		lane_total += conns[i].lane_count;
+		lost += conns[i].lane_lost;
+	}
+
+	if (bench_blob_size)
+		fprintf(stdout, "%u bytes blob ahead of every sync\n",
+			bench_blob_size);
+	bench_report(bench_unix_path ? "unix" : "tcp", all, total, us);
+	if (bench_lane_port) {
+		bench_report("input lane", lane, lane_total, us);
+		fprintf(stdout, "  %u hellos lost\n", lost);
+	}
+	free(all);
+	free(lane);
+
+out:
+	for (i = 0; i < bench_connections; i++)
+		bench_conn_close(&conns[i]);
+	free(conns);
+	free(bench_blob);
+
+	return ret;
+}
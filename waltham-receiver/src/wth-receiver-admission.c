@@ -0,0 +1,192 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the admission control of connections    **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-admission.h"
+
+/*
+ * The buckets form a direct mapped table: a source hashing to a slot held
+ * by another source takes it over with a full bucket. That keeps memory
+ * bounded whatever the number of sources, at the price of letting some
+ * connections of colliding sources through during a storm.
+ */
+#define ADMISSION_BUCKETS	256
+
+struct admission_bucket {
+    uint8_t addr[16];             /* IPv4 addresses are v4-mapped */
+    bool used;
+    uint64_t tokens;              /* thousandths of a connection */
+    uint64_t last_ms;
+};
+
+extern unsigned int max_clients;
+extern unsigned int accept_rate;
+extern unsigned int accept_burst;
+
+/* shared by all reactors */
+static unsigned int admitted_clients;
+
+int
+admission_init(struct receiver *srv)
+{
+	if (!accept_rate)
+		return 0;
+
+	srv->admission = calloc(ADMISSION_BUCKETS, sizeof *srv->admission);
+	return srv->admission ? 0 : -1;
+}
+
+void
+admission_fini(struct receiver *srv)
+{
+	free(srv->admission);
+	srv->admission = NULL;
+}
+
+/* returns false for addresses that are not rate limited */
+static bool
+admission_key(const struct sockaddr *addr, uint8_t key[16])
+{
+	const struct sockaddr_in *sin;
+	const struct sockaddr_in6 *sin6;
+
+	if (!addr)
+		return false;
+
+	switch (addr->sa_family) {
+	case AF_INET:
+		sin = (const struct sockaddr_in *) addr;
+		memset(key, 0, 10);
+		key[10] = 0xff;
+		key[11] = 0xff;
+		memcpy(key + 12, &sin->sin_addr, 4);
+		return true;
+	case AF_INET6:
+		sin6 = (const struct sockaddr_in6 *) addr;
+		memcpy(key, &sin6->sin6_addr, 16);
+		return true;
+	default:
+		return false;
+	}
+}
+
+static unsigned int
+admission_hash(const uint8_t key[16])
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	/* FNV-1a */
+	for (i = 0; i < 16; i++)
+		h = (h ^ key[i]) * 16777619u;
+
+	return h % ADMISSION_BUCKETS;
+}
+
+static bool
+admission_take_token(struct receiver *srv, const struct sockaddr *addr)
+{
+	const uint64_t cap = (uint64_t) accept_burst * 1000;
+	struct admission_bucket *b;
+	uint64_t now = get_monotonic_us() / 1000;
+	uint8_t key[16];
+
+	if (!srv->admission || !admission_key(addr, key))
+		return true;
+
+	b = &srv->admission[admission_hash(key)];
+	if (!b->used || memcmp(b->addr, key, sizeof key) != 0) {
+		memcpy(b->addr, key, sizeof key);
+		b->used = true;
+		b->tokens = cap;
+	} else {
+		/* accept_rate connections per second is accept_rate
+		 * thousandths per ms */
+		b->tokens += (now - b->last_ms) * accept_rate;
+		if (b->tokens > cap)
+			b->tokens = cap;
+	}
+	b->last_ms = now;
+
+	if (b->tokens < 1000)
+		return false;
+
+	b->tokens -= 1000;
+	return true;
+}
+
+enum admission_verdict
+admission_check(struct receiver *srv, const struct sockaddr *addr)
+{
+	unsigned int count;
+
+	if (!admission_take_token(srv, addr))
+		return ADMISSION_REJECT_RATE;
+
+	count = __atomic_add_fetch(&admitted_clients, 1, __ATOMIC_RELAXED);
+	if (max_clients && count > max_clients) {
+		__atomic_sub_fetch(&admitted_clients, 1, __ATOMIC_RELAXED);
+		return ADMISSION_REJECT_FULL;
+	}
+
+	return ADMISSION_ACCEPT;
+}
+
+void
+admission_release(void)
+{
+	__atomic_sub_fetch(&admitted_clients, 1, __ATOMIC_RELAXED);
+}
+
+void
+admission_reject(struct receiver *srv, int fd, enum admission_verdict verdict)
+{
+	struct linger lin = { .l_onoff = 1, .l_linger = 0 };
+
+	if (verdict == ADMISSION_REJECT_FULL)
+		srv->stats.rejected_full++;
+	else
+		srv->stats.rejected_rate++;
+
+	/* RST instead of FIN, no TIME_WAIT left behind */
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof lin);
+	close(fd);
+}
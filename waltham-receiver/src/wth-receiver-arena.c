@@ -0,0 +1,161 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the per-client object arena             **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-seat.h"
+#include "wth-receiver-buffer.h"
+#include "wth-receiver-arena.h"
+
+#define ARENA_SLAB_SIZE		4096
+#define ARENA_MIN_PER_SLAB	4
+#define ARENA_ALIGN		(2 * sizeof(void *))	/* as malloc() */
+
+/* the header keeps the objects that follow it aligned */
+struct arena_slab {
+    union {
+        struct arena_slab *next;
+        char pad[ARENA_ALIGN];
+    };
+};
+
+static const size_t arena_type_size[ARENA_TYPE_COUNT] = {
+	[ARENA_REGISTRY] = sizeof(struct registry),
+	[ARENA_COMPOSITOR] = sizeof(struct compositor),
+	[ARENA_REGION] = sizeof(struct region),
+	[ARENA_SURFACE] = sizeof(struct surface),
+	[ARENA_WINDOW] = sizeof(struct window),
+	[ARENA_IVISURFACE] = sizeof(struct ivisurface),
+	[ARENA_APPLICATION_ID] = sizeof(struct application_id),
+	[ARENA_SEAT] = sizeof(struct seat),
+	[ARENA_POINTER] = sizeof(struct pointer),
+	[ARENA_TOUCH] = sizeof(struct touch),
+	[ARENA_BLOB_FACTORY] = sizeof(struct blob_factory),
+	[ARENA_BUFFER] = sizeof(struct buffer),
+	[ARENA_FRAME_CALLBACK] = sizeof(struct frame_callback),
+};
+
+void
+arena_init(struct arena *arena)
+{
+	const size_t align = ARENA_ALIGN;
+	struct arena_pool *pool;
+	int type;
+
+	memset(arena, 0, sizeof *arena);
+
+	for (type = 0; type < ARENA_TYPE_COUNT; type++) {
+		pool = &arena->pools[type];
+		pool->size = (arena_type_size[type] + align - 1) & ~(align - 1);
+		pool->per_slab = (ARENA_SLAB_SIZE - sizeof(struct arena_slab)) /
+				 pool->size;
+		if (pool->per_slab < ARENA_MIN_PER_SLAB)
+			pool->per_slab = ARENA_MIN_PER_SLAB;
+	}
+}
+
+static int
+arena_pool_grow(struct arena *arena, struct arena_pool *pool)
+{
+	struct arena_slab *slab;
+	char *obj;
+	unsigned int i;
+
+	slab = malloc(sizeof *slab + pool->per_slab * pool->size);
+	if (!slab)
+		return -1;
+
+	slab->next = pool->slabs;
+	pool->slabs = slab;
+	arena->slab_count++;
+
+	/* thread the new objects onto the free list, first one on top */
+	obj = (char *) (slab + 1);
+	for (i = pool->per_slab; i > 0; i--) {
+		*(void **) (obj + (i - 1) * pool->size) = pool->free_list;
+		pool->free_list = obj + (i - 1) * pool->size;
+	}
+
+	return 0;
+}
+
+void *
+arena_zalloc(struct arena *arena, enum arena_type type)
+{
+	struct arena_pool *pool = &arena->pools[type];
+	void *obj;
+
+	if (!pool->free_list && arena_pool_grow(arena, pool) < 0)
+		return NULL;
+
+	obj = pool->free_list;
+	pool->free_list = *(void **) obj;
+	pool->live++;
+
+	memset(obj, 0, pool->size);
+	return obj;
+}
+
+void
+arena_free(struct arena *arena, enum arena_type type, void *ptr)
+{
+	struct arena_pool *pool = &arena->pools[type];
+
+	if (!ptr || arena->releasing)
+		return;
+
+	*(void **) ptr = pool->free_list;
+	pool->free_list = ptr;
+	pool->live--;
+}
+
+void
+arena_release(struct arena *arena)
+{
+	struct arena_slab *slab, *next;
+	int type;
+
+	for (type = 0; type < ARENA_TYPE_COUNT; type++) {
+		for (slab = arena->pools[type].slabs; slab; slab = next) {
+			next = slab->next;
+			free(slab);
+		}
+	}
+
+	arena_init(arena);
+}
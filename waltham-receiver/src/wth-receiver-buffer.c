@@ -26,23 +26,193 @@
 
 #include "wth-receiver-comm.h"
 #include "wth-receiver-buffer.h"
+#include "os-compatibility.h"
+
+void
+buffer_destroy(struct buffer *buf)
+{
+	struct surface *surface;
+
+	/* attached but not committed yet */
+	wl_list_for_each(surface, &buf->client->surface_list, link) {
+		if (surface->pending_buffer == buf)
+			surface->pending_buffer = NULL;
+	}
+
+	if (buf->fd >= 0)
+		close(buf->fd);
+
+	wthp_buffer_free(buf->obj);
+	wl_list_remove(&buf->link);
+	arena_free(&buf->client->arena, ARENA_BUFFER, buf);
+}
 
 static void
 buffer_handle_destroy(struct wthp_buffer *wthp_buffer)
 {
 	struct buffer *buf = wth_object_get_user_data((struct wth_object *)wthp_buffer);
 
-	wthp_buffer_free(wthp_buffer);
-	wl_list_remove(&buf->link);
-	free(buf);
+	assert(wthp_buffer == buf->obj);
+	buffer_destroy(buf);
 }
 
 static const struct wthp_buffer_interface buffer_implementation = {
 	buffer_handle_destroy
 };
 
+static void
+blob_damage_collapse(struct blob_damage *damage)
+{
+	int64_t x1 = INT32_MAX, y1 = INT32_MAX;
+	int64_t x2 = INT32_MIN, y2 = INT32_MIN;
+	uint32_t i;
+
+	for (i = 0; i < damage->count; i++) {
+		if (damage->rects[i].x < x1)
+			x1 = damage->rects[i].x;
+		if (damage->rects[i].y < y1)
+			y1 = damage->rects[i].y;
+		if ((int64_t) damage->rects[i].x + damage->rects[i].width > x2)
+			x2 = (int64_t) damage->rects[i].x + damage->rects[i].width;
+		if ((int64_t) damage->rects[i].y + damage->rects[i].height > y2)
+			y2 = (int64_t) damage->rects[i].y + damage->rects[i].height;
+	}
+
+	damage->rects[0].x = x1;
+	damage->rects[0].y = y1;
+	damage->rects[0].width = x2 - x1 > INT32_MAX ? INT32_MAX : x2 - x1;
+	damage->rects[0].height = y2 - y1 > INT32_MAX ? INT32_MAX : y2 - y1;
+	damage->count = 1;
+}
+
+void
+blob_damage_add(struct blob_damage *damage,
+		int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	uint32_t i;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	/* a clock or a gauge damages the same spot over and over */
+	for (i = 0; i < damage->count; i++) {
+		if (x >= damage->rects[i].x && y >= damage->rects[i].y &&
+		    (int64_t) x + width <=
+		    (int64_t) damage->rects[i].x + damage->rects[i].width &&
+		    (int64_t) y + height <=
+		    (int64_t) damage->rects[i].y + damage->rects[i].height)
+			return;
+	}
+
+	if (damage->count == BLOB_DAMAGE_RECTS)
+		blob_damage_collapse(damage);
+
+	damage->rects[damage->count].x = x;
+	damage->rects[damage->count].y = y;
+	damage->rects[damage->count].width = width;
+	damage->rects[damage->count].height = height;
+	damage->count++;
+}
+
+void
+blob_damage_merge(struct blob_damage *damage, const struct blob_damage *other)
+{
+	uint32_t i;
+
+	for (i = 0; i < other->count; i++)
+		blob_damage_add(damage, other->rects[i].x, other->rects[i].y,
+				other->rects[i].width, other->rects[i].height);
+}
+
+void
+blob_damage_clip(struct blob_damage *damage, int32_t width, int32_t height)
+{
+	int64_t x1, y1, x2, y2;
+	uint32_t i, count = 0;
+
+	for (i = 0; i < damage->count; i++) {
+		x1 = damage->rects[i].x > 0 ? damage->rects[i].x : 0;
+		y1 = damage->rects[i].y > 0 ? damage->rects[i].y : 0;
+		x2 = (int64_t) damage->rects[i].x + damage->rects[i].width;
+		y2 = (int64_t) damage->rects[i].y + damage->rects[i].height;
+		if (x2 > width)
+			x2 = width;
+		if (y2 > height)
+			y2 = height;
+		if (x2 <= x1 || y2 <= y1)
+			continue;
+
+		damage->rects[count].x = x1;
+		damage->rects[count].y = y1;
+		damage->rects[count].width = x2 - x1;
+		damage->rects[count].height = y2 - y1;
+		count++;
+	}
+
+	damage->count = count;
+}
+
+uint64_t
+blob_damage_area(const struct blob_damage *damage)
+{
+	uint64_t area = 0;
+	uint32_t i;
+
+	for (i = 0; i < damage->count; i++)
+		area += (uint64_t) damage->rects[i].width *
+			damage->rects[i].height;
+
+	return area;
+}
+
 /* BEGIN wthp_blob_factory implementation */
 
+/* formats every compositor has to support */
+static bool
+blob_is_valid(uint32_t data_sz, int32_t width, int32_t height,
+	      int32_t stride, uint32_t format)
+{
+	if (format != WL_SHM_FORMAT_ARGB8888 &&
+	    format != WL_SHM_FORMAT_XRGB8888)
+		return false;
+
+	if (width <= 0 || height <= 0 || stride / 4 < width)
+		return false;
+
+	return (uint64_t) stride * height <= data_sz;
+}
+
+/*
+ * The data only lives as long as the request being dispatched, so this is
+ * where the one copy of the pixels happens: straight into the file the
+ * local compositor is going to read them from.
+ */
+static int
+blob_copy_in(const void *data, uint32_t size)
+{
+	const char *p = data;
+	ssize_t len;
+	int fd;
+
+	fd = os_create_anonymous_file(size);
+	if (fd < 0)
+		return -1;
+
+	while (size > 0) {
+		len = write(fd, p, size);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			close(fd);
+			return -1;
+		}
+		p += len;
+		size -= len;
+	}
+
+	return fd;
+}
+
 static void
 blob_factory_create_buffer(struct wthp_blob_factory *blob_factory,
 			   struct wthp_buffer *wthp_buffer, uint32_t data_sz, void *data,
@@ -51,16 +221,17 @@ blob_factory_create_buffer(struct wthp_blob_factory *blob_factory,
 	struct blob_factory *blob = wth_object_get_user_data((struct wth_object *)blob_factory);
 	struct buffer *buffer;
 
-	buffer = zalloc(sizeof *buffer);
+	buffer = arena_zalloc(&blob->client->arena, ARENA_BUFFER);
 	if (!buffer) {
 		client_post_out_of_memory(blob->client);
 		return;
 	}
 
+	buffer->client = blob->client;
 	wl_list_insert(&blob->client->buffer_list, &buffer->link);
 
 	buffer->data_sz = data_sz;
-	buffer->data = data;
+	buffer->fd = -1;
 	buffer->width = width;
 	buffer->height = height;
 	buffer->stride = stride;
@@ -68,6 +239,23 @@ blob_factory_create_buffer(struct wthp_blob_factory *blob_factory,
 	buffer->obj = wthp_buffer;
 
 	wthp_buffer_set_interface(wthp_buffer, &buffer_implementation, buffer);
+
+	/* not fatal, the buffer just never shows up */
+	if (!blob_is_valid(data_sz, width, height, stride, format)) {
+		wth_error("client %p: unusable blob buffer %dx%d stride %d "
+			  "format 0x%x, %u bytes\n", blob->client, width,
+			  height, stride, format, data_sz);
+		return;
+	}
+
+	buffer->fd = blob_copy_in(data, data_sz);
+	if (buffer->fd < 0) {
+		wth_error("client %p: no room for a %u bytes blob: %s\n",
+			  blob->client, data_sz, strerror(errno));
+		return;
+	}
+
+	blob->client->receiver->stats.blob_bytes += data_sz;
 }
 
 static const struct wthp_blob_factory_interface blob_factory_implementation = {
@@ -79,7 +267,7 @@ client_bind_blob_factory(struct client *c, struct wthp_blob_factory *obj)
 {
 	struct blob_factory *blob;
 
-	blob = zalloc(sizeof *blob);
+	blob = arena_zalloc(&c->arena, ARENA_BLOB_FACTORY);
 	if (!blob) {
 		client_post_out_of_memory(c);
 		return;
@@ -38,14 +38,25 @@
 #include <signal.h>
 
 #include "wth-receiver-comm.h"
+#include "wth-receiver-socket.h"
+#include "wth-receiver-admission.h"
 #include "wth-receiver-surface.h"
 #include "wth-receiver-seat.h"
 #include "wth-receiver-buffer.h"
+#include "wth-receiver-session.h"
+#include "wth-receiver-uring.h"
 
 #include <waltham-util.h>
 
-extern uint16_t tcp_port;
+extern uint16_t rtp_port;
 extern const char *my_app_id;
+extern bool edge_triggered;
+extern size_t client_read_budget;
+extern unsigned int client_dispatch_budget;
+extern struct socket_profile socket_profile;
+extern unsigned int accept_batch;
+extern size_t out_high_watermark;
+extern unsigned int busy_poll_us;
 
 void
 client_post_out_of_memory(struct client *c)
@@ -63,19 +74,14 @@ static void
 wthp_ivi_surface_destroy(struct wthp_ivi_surface * ivi_surface)
 {
 	struct ivisurface *ivisurf = wth_object_get_user_data((struct wth_object *)ivi_surface);
-	struct client *client = ivisurf->appid->client;
-
-	if (client) {
-		client->pid_destroying = true;
-		fprintf(stdout, "client pid_destroying to true for client %p pid %d\n",
-				client, client->pid);
-		if (kill(client->pid, SIGINT) < 0) {
-			fprintf(stderr, "Failed to send SIGINT to child %d\n",
-					client->pid);
-		}
-	}
 
-	free(ivisurf);
+	if (ivisurf->session)
+		session_destroy(ivisurf->session);
+
+	if (ivisurf->surf)
+		ivisurf->surf->ivisurf = NULL;
+
+	arena_free(&ivisurf->client->arena, ARENA_IVISURFACE, ivisurf);
 }
 
 static const struct wthp_ivi_surface_interface wthp_ivi_surface_implementation = {
@@ -96,38 +102,31 @@ wthp_ivi_app_id_surface_create(struct wthp_ivi_app_id *ivi_application,
 		wth_object_get_user_data((struct wth_object *)wthp_surface);
 	struct application_id *appid =
 		wth_object_get_user_data((struct wth_object *) ivi_application);
-	pid_t cpid;
 
-	struct ivisurface *ivisurf = zalloc(sizeof *ivisurf);
+	struct ivisurface *ivisurf;
+
+	ivisurf = arena_zalloc(&appid->client->arena, ARENA_IVISURFACE);
 	if (!ivisurf) {
+		client_post_out_of_memory(appid->client);
 		return;
 	}
 
 	ivisurf->obj = obj;
+	ivisurf->client = appid->client;
 	ivisurf->surf = surface;
 	ivisurf->appid = appid;
 
 	wthp_ivi_surface_set_interface(obj,
 				       &wthp_ivi_surface_implementation, ivisurf);
 
-	cpid = fork();
-	if (cpid == -1) {
-		fprintf(stderr, "Failed to fork()\n");
-		exit(EXIT_FAILURE);
-	}
+	surface->ivisurf = ivisurf;
 
-	if (cpid == 0) {
-		if (my_app_id)
-			wth_receiver_weston_main(surface->shm_window, my_app_id, tcp_port);
-		else
-			wth_receiver_weston_main(surface->shm_window, app_id, tcp_port);
-	} else {
-		/* this is parent, in wthp_ivi_surface_destroy() we mark that the
-		 * client should be waited for so wait4() will be blocked.
-		 */
-		appid->client->pid = cpid;
-	}
+	if (my_app_id)
+		app_id = my_app_id;
 
+	ivisurf->session = session_create(surface, app_id, rtp_port);
+	if (!ivisurf->session)
+		wth_error("Failed to start a session for surface %p\n", surface);
 }
 
 static const struct wthp_ivi_app_id_interface wthp_ivi_app_id_implementation = {
@@ -139,7 +138,7 @@ client_bind_wthp_ivi_app_id(struct client *c, struct wthp_ivi_app_id *obj)
 {
 	struct application_id *app;
 
-	app = zalloc(sizeof *app);
+	app = arena_zalloc(&c->arena, ARENA_APPLICATION_ID);
 	if (!app) {
 		client_post_out_of_memory(c);
 		return;
@@ -160,7 +159,7 @@ registry_destroy(struct registry *reg)
 {
 	wthp_registry_free(reg->obj);
 	wl_list_remove(&reg->link);
-	free(reg);
+	arena_free(&reg->client->arena, ARENA_REGISTRY, reg);
 }
 
 static void
@@ -224,8 +223,13 @@ display_handle_client_version(struct wth_display *wth_display,
 static void
 display_handle_sync(struct wth_display * wth_display, struct wthp_callback * callback)
 {
-	wthp_callback_send_done(callback, 0);
+	struct client *c = wth_object_get_user_data((struct wth_object *)wth_display);
+
+	/* same clock and unit as the timestamps of wl_callback.done */
+	wthp_callback_send_done(callback,
+				(uint32_t) (get_monotonic_us() / 1000));
 	wthp_callback_free(callback);
+	client_account_output(c, CLIENT_MSG_BYTES(1));
 }
 
 static void
@@ -235,7 +239,7 @@ display_handle_get_registry(struct wth_display *wth_display,
 	struct client *c = wth_object_get_user_data((struct wth_object *)wth_display);
 	struct registry *reg;
 
-	reg = zalloc(sizeof *reg);
+	reg = arena_zalloc(&c->arena, ARENA_REGISTRY);
 	if (!reg) {
 		client_post_out_of_memory(c);
 		return;
@@ -263,14 +267,42 @@ const struct wth_display_interface display_implementation = {
 /*
  * utility functions
  */
-static int
+int
 watch_ctl(struct watch *w, int op, uint32_t events)
 {
+	struct receiver *srv = w->receiver;
 	struct epoll_event ee;
+	int i;
+
+	/* the watch is likely about to be freed, make sure the events
+	 * batch being handled does not still point at it */
+	if (op == EPOLL_CTL_DEL) {
+		for (i = 0; i < srv->batch_count; i++) {
+			if (srv->batch[i].data.ptr == w)
+				srv->batch[i].data.ptr = NULL;
+		}
+	}
+
+	if (srv->uring)
+		return uring_watch_ctl(srv->uring, w, op, events);
 
 	ee.events = events;
 	ee.data.ptr = w;
-	return epoll_ctl(w->receiver->epoll_fd, op, w->fd, &ee);
+	return epoll_ctl(srv->epoll_fd, op, w->fd, &ee);
+}
+
+static uint32_t
+client_watch_events(struct client *c)
+{
+	uint32_t events = EPOLLIN;
+
+	if (c->backlogged)
+		events |= EPOLLOUT;
+	/* with EPOLLET a peer shutdown may come without a readable edge */
+	if (edge_triggered)
+		events |= EPOLLET | EPOLLRDHUP;
+
+	return events;
 }
 
 /**
@@ -289,10 +321,22 @@ client_destroy(struct client *c)
 	struct compositor *comp;
 	struct registry *reg;
 	struct surface *surface;
+	struct buffer *buf;
+	struct session *session;
+	unsigned int slabs = c->arena.slab_count;
 
 	/* clean up remaining client resources in case the client
-	 * did not.
+	 * did not. Their memory goes away with the arena below, all
+	 * at once, including objects that are not on any list.
 	 */
+	c->arena.releasing = true;
+
+	rtt_probe_stop(&c->rtt);
+
+	/* the transmitter may be back soon, see session_park() */
+	wl_list_last_until_empty(session, &c->session_list, link)
+		session_park(session);
+
 	wl_list_last_until_empty(region, &c->region_list, link)
 		region_destroy(region);
 
@@ -305,12 +349,144 @@ client_destroy(struct client *c)
 	wl_list_last_until_empty(surface, &c->surface_list, link)
 		surface_destroy(surface);
 
+	/* they own the files holding their pixels */
+	wl_list_last_until_empty(buf, &c->buffer_list, link)
+		buffer_destroy(buf);
+
 	wl_list_remove(&c->link);
+	wl_list_remove(&c->dirty_link);
+	wl_list_remove(&c->ready_link);
 	watch_ctl(&c->conn_watch, EPOLL_CTL_DEL, 0);
 	wth_connection_destroy(c->connection);
+	arena_release(&c->arena);
+	admission_release();
+
+	fprintf(stdout, "Client %p destroyed, %u slabs released\n", c, slabs);
 	free(c);
 }
 
+/*
+ * Everything queued made it to the socket. With TCP_NOTSENT_LOWAT set to
+ * the low watermark, a flush of a congested client only succeeds once the
+ * kernel got below it too.
+ */
+static void
+client_drained(struct client *c)
+{
+	struct session *session;
+
+	c->out_queued = 0;
+	if (!c->congested)
+		return;
+
+	c->congested = false;
+	wl_list_for_each(session, &c->session_list, link)
+		session_release_input(session);
+
+	client_mark_dirty(c);
+}
+
+static int
+receiver_flush_client(struct client *c)
+{
+	struct receiver_stats *stats = &c->receiver->stats;
+	int ret;
+
+	stats->flush_calls++;
+	stats->flush_iter++;
+
+	ret = wth_connection_flush(c->connection);
+	if (ret < 0 && errno == EAGAIN)
+		stats->flush_eagain++;
+
+	return ret;
+}
+
+/*
+ * Reads and dispatches what the client sent. In level-triggered mode that
+ * is one read, epoll reports the socket again if there is more. In
+ * edge-triggered mode the socket has to be drained, but only up to the
+ * per-turn budgets: a client with more to read goes to the back of the
+ * ready list so the others get their turn first.
+ */
+static void
+client_service_input(struct client *c)
+{
+	struct receiver *srv = c->receiver;
+	unsigned int dispatches = 0;
+	size_t bytes = 0;
+	int nread;
+	int ret;
+
+	do {
+		if (dispatches >= client_dispatch_budget ||
+		    bytes >= client_read_budget) {
+			srv->stats.budget_requeues++;
+			wl_list_insert(srv->ready_list.prev, &c->ready_link);
+			break;
+		}
+
+		ret = wth_connection_read(c->connection);
+		if (ret < 0 && errno == EAGAIN && edge_triggered)
+			break;
+
+		if (ret < 0) {
+			wth_error("Client %p read error.\n", c);
+			client_destroy(c);
+			return;
+		}
+
+		bytes += ret;
+		nread = ret;
+
+		ret = wth_connection_dispatch(c->connection);
+		if (ret < 0 && errno != EPROTO) {
+			wth_error("Client %p dispatch error.\n", c);
+			client_destroy(c);
+			return;
+		}
+		dispatches++;
+	} while (edge_triggered && nread > 0);
+
+	/* ACK what came in right away instead of waiting for a reply to
+	 * carry it, the kernel drops out of quickack mode on its own */
+	if (bytes && c->tcp && socket_profile.quickack)
+		socket_profile_rearm_quickack(c->conn_watch.fd);
+
+	/* replies, if any, go out at the end of the iteration */
+	client_mark_dirty(c);
+}
+
+/**
+* receiver_service_ready
+*
+* Gives every client that ran out of budget in the previous iteration one
+* more turn, in the order they ran out
+*
+* @param names        struct receiver *srv
+* @param value        socket connection info and client data
+* @return             none
+*/
+void
+receiver_service_ready(struct receiver *srv)
+{
+	struct wl_list turn;
+	struct client *c;
+
+	/* clients running out of budget again go to the next round */
+	wl_list_init(&turn);
+	wl_list_insert_list(&turn, &srv->ready_list);
+	wl_list_init(&srv->ready_list);
+
+	while (!wl_list_empty(&turn)) {
+		c = wl_container_of(turn.next, c, ready_link);
+		wl_list_remove(&c->ready_link);
+		wl_list_init(&c->ready_link);
+
+		client_service_input(c);
+	}
+}
+
 /*
  * functions to handle waltham client connections
  */
@@ -327,16 +503,19 @@ connection_handle_data(struct watch *w, uint32_t events)
 		return;
 	}
 
-	if (events & EPOLLHUP) {
+	if (events & (EPOLLHUP | EPOLLRDHUP)) {
 		wth_error("Client %p hung up.\n", c);
 		client_destroy(c);
 		return;
 	}
 
 	if (events & EPOLLOUT) {
-		ret = wth_connection_flush(c->connection);
+		ret = receiver_flush_client(c);
 		if (ret == 0) {
-			watch_ctl(&c->conn_watch, EPOLL_CTL_MOD, EPOLLIN);
+			c->backlogged = false;
+			watch_ctl(&c->conn_watch, EPOLL_CTL_MOD,
+				  client_watch_events(c));
+			client_drained(c);
 		} else if (ret < 0 && errno != EAGAIN) {
 			wth_error("Client %p flush error.\n", c);
 			client_destroy(c);
@@ -344,21 +523,9 @@ connection_handle_data(struct watch *w, uint32_t events)
 		}
 	}
 
-	if (events & EPOLLIN) {
-		ret = wth_connection_read(c->connection);
-		if (ret < 0) {
-			wth_error("Client %p read error.\n", c);
-			client_destroy(c);
-			return;
-		}
-
-		ret = wth_connection_dispatch(c->connection);
-		if (ret < 0 && errno != EPROTO) {
-			wth_error("Client %p dispatch error.\n", c);
-			client_destroy(c);
-			return;
-		}
-	}
+	/* already queued for a turn, no need to read out of order */
+	if ((events & EPOLLIN) && wl_list_empty(&c->ready_link))
+		client_service_input(c);
 }
 
 /**
@@ -376,6 +543,8 @@ client_create(struct receiver *srv, struct wth_connection *conn)
 
 	struct client *c;
 	struct wth_display *disp;
+	struct sockaddr_storage addr;
+	socklen_t len;
 
 	c = zalloc(sizeof *c);
 	if (!c)
@@ -384,16 +553,38 @@ client_create(struct receiver *srv, struct wth_connection *conn)
 	c->receiver = srv;
 	c->connection = conn;
 
+	c->connect_us = get_monotonic_us();
+	c->lane.slot = -1;
+
+	len = sizeof addr;
+	if (getsockname(wth_connection_get_fd(conn),
+			(struct sockaddr *) &addr, &len) == 0)
+		c->tcp = addr.ss_family == AF_INET || addr.ss_family == AF_INET6;
+
+	len = sizeof c->peer;
+	if (getpeername(wth_connection_get_fd(conn),
+			(struct sockaddr *) &c->peer, &len) < 0)
+		c->peer.ss_family = AF_UNSPEC;
+
+	if (c->tcp)
+		socket_profile_apply_client(&socket_profile,
+					    wth_connection_get_fd(conn));
+	/* best effort, main() already warned if the kernel refuses */
+	if (c->tcp && busy_poll_us)
+		socket_set_busy_poll(wth_connection_get_fd(conn), busy_poll_us);
+
 	c->conn_watch.receiver = srv;
 	c->conn_watch.fd = wth_connection_get_fd(conn);
 	c->conn_watch.cb = connection_handle_data;
-	if (watch_ctl(&c->conn_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+	if (watch_ctl(&c->conn_watch, EPOLL_CTL_ADD, client_watch_events(c)) < 0) {
 		free(c);
 		return NULL;
 	}
 
 
 	wl_list_insert(&srv->client_list, &c->link);
+	wl_list_init(&c->dirty_link);
+	wl_list_init(&c->ready_link);
 
 	wl_list_init(&c->registry_list);
 	wl_list_init(&c->compositor_list);
@@ -403,19 +594,56 @@ client_create(struct receiver *srv, struct wth_connection *conn)
 	wl_list_init(&c->region_list);
 	wl_list_init(&c->surface_list);
 	wl_list_init(&c->buffer_list);
+	wl_list_init(&c->session_list);
+	arena_init(&c->arena);
+
+	rtt_probe_start(&c->rtt, c);
 
 	disp = wth_connection_get_display(c->connection);
 	wth_display_set_interface(disp, &display_implementation, c);
 
-	fprintf(stdout, "Client %p created\n", c);
+	fprintf(stdout, "Client %p created on reactor %u\n", c, srv->index);
 	return c;
 }
 
 
+/**
+* client_mark_dirty
+*
+* Queues the client for the next receiver_flush_clients()
+*
+* @param names        struct client *c
+* @param value        client that has output queued
+* @return             none
+*/
+void
+client_mark_dirty(struct client *c)
+{
+	/* a backlogged client gets flushed when its socket drains */
+	if (c->backlogged || !wl_list_empty(&c->dirty_link))
+		return;
+
+	wl_list_insert(c->receiver->dirty_list.prev, &c->dirty_link);
+}
+
+void
+client_account_output(struct client *c, size_t bytes)
+{
+	c->out_queued += bytes;
+	if (c->congested || !out_high_watermark ||
+	    c->out_queued <= out_high_watermark)
+		return;
+
+	c->congested = true;
+	c->receiver->stats.congestion_events++;
+	fprintf(stdout, "Client %p congested, %zu bytes queued\n",
+		c, c->out_queued);
+}
+
 /**
 * receiver_flush_clients
 *
-* write all the pending requests from the clients to socket
+* write the pending requests of the clients marked dirty to socket
 *
 * @param names        struct receiver *srv
 * @param value        socket connection info and client data
@@ -424,50 +652,124 @@ client_create(struct receiver *srv, struct wth_connection *conn)
 void
 receiver_flush_clients(struct receiver *srv)
 {
-	struct client *c, *tmp;
+	struct client *c;
 	int ret;
 
-	wl_list_for_each_safe(c, tmp, &srv->client_list, link) {
+	while (!wl_list_empty(&srv->dirty_list)) {
+		c = wl_container_of(srv->dirty_list.next, c, dirty_link);
+		wl_list_remove(&c->dirty_link);
+		wl_list_init(&c->dirty_link);
+
 		/* Flush out buffered requests. If the Waltham socket is
 		 * full, poll it for writable too.
 		 */
-		ret = wth_connection_flush(c->connection);
-		if (ret < 0 && errno == EAGAIN) {
-			watch_ctl(&c->conn_watch, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT);
+		ret = receiver_flush_client(c);
+		if (ret == 0) {
+			client_drained(c);
+		} else if (ret < 0 && errno == EAGAIN) {
+			c->backlogged = true;
+			watch_ctl(&c->conn_watch, EPOLL_CTL_MOD,
+				  client_watch_events(c));
 		} else if (ret < 0) {
 			perror("Connection flush failed");
 			client_destroy(c);
-			return;
 		}
 	}
 }
 
+static void
+receiver_admit_client(struct receiver *srv, int fd, const struct sockaddr *addr)
+{
+	enum admission_verdict verdict;
+	struct wth_connection *conn;
+
+	verdict = admission_check(srv, addr);
+	if (verdict != ADMISSION_ACCEPT) {
+		admission_reject(srv, fd, verdict);
+		return;
+	}
+
+	srv->stats.accepted++;
+
+	conn = wth_connection_from_fd(fd, WTH_CONNECTION_SIDE_SERVER);
+	if (!conn) {
+		wth_error("Failed to set up a connection.\n");
+		close(fd);
+		admission_release();
+		return;
+	}
+
+	if (!client_create(srv, conn)) {
+		wth_error("Failed client_create().\n");
+		wth_connection_destroy(conn);
+		admission_release();
+	}
+}
+
 /**
 * receiver_accept_client
 *
-* Accepts new waltham client connection and instantiates client structure
+* Accepts the pending waltham client connections, up to the accept batch,
+* and instantiates client structures for those passing admission control
 *
-* @param names        struct receiver *srv
-* @param value        socket connection info and client data
+* @param names        struct receiver *srv, int fd
+* @param value        socket connection info and client data, listening socket
+*                     (TCP or AF_UNIX) to accept from
 * @return             none
 */
 void
-receiver_accept_client(struct receiver *srv)
+receiver_accept_client(struct receiver *srv, int fd)
 {
-	struct client *client;
-	struct wth_connection *conn;
-	struct sockaddr_in addr;
+	struct sockaddr_storage addr;
 	socklen_t len;
+	unsigned int count;
+	int cfd;
+
+	/* whatever is left over keeps the socket readable, the next
+	 * iteration picks it up after the other clients had their turn */
+	for (count = 0; count < accept_batch; ) {
+		len = sizeof(addr);
+		cfd = accept4(fd, (struct sockaddr *)&addr, &len,
+			      SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (cfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN)
+				wth_error("Failed to accept a connection: %s\n",
+					  strerror(errno));
+			break;
+		}
 
-	len = sizeof(addr);
-	conn = wth_accept(srv->listen_fd, (struct sockaddr *)&addr, &len);
-	if (!conn) {
-		wth_error("Failed to accept a connection.\n");
-		return;
+		count++;
+		receiver_admit_client(srv, cfd, (struct sockaddr *)&addr);
 	}
-	client = client_create(srv, conn);
-	if (!client) {
-		wth_error("Failed client_create().\n");
+
+	if (count > srv->stats.accept_batch_max)
+		srv->stats.accept_batch_max = count;
+}
+
+/**
+* receiver_adopt_client
+*
+* Instantiates a client for a connection that was already accepted, if it
+* passes admission control
+*
+* @param names        struct receiver *srv, int fd
+* @param value        socket connection info, accepted socket
+* @return             none
+*/
+void
+receiver_adopt_client(struct receiver *srv, int fd)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+
+	len = sizeof(addr);
+	if (getpeername(fd, (struct sockaddr *)&addr, &len) < 0) {
+		/* reset by the peer already */
+		close(fd);
 		return;
 	}
+
+	receiver_admit_client(srv, fd, (struct sockaddr *)&addr);
 }
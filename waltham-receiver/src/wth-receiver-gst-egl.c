@@ -40,6 +40,7 @@
 #include <sys/mman.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <poll.h>
 #include <gst/gst.h>
 #include <gst/video/gstvideometa.h>
 #include <gst/allocators/gstdmabuf.h>
@@ -57,8 +58,13 @@
 
 #include "xdg-shell-client-protocol.h"
 
-#include "wth-receiver-seat.h"
 #include "wth-receiver-comm.h"
+#include "wth-receiver-seat.h"
+#include "wth-receiver-session.h"
+#include "wth-receiver-buffer.h"
+#include "wth-receiver-ingest.h"
+#include "wth-receiver-latency.h"
+#include "wth-receiver-socket.h"
 #include "os-compatibility.h"
 #include "bitmap.h"
 
@@ -67,7 +73,11 @@
 
 #define PIPELINE_SIZE		4096
 
-static int running = 1;
+extern bool rtp_ingest;
+extern bool latency_accounting;
+extern const char *multicast_group;
+extern const char *multicast_iface;
+extern unsigned int busy_poll_us;
 
 typedef struct _GstAppContext {
 	GMainLoop *loop;
@@ -83,6 +93,30 @@ typedef struct _GstAppContext {
 	struct window *window;
 	GstVideoInfo info;
 
+	int port;
+	struct rtp_ingest *ingest;   /* instead of udpsrc, with --rtp-ingest */
+	struct latency_probe *latency;
+	bool started;
+	char app_id[SESSION_APP_ID_MAX];
+
+	/* blob buffers, see session_show_blob() */
+	bool showing_blobs;
+	bool unpack_subimage;        /* GL_EXT_unpack_subimage */
+	int32_t blob_width;          /* of the texture */
+	int32_t blob_height;
+	int blob_fd;                 /* arrived before the first configure */
+	struct session_msg blob_msg;
+
+	/* regions set with the next blob, see session_apply_regions() */
+	struct region_set regions[SESSION_REGION_COUNT];
+	bool region_infinite[SESSION_REGION_COUNT];
+	bool region_dirty[SESSION_REGION_COUNT];
+
+	/* frame callbacks of the receiver, see session_take_frame() */
+	struct wl_callback *frame_cb;
+	uint32_t frame_seq;          /* reported once frame_cb is done */
+	uint32_t frame_wanted;       /* for the next commit, 0 for none */
+	bool frame_with_blob;        /* that commit is a blob's */
 } GstAppContext;
 
 static const gchar *vertex_shader_str =
@@ -109,6 +143,19 @@ static const gchar *fragment_shader_str =
 "gl_FragColor = c;                                     \n"
 "}                                                     \n";
 
+/*
+ * Input is not sent to the transmitter from here, the receiver owns the
+ * Waltham connection. Hand it over through the session channel instead.
+ */
+static void
+session_post(struct window *window, const struct session_msg *msg)
+{
+	if (session_msg_send(window->session_fd, msg) < 0) {
+		fprintf(stderr, "Lost the session channel, stopping\n");
+		window->running = false;
+	}
+}
+
 /*
  * pointer callbcak functions
  */
@@ -118,9 +165,12 @@ pointer_handle_enter(void *data, struct wl_pointer *wl_pointer,
 		wl_fixed_t sx, wl_fixed_t sy)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_ENTER };
 
-	waltham_pointer_enter(window, serial, sx, sy);
+	msg.input.serial = serial;
+	msg.input.x = sx;
+	msg.input.y = sy;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -128,10 +178,10 @@ pointer_handle_leave(void *data, struct wl_pointer *pointer,
 		uint32_t serial, struct wl_surface *surface)
 {
 	struct display *display = data;
-	struct window *window = display->window;
-
-	waltham_pointer_leave(window, serial);
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_LEAVE };
 
+	msg.input.serial = serial;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -139,9 +189,12 @@ pointer_handle_motion(void *data, struct wl_pointer *pointer,
 		uint32_t time, wl_fixed_t sx, wl_fixed_t sy)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_MOTION };
 
-	waltham_pointer_motion(window, time, sx, sy);
+	msg.input.time = time;
+	msg.input.x = sx;
+	msg.input.y = sy;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -150,9 +203,13 @@ pointer_handle_button(void *data, struct wl_pointer *wl_pointer,
 		uint32_t state)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_BUTTON };
 
-	waltham_pointer_button(window, serial, time, button, state);
+	msg.input.serial = serial;
+	msg.input.time = time;
+	msg.input.button = button;
+	msg.input.state = state;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -160,9 +217,12 @@ pointer_handle_axis(void *data, struct wl_pointer *wl_pointer,
 		uint32_t time, uint32_t axis, wl_fixed_t value)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_AXIS };
 
-	waltham_pointer_axis(window, time, axis, value);
+	msg.input.time = time;
+	msg.input.button = axis;
+	msg.input.x = value;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -216,16 +276,20 @@ static const struct wl_pointer_listener pointer_listener = {
 /*
  * touch callbcak functions
  */
-
 static void
 touch_handle_down(void *data, struct wl_touch *touch, uint32_t serial,
 		uint32_t time, struct wl_surface *surface, int32_t id,
 		wl_fixed_t x_w, wl_fixed_t y_w)
 {
 	struct display *display = data;
-	struct window *window = display->window;
-
-	waltham_touch_down(window, serial, time, id, x_w, y_w);
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_DOWN };
+
+	msg.input.serial = serial;
+	msg.input.time = time;
+	msg.input.id = id;
+	msg.input.x = x_w;
+	msg.input.y = y_w;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -233,9 +297,12 @@ touch_handle_up(void *data, struct wl_touch *touch, uint32_t serial,
 		uint32_t time, int32_t id)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_UP };
 
-	waltham_touch_up(window, serial, time, id);
+	msg.input.serial = serial;
+	msg.input.time = time;
+	msg.input.id = id;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -243,27 +310,31 @@ touch_handle_motion(void *data, struct wl_touch *touch, uint32_t time,
 		int32_t id, wl_fixed_t x_w, wl_fixed_t y_w)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_MOTION };
 
-	waltham_touch_motion(window, time, id, x_w, y_w);
+	msg.input.time = time;
+	msg.input.id = id;
+	msg.input.x = x_w;
+	msg.input.y = y_w;
+	session_post(display->window, &msg);
 }
 
 static void
 touch_handle_frame(void *data, struct wl_touch *touch)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_FRAME };
 
-	waltham_touch_frame(window);
+	session_post(display->window, &msg);
 }
 
 static void
 touch_handle_cancel(void *data, struct wl_touch *touch)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_CANCEL };
 
-	waltham_touch_cancel(window);
+	session_post(display->window, &msg);
 }
 
 static void
@@ -677,7 +748,9 @@ handle_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
 static void
 handle_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel)
 {
-	running = 0;
+	struct window *window = data;
+
+	window->running = false;
 }
 
 static const struct xdg_toplevel_listener xdg_toplevel_listener = {
@@ -838,11 +911,6 @@ destroy_window(struct window *window)
 	
 }
 
-static void
-signal_int(int signum)
-{
-	running = 0;
-}
 
 
 static void
@@ -915,47 +983,595 @@ drop:
 }
 
 
+static struct rtp_ingest *
+session_ingest_create(GstElement *src, int port)
+{
+	struct rtp_ingest_config config = {
+		.port = port,
+		.timestamps = latency_accounting,
+		.group = multicast_group,
+		.iface = multicast_iface,
+		.busy_poll = busy_poll_us,
+	};
+
+	return rtp_ingest_create(src, &config);
+}
+
+/* udpsrc opens its socket in session_source_open() */
+static void
+session_busy_poll_source(GstAppContext *gstctx)
+{
+	GSocket *socket = NULL;
+	GstElement *src;
+
+	if (!busy_poll_us || gstctx->ingest)
+		return;
+
+	src = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "src");
+	if (!src)
+		return;
+
+	g_object_get(src, "used-socket", &socket, NULL);
+	if (socket) {
+		socket_set_busy_poll(g_socket_get_fd(socket), busy_poll_us);
+		g_object_unref(socket);
+	}
+
+	gst_object_unref(src);
+}
+
+/*
+ * Pooled workers are spawned for the same RTP port and Linux hands a
+ * datagram to one of the sockets bound to it only, usually the latest. A
+ * warm worker must not hold one, or it swallows the stream of the session
+ * just started: the source stays locked in NULL until the surface is
+ * handed over.
+ */
+static void
+session_source_open(GstAppContext *gstctx, int port)
+{
+	GstElement *src;
+
+	src = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "src");
+	if (!src)
+		return;
+
+	if (!rtp_ingest)
+		g_object_set(src, "port", port, NULL);
+
+	gst_element_set_locked_state(src, FALSE);
+	gst_element_sync_state_with_parent(src);
+
+	/* appsrc takes buffers once it left NULL */
+	if (rtp_ingest) {
+		gstctx->ingest = session_ingest_create(src, port);
+		if (!gstctx->ingest)
+			fprintf(stderr, "No RTP ingest on port %d\n", port);
+	}
+
+	gst_object_unref(src);
+	gstctx->port = port;
+	session_busy_poll_source(gstctx);
+}
+
+/*
+ * The surface was handed over: only what depends on the app_id is left to
+ * do, the pipeline but its source is already waiting in PAUSED.
+ */
+static void
+session_start(GstAppContext *gstctx, const struct session_msg *start)
+{
+	struct session_msg msg = { .type = SESSION_MSG_STARTED };
+	struct window *window = gstctx->window;
+	uint64_t t = get_monotonic_us();
+	const char *extensions;
+
+	snprintf(gstctx->app_id, sizeof gstctx->app_id, "%s", start->start.app_id);
+
+	/* ToDo: fix the hardcoded value of width, height */
+	create_window(window, gstctx->display, WINDOW_WIDTH_SIZE,
+		      WINDOW_HEIGHT_SIZE, gstctx->app_id);
+	init_gl(gstctx->display);
+	extensions = (const char *) glGetString(GL_EXTENSIONS);
+	gstctx->unpack_subimage = extensions &&
+		wth_check_egl_extension(extensions, "GL_EXT_unpack_subimage");
+	session_stage_done(&msg, SESSION_STAGE_WINDOW, &t);
+
+	gst_element_set_state(gstctx->pipeline, GST_STATE_PLAYING);
+	session_stage_done(&msg, SESSION_STAGE_PLAYING, &t);
+
+	session_source_open(gstctx, start->start.port);
+
+	gstctx->started = true;
+	session_post(window, &msg);
+}
+
+static GstPadProbeReturn
+session_first_frame(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	struct session_msg msg = { .type = SESSION_MSG_RESUMED };
+	struct window *window = data;
+
+	/* streaming thread, the channel is a SEQPACKET socket so this
+	 * cannot interleave with input sent from the main thread */
+	session_post(window, &msg);
+
+	return GST_PAD_PROBE_REMOVE;
+}
+
+/*
+ * A reconnected transmitter took the surface over again, the window and
+ * the pipeline never went away. Report the first frame that makes it to
+ * the sink, so the receiver can tell how long the reconnect took.
+ */
+static void
+session_resume(GstAppContext *gstctx)
+{
+	GstElement *sink;
+	GstPad *pad;
+
+	/* the surface taking over counts its commits from scratch */
+	if (gstctx->frame_cb) {
+		wl_callback_destroy(gstctx->frame_cb);
+		gstctx->frame_cb = NULL;
+	}
+	gstctx->frame_wanted = 0;
+	gstctx->frame_with_blob = false;
+
+	sink = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "sink");
+	if (!sink)
+		return;
+
+	pad = gst_element_get_static_pad(sink, "sink");
+	if (pad) {
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+				  session_first_frame, gstctx->window, NULL);
+		gst_object_unref(pad);
+	}
+
+	gst_object_unref(sink);
+}
+
+/* keeps the latest frame, with what changed in the ones it replaces */
+static void
+session_hold_blob(GstAppContext *gstctx, const struct session_msg *msg, int fd)
+{
+	struct blob_damage damage = msg->buffer.damage;
+
+	if (gstctx->blob_fd >= 0 && gstctx->blob_fd != fd) {
+		blob_damage_merge(&damage, &gstctx->blob_msg.buffer.damage);
+		close(gstctx->blob_fd);
+	}
+
+	if (msg != &gstctx->blob_msg)
+		gstctx->blob_msg = *msg;
+	gstctx->blob_msg.buffer.damage = damage;
+	gstctx->blob_fd = fd;
+}
+
+static void
+blob_upload_rect(GstAppContext *gstctx, const uint8_t *pixels, int32_t stride,
+		 int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	int32_t row;
+
+	if (gstctx->unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, stride / 4);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, x);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, y);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height,
+				GL_BGRA_EXT, GL_UNSIGNED_BYTE, pixels);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	} else if (x == 0 && width * 4 == stride) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, y, width, height,
+				GL_BGRA_EXT, GL_UNSIGNED_BYTE,
+				pixels + (size_t) y * stride);
+	} else {
+		/* plain GLES2 cannot skip the rest of a row by itself */
+		for (row = y; row < y + height; row++)
+			glTexSubImage2D(GL_TEXTURE_2D, 0, x, row, width, 1,
+					GL_BGRA_EXT, GL_UNSIGNED_BYTE,
+					pixels + (size_t) row * stride + x * 4);
+	}
+}
+
+static void
+session_frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	GstAppContext *gstctx = data;
+	struct session_msg msg = { .type = SESSION_MSG_FRAME_DONE };
+
+	wl_callback_destroy(callback);
+	gstctx->frame_cb = NULL;
+
+	msg.frame.seq = gstctx->frame_seq;
+	msg.frame.time = time;
+	session_post(gstctx->window, &msg);
+}
+
+static const struct wl_callback_listener session_frame_listener = {
+	session_frame_done,
+};
+
+/*
+ * Asks for a frame callback with the next commit, on behalf of the latest
+ * commit of the receiver with frame callbacks. Its report covers the
+ * earlier commits too, so a single one is ever pending.
+ */
+static void
+session_want_frame(GstAppContext *gstctx)
+{
+	struct window *window = gstctx->window;
+
+	if (!gstctx->frame_wanted)
+		return;
+
+	if (gstctx->frame_cb)
+		wl_callback_destroy(gstctx->frame_cb);
+	gstctx->frame_cb = wl_surface_frame(window->surface);
+	wl_callback_add_listener(gstctx->frame_cb, &session_frame_listener,
+				 gstctx);
+
+	gstctx->frame_seq = gstctx->frame_wanted;
+	gstctx->frame_wanted = 0;
+	gstctx->frame_with_blob = false;
+}
+
+static void
+session_commit_frame(GstAppContext *gstctx)
+{
+	struct window *window = gstctx->window;
+
+	if (!gstctx->started || window->wait_for_configure)
+		return;
+
+	/* redraw() swaps, and so commits, unless blobs are shown; the
+	 * compositor repaints for a commit without changes too */
+	session_want_frame(gstctx);
+	if (gstctx->showing_blobs)
+		wl_surface_commit(window->surface);
+}
+
+/*
+ * SESSION_MSG_FRAME: a commit with a blob gets its frame callback along
+ * with the blob, any other one as soon as the window can be committed.
+ */
+static void
+session_take_frame(GstAppContext *gstctx, const struct session_msg *msg)
+{
+	gstctx->frame_wanted = msg->frame.seq;
+	gstctx->frame_with_blob = msg->frame.buffer;
+
+	if (!gstctx->frame_with_blob)
+		session_commit_frame(gstctx);
+}
+
+/*
+ * Collects the boxes of a region sent over in SESSION_MSG_REGION. They
+ * come from a region already, adding them is cheap.
+ */
+static void
+session_take_region(GstAppContext *gstctx, const struct session_msg *msg)
+{
+	uint32_t kind = msg->region.kind;
+	const struct region_box *box;
+	struct region_set *set;
+	int64_t width, height;
+	uint32_t i;
+
+	if (kind >= SESSION_REGION_COUNT ||
+	    msg->region.count > SESSION_REGION_BOXES)
+		return;
+
+	set = &gstctx->regions[kind];
+	if (msg->region.flags & SESSION_REGION_FIRST) {
+		region_set_clear(set);
+		gstctx->region_infinite[kind] =
+			!!(msg->region.flags & SESSION_REGION_INFINITE);
+	}
+
+	for (i = 0; i < msg->region.count; i++) {
+		box = &msg->region.boxes[i];
+		width = (int64_t) box->x2 - box->x1;
+		height = (int64_t) box->y2 - box->y1;
+		if (region_set_union_rect(set, box->x1, box->y1,
+					  width > INT32_MAX ? INT32_MAX : width,
+					  height > INT32_MAX ? INT32_MAX : height) < 0)
+			fprintf(stderr, "Out of memory for a region\n");
+	}
+
+	if (msg->region.flags & SESSION_REGION_LAST)
+		gstctx->region_dirty[kind] = true;
+}
+
+/* from blob to window coordinates, rounded down or up */
+static int32_t
+blob_to_window(int32_t v, int32_t blob_size, int32_t window_size, bool up)
+{
+	int64_t scaled = (int64_t) v * window_size;
+
+	if (up)
+		scaled += blob_size - 1;
+
+	return scaled / blob_size;
+}
+
+/*
+ * Sets the regions received since the last blob on the surface, clipped
+ * to the blob and stretched over the window as the blob is. The opaque
+ * boxes are rounded inwards and the input ones outwards, so that neither
+ * claims pixels it does not cover.
+ */
+static void
+session_apply_regions(GstAppContext *gstctx)
+{
+	struct display *display = gstctx->display;
+	struct window *window = gstctx->window;
+	int32_t bw = gstctx->blob_width, bh = gstctx->blob_height;
+	struct wl_region *region;
+	struct region_set clip;
+	struct region_box *box;
+	int32_t x1, y1, x2, y2;
+	uint32_t kind, i;
+	bool inwards;
+
+	region_set_init(&clip);
+
+	for (kind = 0; kind < SESSION_REGION_COUNT; kind++) {
+		if (!gstctx->region_dirty[kind])
+			continue;
+
+		region = NULL;
+		if (!gstctx->region_infinite[kind]) {
+			region_set_clear(&clip);
+			if (region_set_union_rect(&clip, 0, 0, bw, bh) < 0 ||
+			    region_set_intersect(&clip, &clip,
+						 &gstctx->regions[kind]) < 0)
+				continue;
+
+			inwards = kind == SESSION_REGION_OPAQUE;
+			region = wl_compositor_create_region(display->compositor);
+			for (i = 0; i < clip.count; i++) {
+				box = &clip.boxes[i];
+				x1 = blob_to_window(box->x1, bw, window->width, inwards);
+				y1 = blob_to_window(box->y1, bh, window->height, inwards);
+				x2 = blob_to_window(box->x2, bw, window->width, !inwards);
+				y2 = blob_to_window(box->y2, bh, window->height, !inwards);
+				if (x1 < x2 && y1 < y2)
+					wl_region_add(region, x1, y1, x2 - x1, y2 - y1);
+			}
+		}
+
+		if (kind == SESSION_REGION_OPAQUE)
+			wl_surface_set_opaque_region(window->surface, region);
+		else
+			wl_surface_set_input_region(window->surface, region);
+
+		if (region)
+			wl_region_destroy(region);
+		gstctx->region_dirty[kind] = false;
+	}
+
+	region_set_fini(&clip);
+}
+
+/*
+ * Shows the pixels of a blob buffer: only what changed is uploaded from
+ * the file the receiver copied them into, then the texture is drawn over
+ * the whole window. From the first blob on blobs own the window, the main
+ * loop no longer swaps buffers on its own.
+ */
+static void
+session_show_blob(GstAppContext *gstctx, const struct session_msg *msg, int fd)
+{
+	static const GLfloat positions[] = {
+		-1.0f, -1.0f,   1.0f, -1.0f,   -1.0f, 1.0f,   1.0f, 1.0f,
+	};
+	static const GLfloat texcoords[] = {
+		0.0f, 1.0f,   1.0f, 1.0f,   0.0f, 0.0f,   1.0f, 0.0f,
+	};
+	struct display *display = gstctx->display;
+	struct window *window = gstctx->window;
+	struct blob_damage damage = msg->buffer.damage;
+	const uint8_t *pixels;
+	GLint texcoord;
+	uint32_t i;
+
+	if (fd < 0) {
+		fprintf(stderr, "Blob buffer without its pixels\n");
+		return;
+	}
+
+	/* nothing may be shown before the first configure */
+	if (!gstctx->started || window->wait_for_configure) {
+		session_hold_blob(gstctx, msg, fd);
+		return;
+	}
+
+	pixels = mmap(NULL, msg->buffer.size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pixels == MAP_FAILED) {
+		fprintf(stderr, "Failed to map a blob buffer: %s\n",
+			strerror(errno));
+		return;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, display->gl.texture);
+
+	if (msg->buffer.width != gstctx->blob_width ||
+	    msg->buffer.height != gstctx->blob_height) {
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_BGRA_EXT, msg->buffer.width,
+			     msg->buffer.height, 0, GL_BGRA_EXT,
+			     GL_UNSIGNED_BYTE, NULL);
+		gstctx->blob_width = msg->buffer.width;
+		gstctx->blob_height = msg->buffer.height;
+
+		damage.count = 0;
+		blob_damage_add(&damage, 0, 0, msg->buffer.width,
+				msg->buffer.height);
+	}
+
+	blob_damage_clip(&damage, gstctx->blob_width, gstctx->blob_height);
+	for (i = 0; i < damage.count; i++)
+		blob_upload_rect(gstctx, pixels, msg->buffer.stride,
+				 damage.rects[i].x, damage.rects[i].y,
+				 damage.rects[i].width, damage.rects[i].height);
+	munmap((void *) pixels, msg->buffer.size);
+
+	texcoord = glGetAttribLocation(display->gl.program_object, "a_texCoord");
+
+	glViewport(0, 0, window->width, window->height);
+	glUseProgram(display->gl.program_object);
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, positions);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+	glEnableVertexAttribArray(texcoord);
+	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	glDisableVertexAttribArray(texcoord);
+	glDisableVertexAttribArray(0);
+
+	session_apply_regions(gstctx);
+	session_want_frame(gstctx);
+	eglSwapBuffers(display->egl.dpy, window->egl_surface);
+	gstctx->showing_blobs = true;
+}
+
+/*
+ * Handles everything the receiver queued on the session channel, so a
+ * burst of commits costs one wakeup rather than one each.
+ */
+static void
+session_drain_channel(GstAppContext *gstctx)
+{
+	struct window *window = gstctx->window;
+	struct session_msg msg;
+	int passfd;
+	int ret;
+
+	while (window->running) {
+		ret = session_msg_recv_fd(window->session_fd, &msg, &passfd,
+					  MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+
+		if (ret <= 0 || msg.type == SESSION_MSG_STOP)
+			window->running = false;
+		else if (msg.type == SESSION_MSG_START && !gstctx->started)
+			session_start(gstctx, &msg);
+		else if (msg.type == SESSION_MSG_RESUME && gstctx->started)
+			session_resume(gstctx);
+		else if (msg.type == SESSION_MSG_BUFFER)
+			session_show_blob(gstctx, &msg, passfd);
+		else if (msg.type == SESSION_MSG_REGION)
+			session_take_region(gstctx, &msg);
+		else if (msg.type == SESSION_MSG_FRAME)
+			session_take_frame(gstctx, &msg);
+	}
+}
+
+/*
+ * Waits on both the compositor connection and the session channel, so the
+ * receiver can start or stop us while we are otherwise idle.
+ */
+static int
+session_dispatch(GstAppContext *gstctx)
+{
+	struct display *display = gstctx->display;
+	struct window *window = gstctx->window;
+	struct pollfd fds[2];
+	int passfd;
+	int ret;
+
+	while (wl_display_prepare_read(display->display) != 0) {
+		if (wl_display_dispatch_pending(display->display) < 0)
+			return -1;
+	}
+
+	if (wl_display_flush(display->display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(display->display);
+		return -1;
+	}
+
+	fds[0].fd = wl_display_get_fd(display->display);
+	fds[0].events = POLLIN;
+	fds[1].fd = window->session_fd;
+	fds[1].events = POLLIN;
+
+	ret = poll(fds, ARRAY_LENGTH(fds), -1);
+	if (ret < 0) {
+		wl_display_cancel_read(display->display);
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		if (wl_display_read_events(display->display) < 0)
+			return -1;
+	} else {
+		wl_display_cancel_read(display->display);
+		if (fds[0].revents & (POLLERR | POLLHUP))
+			return -1;
+	}
+
+	if (wl_display_dispatch_pending(display->display) < 0)
+		return -1;
+
+	if (gstctx->blob_fd >= 0 && !window->wait_for_configure) {
+		passfd = gstctx->blob_fd;
+		gstctx->blob_fd = -1;
+		session_show_blob(gstctx, &gstctx->blob_msg, passfd);
+	}
+
+	/* asked for before the window could be committed */
+	if (gstctx->frame_wanted && !gstctx->frame_with_blob)
+		session_commit_frame(gstctx);
+
+	if (fds[1].revents & (POLLIN | POLLERR | POLLHUP))
+		session_drain_channel(gstctx);
+
+	return 0;
+}
+
 /**
  * wth_receiver_weston_main
  *
  * This is the main function which will handle connection to the compositor at
  * receiver side
  *
- * @param names        void *data
- * @param value        struct window data
+ * @param names        int session_fd, const char *app_id, int port
+ * @param value        session channel, app_id of the toplevel, RTP port
  * @return             0 on success, -1 on error
  */
 int
-wth_receiver_weston_main(struct window *window, const char *app_id, int port)
+wth_receiver_weston_main(int session_fd, int port)
 {
-	struct sigaction sigint;
+	struct session_msg msg = { .type = SESSION_MSG_READY };
+	struct window *window;
 	GstAppContext gstctx;
+	GstElement *src;
 	int ret = 0;
 	GError *gerror = NULL;
 	char pipeline[PIPELINE_SIZE];
+	uint64_t t = get_monotonic_us();
+	unsigned int kind;
 
 	memset(&gstctx, 0, sizeof(gstctx));
+	gstctx.blob_fd = -1;
 
-	sigint.sa_handler = signal_int;
-	sigemptyset(&sigint.sa_mask);
-	sigint.sa_flags = SA_RESETHAND;
-	sigaction(SIGINT, &sigint, NULL);
-
-	/* Initialization for window creation */
-	gstctx.display = create_display();
-	init_egl(gstctx.display);
+	window = zalloc(sizeof *window);
+	if (!window)
+		return -1;
 
-	/* ToDo: fix the hardcoded value of width, height */
-	create_window(window, gstctx.display, WINDOW_WIDTH_SIZE,
-		      WINDOW_HEIGHT_SIZE, app_id);
-	init_gl(gstctx.display);
+	window->session_fd = session_fd;
+	window->running = true;
 
 	gstctx.window = window;
-	gstctx.display->window = window;
-
-	fprintf(stderr, "display %p\n", gstctx.display);
-	fprintf(stderr, "display->window %p\n", gstctx.display->window);
-	fprintf(stderr, "window %p\n", window);
+	gstctx.port = port;
 
 	int gargc = 2;
 	char **gargv = (char**) malloc(2 * sizeof(char*));
@@ -965,14 +1581,42 @@ wth_receiver_weston_main(struct window *window, const char *app_id, int port)
 
 	/* create gstreamer pipeline */
 	gst_init(&gargc, &gargv);
+	session_stage_done(&msg, SESSION_STAGE_GST_INIT, &t);
+
+	/* Initialization for window creation */
+	gstctx.display = create_display();
+	init_egl(gstctx.display);
+	gstctx.display->window = window;
+	session_stage_done(&msg, SESSION_STAGE_DISPLAY, &t);
+
+	fprintf(stderr, "display %p\n", gstctx.display);
+	fprintf(stderr, "display->window %p\n", gstctx.display->window);
+	fprintf(stderr, "window %p\n", window);
 
-	const char *pipe = "rtpbin name=rtpbin udpsrc "
+	const char *pipe = "rtpbin name=rtpbin %s "
 		"caps=\"application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=JPEG,payload=26\" "
-		"port=%d ! rtpbin.recv_rtp_sink_0 rtpbin. ! "
-		"rtpjpegdepay ! jpegdec ! waylandsink";
+		"! rtpbin.recv_rtp_sink_0 rtpbin. ! "
+		"rtpjpegdepay name=depay ! jpegdec name=dec ! waylandsink name=sink";
+	char source[256];
+	int off;
+
+	/* the ingest thread binds the port itself, on START */
+	if (rtp_ingest) {
+		snprintf(source, sizeof(source), "appsrc name=src");
+	} else {
+		off = snprintf(source, sizeof(source), "udpsrc name=src port=%d",
+			       port);
+		if (multicast_group)
+			off += snprintf(source + off, sizeof(source) - off,
+					" address=%s auto-multicast=true",
+					multicast_group);
+		if (multicast_group && multicast_iface)
+			snprintf(source + off, sizeof(source) - off,
+				 " multicast-iface=%s", multicast_iface);
+	}
 
 	memset(pipeline, 0x00, sizeof(pipeline));
-	snprintf(pipeline, sizeof(pipeline), pipe, port);
+	snprintf(pipeline, sizeof(pipeline), pipe, source);
 
 	fprintf(stdout, "pipeline %s\n", pipeline);
 
@@ -981,8 +1625,21 @@ wth_receiver_weston_main(struct window *window, const char *app_id, int port)
 	if (!gstctx.pipeline) {
 		fprintf(stderr, "Could not create gstreamer pipeline.\n");
 		destroy_display(gstctx.display);
+		free(window);
 		return -1;
 	}
+	/* no socket before START, see session_source_open() */
+	src = gst_bin_get_by_name(GST_BIN(gstctx.pipeline), "src");
+	gst_element_set_locked_state(src, TRUE);
+	gst_object_unref(src);
+
+	/* not fatal, the stream shows up all the same */
+	if (latency_accounting) {
+		gstctx.latency = latency_probe_attach(gstctx.pipeline);
+		if (!gstctx.latency)
+			fprintf(stderr, "No latency accounting for this pipeline\n");
+	}
+	session_stage_done(&msg, SESSION_STAGE_PIPELINE, &t);
 
 	gstctx.bus = gst_element_get_bus(gstctx.pipeline);
 	gst_bus_add_signal_watch(gstctx.bus);
@@ -991,20 +1648,46 @@ wth_receiver_weston_main(struct window *window, const char *app_id, int port)
 	gst_bus_set_sync_handler(gstctx.bus, bus_sync_handler, &gstctx, NULL);
 	gst_object_unref(gstctx.bus);
 
-	gst_element_set_state(gstctx.pipeline, GST_STATE_PLAYING);
+	gst_element_set_state(gstctx.pipeline, GST_STATE_PAUSED);
+	session_stage_done(&msg, SESSION_STAGE_PAUSED, &t);
+
+	/* warm, wait for the receiver to hand us a surface */
+	session_post(window, &msg);
 
-	while (running && ret != -1) {
-		if (window->wait_for_configure) {
-			ret = wl_display_dispatch(gstctx.display->display);
+	while (window->running && ret != -1) {
+		if (!gstctx.started || window->wait_for_configure ||
+		    gstctx.showing_blobs) {
+			ret = session_dispatch(&gstctx);
 		} else {
 			ret = wl_display_dispatch_pending(gstctx.display->display);
-			redraw(window);
+
+			/* eglSwapBuffers() paces us, only peek at the channel */
+			session_drain_channel(&gstctx);
+
+			/* asked for before the window could be committed */
+			if (gstctx.frame_wanted && !gstctx.frame_with_blob)
+				session_commit_frame(&gstctx);
+
+			if (!gstctx.showing_blobs)
+				redraw(window);
 		}
 	}
 
-	gst_element_set_state(gstctx.pipeline, GST_STATE_NULL);
+	if (gstctx.blob_fd >= 0)
+		close(gstctx.blob_fd);
+	for (kind = 0; kind < SESSION_REGION_COUNT; kind++)
+		region_set_fini(&gstctx.regions[kind]);
 
-	destroy_window(window);
+	rtp_ingest_destroy(gstctx.ingest);
+	gst_element_set_state(gstctx.pipeline, GST_STATE_NULL);
+	latency_probe_detach(gstctx.latency);
+
+	if (gstctx.frame_cb)
+		wl_callback_destroy(gstctx.frame_cb);
+	if (gstctx.started)
+		destroy_window(window);
+	else
+		free(window);
 	destroy_display(gstctx.display);
 	gst_object_unref(gstctx.pipeline);
 
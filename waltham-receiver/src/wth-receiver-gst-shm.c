@@ -53,11 +53,17 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 
 #include "xdg-shell-client-protocol.h"
 
 #include "wth-receiver-comm.h"
 #include "wth-receiver-seat.h"
+#include "wth-receiver-session.h"
+#include "wth-receiver-buffer.h"
+#include "wth-receiver-ingest.h"
+#include "wth-receiver-latency.h"
+#include "wth-receiver-socket.h"
 #include "os-compatibility.h"
 #include "bitmap.h"
 
@@ -66,7 +72,21 @@
 
 #define PIPELINE_SIZE		4096
 
-static int running = 1;
+/* blobs are copied into these, only where they changed */
+#define BLOB_SLOTS		2
+
+extern bool rtp_ingest;
+extern bool latency_accounting;
+extern const char *multicast_group;
+extern const char *multicast_iface;
+extern unsigned int busy_poll_us;
+
+struct blob_slot {
+	struct wl_buffer *buffer;
+	uint8_t *data;
+	bool busy;                   /* until the compositor releases it */
+	struct blob_damage stale;    /* changed since the slot was written */
+};
 
 typedef struct _GstAppContext {
 	GMainLoop *loop;
@@ -82,8 +102,47 @@ typedef struct _GstAppContext {
 	struct window *window;
 	GstVideoInfo info;
 
+	int port;
+	struct rtp_ingest *ingest;   /* instead of udpsrc, with --rtp-ingest */
+	struct latency_probe *latency;
+	bool started;
+	char app_id[SESSION_APP_ID_MAX];
+
+	/* blob buffers, see session_show_blob() */
+	struct blob_slot blob_slots[BLOB_SLOTS];
+	uint8_t *blob_map;           /* all the slots */
+	size_t blob_map_size;
+	int32_t blob_width;
+	int32_t blob_height;
+	uint32_t blob_format;
+	int blob_fd;                 /* waiting for a configure or a slot */
+	struct session_msg blob_msg;
+
+	/* regions set with the next blob, see session_apply_regions() */
+	struct region_set regions[SESSION_REGION_COUNT];
+	bool region_infinite[SESSION_REGION_COUNT];
+	bool region_dirty[SESSION_REGION_COUNT];
+
+	/* frame callbacks of the receiver, see session_take_frame() */
+	struct wl_callback *frame_cb;
+	uint32_t frame_seq;          /* reported once frame_cb is done */
+	uint32_t frame_wanted;       /* for the next commit, 0 for none */
+	bool frame_with_blob;        /* that commit is a blob's */
 } GstAppContext;
 
+/*
+ * Input is not sent to the transmitter from here, the receiver owns the
+ * Waltham connection. Hand it over through the session channel instead.
+ */
+static void
+session_post(struct window *window, const struct session_msg *msg)
+{
+	if (session_msg_send(window->session_fd, msg) < 0) {
+		fprintf(stderr, "Lost the session channel, stopping\n");
+		window->running = false;
+	}
+}
+
 /*
  * pointer callbcak functions
  */
@@ -93,9 +152,12 @@ pointer_handle_enter(void *data, struct wl_pointer *wl_pointer,
 		wl_fixed_t sx, wl_fixed_t sy)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_ENTER };
 
-	waltham_pointer_enter(window, serial, sx, sy);
+	msg.input.serial = serial;
+	msg.input.x = sx;
+	msg.input.y = sy;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -103,9 +165,10 @@ pointer_handle_leave(void *data, struct wl_pointer *pointer,
 		uint32_t serial, struct wl_surface *surface)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_LEAVE };
 
-	waltham_pointer_leave(window, serial);
+	msg.input.serial = serial;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -113,9 +176,12 @@ pointer_handle_motion(void *data, struct wl_pointer *pointer,
 		uint32_t time, wl_fixed_t sx, wl_fixed_t sy)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_MOTION };
 
-	waltham_pointer_motion(window, time, sx, sy);
+	msg.input.time = time;
+	msg.input.x = sx;
+	msg.input.y = sy;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -124,9 +190,13 @@ pointer_handle_button(void *data, struct wl_pointer *wl_pointer,
 		uint32_t state)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_BUTTON };
 
-	waltham_pointer_button(window, serial, time, button, state);
+	msg.input.serial = serial;
+	msg.input.time = time;
+	msg.input.button = button;
+	msg.input.state = state;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -134,9 +204,12 @@ pointer_handle_axis(void *data, struct wl_pointer *wl_pointer,
 		uint32_t time, uint32_t axis, wl_fixed_t value)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_POINTER_AXIS };
 
-	waltham_pointer_axis(window, time, axis, value);
+	msg.input.time = time;
+	msg.input.button = axis;
+	msg.input.x = value;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -196,9 +269,14 @@ touch_handle_down(void *data, struct wl_touch *touch, uint32_t serial,
 		wl_fixed_t x_w, wl_fixed_t y_w)
 {
 	struct display *display = data;
-	struct window *window = display->window;
-
-	waltham_touch_down(window, serial, time, id, x_w, y_w);
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_DOWN };
+
+	msg.input.serial = serial;
+	msg.input.time = time;
+	msg.input.id = id;
+	msg.input.x = x_w;
+	msg.input.y = y_w;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -206,9 +284,12 @@ touch_handle_up(void *data, struct wl_touch *touch, uint32_t serial,
 		uint32_t time, int32_t id)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_UP };
 
-	waltham_touch_up(window, serial, time, id);
+	msg.input.serial = serial;
+	msg.input.time = time;
+	msg.input.id = id;
+	session_post(display->window, &msg);
 }
 
 static void
@@ -216,27 +297,31 @@ touch_handle_motion(void *data, struct wl_touch *touch, uint32_t time,
 		int32_t id, wl_fixed_t x_w, wl_fixed_t y_w)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_MOTION };
 
-	waltham_touch_motion(window, time, id, x_w, y_w);
+	msg.input.time = time;
+	msg.input.id = id;
+	msg.input.x = x_w;
+	msg.input.y = y_w;
+	session_post(display->window, &msg);
 }
 
 static void
 touch_handle_frame(void *data, struct wl_touch *touch)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_FRAME };
 
-	waltham_touch_frame(window);
+	session_post(display->window, &msg);
 }
 
 static void
 touch_handle_cancel(void *data, struct wl_touch *touch)
 {
 	struct display *display = data;
-	struct window *window = display->window;
+	struct session_msg msg = { .type = SESSION_MSG_TOUCH_CANCEL };
 
-	waltham_touch_cancel(window);
+	session_post(display->window, &msg);
 }
 
 static void
@@ -417,24 +502,6 @@ static const struct wl_callback_listener frame_listener = {
 	redraw
 };
 
-static struct client *to_client(struct surface *surface)
-{
-	struct ivisurface *ivisurface = NULL;
-	struct client *client = NULL;
-
-	if (!surface)
-		return NULL;
-
-	if (!surface->ivisurf)
-		return NULL;
-
-	ivisurface = surface->ivisurf;
-	if (!ivisurface->appid)
-		return client;
-
-	return ivisurface->appid->client;
-}
-
 static void
 redraw(void *data, struct wl_callback *callback, uint32_t time)
 {
@@ -443,12 +510,11 @@ redraw(void *data, struct wl_callback *callback, uint32_t time)
 
         buffer = get_next_buffer(window);
         if (!buffer) {
-		struct client *client = to_client(window->receiver_surf);
                 fprintf(stderr,
                         !callback ? "Failed to create the first buffer.\n" :
                         "Both buffers busy at redraw(). Server bug?\n");
-		client->pid_destroying = true;
-		exit(EXIT_FAILURE);
+		window->running = false;
+		return;
         }
 
 	// do the actual painting
@@ -533,7 +599,9 @@ handle_xdg_toplevel_configure(void *data, struct xdg_toplevel *xdg_toplevel,
 static void
 handle_xdg_toplevel_close(void *data, struct xdg_toplevel *xdg_toplevel)
 {
-	running = 0;
+	struct window *window = data;
+
+	window->running = false;
 }
 
 static const struct xdg_toplevel_listener xdg_toplevel_listener = {
@@ -625,12 +693,6 @@ destroy_window(struct window *window)
 	free(window);
 }
 
-static void
-signal_int(int signum)
-{
-	running = 0;
-}
-
 /*
  *  registry callback
  */
@@ -641,9 +703,10 @@ registry_handle_global(void *data, struct wl_registry *registry,
 	struct display *d = data;
 
 	if (strcmp(interface, "wl_compositor") == 0) {
+		/* 4 for wl_surface.damage_buffer */
 		d->compositor =
-			wl_registry_bind(registry,
-					 id, &wl_compositor_interface, 1);
+			wl_registry_bind(registry, id, &wl_compositor_interface,
+					 version < 4 ? version : 4);
 	} else if (strcmp(interface, "wl_seat") == 0) {
 		add_seat(d, id, version);
 	} else if (strcmp(interface, "xdg_wm_base") == 0) {
@@ -771,52 +834,681 @@ drop:
 }
 
 
+static struct rtp_ingest *
+session_ingest_create(GstElement *src, int port)
+{
+	struct rtp_ingest_config config = {
+		.port = port,
+		.timestamps = latency_accounting,
+		.group = multicast_group,
+		.iface = multicast_iface,
+		.busy_poll = busy_poll_us,
+	};
+
+	return rtp_ingest_create(src, &config);
+}
+
+/* udpsrc opens its socket in session_source_open() */
+static void
+session_busy_poll_source(GstAppContext *gstctx)
+{
+	GSocket *socket = NULL;
+	GstElement *src;
+
+	if (!busy_poll_us || gstctx->ingest)
+		return;
+
+	src = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "src");
+	if (!src)
+		return;
+
+	g_object_get(src, "used-socket", &socket, NULL);
+	if (socket) {
+		socket_set_busy_poll(g_socket_get_fd(socket), busy_poll_us);
+		g_object_unref(socket);
+	}
+
+	gst_object_unref(src);
+}
+
+/*
+ * Pooled workers are spawned for the same RTP port and Linux hands a
+ * datagram to one of the sockets bound to it only, usually the latest. A
+ * warm worker must not hold one, or it swallows the stream of the session
+ * just started: the source stays locked in NULL until the surface is
+ * handed over.
+ */
+static void
+session_source_open(GstAppContext *gstctx, int port)
+{
+	GstElement *src;
+
+	src = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "src");
+	if (!src)
+		return;
+
+	if (!rtp_ingest)
+		g_object_set(src, "port", port, NULL);
+
+	gst_element_set_locked_state(src, FALSE);
+	gst_element_sync_state_with_parent(src);
+
+	/* appsrc takes buffers once it left NULL */
+	if (rtp_ingest) {
+		gstctx->ingest = session_ingest_create(src, port);
+		if (!gstctx->ingest)
+			fprintf(stderr, "No RTP ingest on port %d\n", port);
+	}
+
+	gst_object_unref(src);
+	gstctx->port = port;
+	session_busy_poll_source(gstctx);
+}
+
+/*
+ * The surface was handed over: only what depends on the app_id is left to
+ * do, the pipeline but its source is already waiting in PAUSED.
+ */
+static void
+session_start(GstAppContext *gstctx, const struct session_msg *start)
+{
+	struct session_msg msg = { .type = SESSION_MSG_STARTED };
+	struct window *window = gstctx->window;
+	uint64_t t = get_monotonic_us();
+
+	snprintf(gstctx->app_id, sizeof gstctx->app_id, "%s", start->start.app_id);
+
+	/* ToDo: fix the hardcoded value of width, height */
+	create_window(window, gstctx->display, WINDOW_WIDTH_SIZE,
+		      WINDOW_HEIGHT_SIZE, gstctx->app_id);
+
+	/* Initialise damage to full surface, so the padding gets painted */
+	wl_surface_damage(window->surface, 0, 0,
+			  window->width, window->height);
+
+	if (!window->wait_for_configure)
+		redraw(window, NULL, 0);
+
+	session_stage_done(&msg, SESSION_STAGE_WINDOW, &t);
+
+	gst_element_set_state(gstctx->pipeline, GST_STATE_PLAYING);
+	session_stage_done(&msg, SESSION_STAGE_PLAYING, &t);
+
+	session_source_open(gstctx, start->start.port);
+
+	gstctx->started = true;
+	session_post(window, &msg);
+}
+
+static GstPadProbeReturn
+session_first_frame(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	struct session_msg msg = { .type = SESSION_MSG_RESUMED };
+	struct window *window = data;
+
+	/* streaming thread, the channel is a SEQPACKET socket so this
+	 * cannot interleave with input sent from the main thread */
+	session_post(window, &msg);
+
+	return GST_PAD_PROBE_REMOVE;
+}
+
+/*
+ * A reconnected transmitter took the surface over again, the window and
+ * the pipeline never went away. Report the first frame that makes it to
+ * the sink, so the receiver can tell how long the reconnect took.
+ */
+static void
+session_resume(GstAppContext *gstctx)
+{
+	GstElement *sink;
+	GstPad *pad;
+
+	/* the surface taking over counts its commits from scratch */
+	if (gstctx->frame_cb) {
+		wl_callback_destroy(gstctx->frame_cb);
+		gstctx->frame_cb = NULL;
+	}
+	gstctx->frame_wanted = 0;
+	gstctx->frame_with_blob = false;
+
+	sink = gst_bin_get_by_name(GST_BIN(gstctx->pipeline), "sink");
+	if (!sink)
+		return;
+
+	pad = gst_element_get_static_pad(sink, "sink");
+	if (pad) {
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER,
+				  session_first_frame, gstctx->window, NULL);
+		gst_object_unref(pad);
+	}
+
+	gst_object_unref(sink);
+}
+
+static void
+blob_slot_release(void *data, struct wl_buffer *buffer)
+{
+	struct blob_slot *slot = data;
+
+	slot->busy = false;
+}
+
+static const struct wl_buffer_listener blob_slot_listener = {
+	blob_slot_release
+};
+
+static void
+blob_slots_destroy(GstAppContext *gstctx)
+{
+	int i;
+
+	for (i = 0; i < BLOB_SLOTS; i++) {
+		if (gstctx->blob_slots[i].buffer)
+			wl_buffer_destroy(gstctx->blob_slots[i].buffer);
+	}
+	memset(gstctx->blob_slots, 0, sizeof gstctx->blob_slots);
+
+	if (gstctx->blob_map)
+		munmap(gstctx->blob_map, gstctx->blob_map_size);
+	gstctx->blob_map = NULL;
+	gstctx->blob_width = 0;
+	gstctx->blob_height = 0;
+}
+
+/* one pool for all the slots, they are only ever replaced together */
+static int
+blob_slots_create(GstAppContext *gstctx, int32_t width, int32_t height,
+		  uint32_t format)
+{
+	int32_t stride = width * 4;
+	struct wl_shm_pool *pool;
+	struct blob_slot *slot;
+	size_t size;
+	int fd, i;
+
+	size = (size_t) stride * height;
+	if (size > INT32_MAX / BLOB_SLOTS) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	fd = os_create_anonymous_file(size * BLOB_SLOTS);
+	if (fd < 0)
+		return -1;
+
+	gstctx->blob_map = mmap(NULL, size * BLOB_SLOTS, PROT_READ | PROT_WRITE,
+				MAP_SHARED, fd, 0);
+	if (gstctx->blob_map == MAP_FAILED) {
+		gstctx->blob_map = NULL;
+		close(fd);
+		return -1;
+	}
+	gstctx->blob_map_size = size * BLOB_SLOTS;
+
+	pool = wl_shm_create_pool(gstctx->display->shm, fd, size * BLOB_SLOTS);
+	for (i = 0; i < BLOB_SLOTS; i++) {
+		slot = &gstctx->blob_slots[i];
+		slot->buffer = wl_shm_pool_create_buffer(pool, i * size, width,
+							 height, stride, format);
+		wl_buffer_add_listener(slot->buffer, &blob_slot_listener, slot);
+		slot->data = gstctx->blob_map + i * size;
+		slot->busy = false;
+		/* nothing was written yet */
+		slot->stale.count = 0;
+		blob_damage_add(&slot->stale, 0, 0, width, height);
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	gstctx->blob_width = width;
+	gstctx->blob_height = height;
+	gstctx->blob_format = format;
+	return 0;
+}
+
+static void
+blob_copy_damage(uint8_t *dst, int32_t dst_stride, const uint8_t *src,
+		 int32_t src_stride, const struct blob_damage *damage)
+{
+	size_t offset, len;
+	int32_t row;
+	uint32_t i;
+
+	for (i = 0; i < damage->count; i++) {
+		len = (size_t) damage->rects[i].width * 4;
+
+		/* whole rows of the same stride are contiguous */
+		if (dst_stride == src_stride && len == (size_t) dst_stride) {
+			offset = (size_t) damage->rects[i].y * dst_stride;
+			memcpy(dst + offset, src + offset,
+			       len * damage->rects[i].height);
+			continue;
+		}
+
+		for (row = damage->rects[i].y;
+		     row < damage->rects[i].y + damage->rects[i].height; row++)
+			memcpy(dst + (size_t) row * dst_stride +
+			       damage->rects[i].x * 4,
+			       src + (size_t) row * src_stride +
+			       damage->rects[i].x * 4, len);
+	}
+}
+
+/* keeps the latest frame, with what changed in the ones it replaces */
+static void
+session_hold_blob(GstAppContext *gstctx, const struct session_msg *msg, int fd)
+{
+	struct blob_damage damage = msg->buffer.damage;
+
+	if (gstctx->blob_fd >= 0 && gstctx->blob_fd != fd) {
+		blob_damage_merge(&damage, &gstctx->blob_msg.buffer.damage);
+		close(gstctx->blob_fd);
+	}
+
+	if (msg != &gstctx->blob_msg)
+		gstctx->blob_msg = *msg;
+	gstctx->blob_msg.buffer.damage = damage;
+	gstctx->blob_fd = fd;
+}
+
+static void
+session_frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	GstAppContext *gstctx = data;
+	struct session_msg msg = { .type = SESSION_MSG_FRAME_DONE };
+
+	wl_callback_destroy(callback);
+	gstctx->frame_cb = NULL;
+
+	msg.frame.seq = gstctx->frame_seq;
+	msg.frame.time = time;
+	session_post(gstctx->window, &msg);
+}
+
+static const struct wl_callback_listener session_frame_listener = {
+	session_frame_done,
+};
+
+/*
+ * Asks for a frame callback with the next commit, on behalf of the latest
+ * commit of the receiver with frame callbacks. Its report covers the
+ * earlier commits too, so a single one is ever pending.
+ */
+static void
+session_want_frame(GstAppContext *gstctx)
+{
+	struct window *window = gstctx->window;
+
+	if (!gstctx->frame_wanted)
+		return;
+
+	if (gstctx->frame_cb)
+		wl_callback_destroy(gstctx->frame_cb);
+	gstctx->frame_cb = wl_surface_frame(window->surface);
+	wl_callback_add_listener(gstctx->frame_cb, &session_frame_listener,
+				 gstctx);
+
+	gstctx->frame_seq = gstctx->frame_wanted;
+	gstctx->frame_wanted = 0;
+	gstctx->frame_with_blob = false;
+}
+
+static void
+session_commit_frame(GstAppContext *gstctx)
+{
+	struct window *window = gstctx->window;
+
+	if (!gstctx->started || window->wait_for_configure)
+		return;
+
+	/* the compositor repaints for a commit without changes too */
+	session_want_frame(gstctx);
+	wl_surface_commit(window->surface);
+}
+
+/*
+ * SESSION_MSG_FRAME: a commit with a blob gets its frame callback along
+ * with the blob, any other one as soon as the window can be committed.
+ */
+static void
+session_take_frame(GstAppContext *gstctx, const struct session_msg *msg)
+{
+	gstctx->frame_wanted = msg->frame.seq;
+	gstctx->frame_with_blob = msg->frame.buffer;
+
+	if (!gstctx->frame_with_blob)
+		session_commit_frame(gstctx);
+}
+
+/*
+ * Collects the boxes of a region sent over in SESSION_MSG_REGION. They
+ * come from a region already, adding them is cheap.
+ */
+static void
+session_take_region(GstAppContext *gstctx, const struct session_msg *msg)
+{
+	uint32_t kind = msg->region.kind;
+	const struct region_box *box;
+	struct region_set *set;
+	int64_t width, height;
+	uint32_t i;
+
+	if (kind >= SESSION_REGION_COUNT ||
+	    msg->region.count > SESSION_REGION_BOXES)
+		return;
+
+	set = &gstctx->regions[kind];
+	if (msg->region.flags & SESSION_REGION_FIRST) {
+		region_set_clear(set);
+		gstctx->region_infinite[kind] =
+			!!(msg->region.flags & SESSION_REGION_INFINITE);
+	}
+
+	for (i = 0; i < msg->region.count; i++) {
+		box = &msg->region.boxes[i];
+		width = (int64_t) box->x2 - box->x1;
+		height = (int64_t) box->y2 - box->y1;
+		if (region_set_union_rect(set, box->x1, box->y1,
+					  width > INT32_MAX ? INT32_MAX : width,
+					  height > INT32_MAX ? INT32_MAX : height) < 0)
+			fprintf(stderr, "Out of memory for a region\n");
+	}
+
+	if (msg->region.flags & SESSION_REGION_LAST)
+		gstctx->region_dirty[kind] = true;
+}
+
+/*
+ * Sets the regions received since the last blob on the surface, clipped
+ * to the buffer. The surface is the size of the buffer, so they go
+ * unchanged, and take effect with the commit of the buffer.
+ */
+static void
+session_apply_regions(GstAppContext *gstctx, int32_t width, int32_t height)
+{
+	struct display *display = gstctx->display;
+	struct window *window = gstctx->window;
+	struct wl_region *region;
+	struct region_set clip;
+	uint32_t kind, i;
+
+	region_set_init(&clip);
+
+	for (kind = 0; kind < SESSION_REGION_COUNT; kind++) {
+		if (!gstctx->region_dirty[kind])
+			continue;
+
+		region = NULL;
+		if (!gstctx->region_infinite[kind]) {
+			region_set_clear(&clip);
+			if (region_set_union_rect(&clip, 0, 0, width, height) < 0 ||
+			    region_set_intersect(&clip, &clip,
+						 &gstctx->regions[kind]) < 0)
+				continue;
+
+			region = wl_compositor_create_region(display->compositor);
+			for (i = 0; i < clip.count; i++)
+				wl_region_add(region, clip.boxes[i].x1,
+					      clip.boxes[i].y1,
+					      clip.boxes[i].x2 - clip.boxes[i].x1,
+					      clip.boxes[i].y2 - clip.boxes[i].y1);
+		}
+
+		if (kind == SESSION_REGION_OPAQUE)
+			wl_surface_set_opaque_region(window->surface, region);
+		else
+			wl_surface_set_input_region(window->surface, region);
+
+		if (region)
+			wl_region_destroy(region);
+		gstctx->region_dirty[kind] = false;
+	}
+
+	region_set_fini(&clip);
+}
+
+/*
+ * Shows the pixels of a blob buffer, from the file the receiver copied
+ * them into. Only what changed is copied into one of our slots, and only
+ * that is damaged, so the compositor only uploads that much too. A slot
+ * also misses what changed while it was on screen, that is copied along.
+ * From the first blob on blobs own the window, the padding is no longer
+ * painted.
+ */
+static void
+session_show_blob(GstAppContext *gstctx, const struct session_msg *msg, int fd)
+{
+	struct window *window = gstctx->window;
+	const struct blob_damage *damage = &msg->buffer.damage;
+	struct blob_slot *slot = NULL;
+	struct blob_damage copy, full = { 0 };
+	const uint8_t *pixels;
+	uint32_t i;
+	int s;
+
+	if (fd < 0) {
+		fprintf(stderr, "Blob buffer without its pixels\n");
+		return;
+	}
+
+	/* nothing may be attached before the first configure */
+	if (!gstctx->started || window->wait_for_configure) {
+		session_hold_blob(gstctx, msg, fd);
+		return;
+	}
+
+	if (msg->buffer.width != gstctx->blob_width ||
+	    msg->buffer.height != gstctx->blob_height ||
+	    msg->buffer.format != gstctx->blob_format) {
+		blob_slots_destroy(gstctx);
+		if (blob_slots_create(gstctx, msg->buffer.width,
+				      msg->buffer.height,
+				      msg->buffer.format) < 0) {
+			fprintf(stderr, "No room for %dx%d blobs: %s\n",
+				msg->buffer.width, msg->buffer.height,
+				strerror(errno));
+			close(fd);
+			return;
+		}
+
+		/* a new wl_buffer has to be damaged all over */
+		blob_damage_add(&full, 0, 0, msg->buffer.width,
+				msg->buffer.height);
+		damage = &full;
+	}
+
+	for (s = 0; s < BLOB_SLOTS; s++) {
+		if (!gstctx->blob_slots[s].busy) {
+			slot = &gstctx->blob_slots[s];
+			break;
+		}
+	}
+
+	/* both on screen still, wait for a release */
+	if (!slot) {
+		session_hold_blob(gstctx, msg, fd);
+		return;
+	}
+
+	pixels = mmap(NULL, msg->buffer.size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (pixels == MAP_FAILED) {
+		fprintf(stderr, "Failed to map a blob buffer: %s\n",
+			strerror(errno));
+		return;
+	}
+
+	copy = slot->stale;
+	blob_damage_merge(&copy, damage);
+	blob_damage_clip(&copy, gstctx->blob_width, gstctx->blob_height);
+	blob_copy_damage(slot->data, gstctx->blob_width * 4, pixels,
+			 msg->buffer.stride, &copy);
+	munmap((void *) pixels, msg->buffer.size);
+
+	slot->stale.count = 0;
+	for (s = 0; s < BLOB_SLOTS; s++) {
+		if (&gstctx->blob_slots[s] != slot)
+			blob_damage_merge(&gstctx->blob_slots[s].stale, damage);
+	}
+
+	if (window->callback) {
+		wl_callback_destroy(window->callback);
+		window->callback = NULL;
+	}
+
+	wl_surface_attach(window->surface, slot->buffer, 0, 0);
+	for (i = 0; i < damage->count; i++) {
+		if (wl_proxy_get_version((struct wl_proxy *) window->surface) >=
+		    WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+			wl_surface_damage_buffer(window->surface,
+						 damage->rects[i].x,
+						 damage->rects[i].y,
+						 damage->rects[i].width,
+						 damage->rects[i].height);
+		else
+			wl_surface_damage(window->surface,
+					  damage->rects[i].x,
+					  damage->rects[i].y,
+					  damage->rects[i].width,
+					  damage->rects[i].height);
+	}
+	session_apply_regions(gstctx, msg->buffer.width, msg->buffer.height);
+	session_want_frame(gstctx);
+	wl_surface_commit(window->surface);
+	slot->busy = true;
+}
+
+/*
+ * Handles everything the receiver queued on the session channel, so a
+ * burst of commits costs one wakeup rather than one each.
+ */
+static void
+session_drain_channel(GstAppContext *gstctx)
+{
+	struct window *window = gstctx->window;
+	struct session_msg msg;
+	int passfd;
+	int ret;
+
+	while (window->running) {
+		ret = session_msg_recv_fd(window->session_fd, &msg, &passfd,
+					  MSG_DONTWAIT);
+		if (ret < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+
+		if (ret <= 0 || msg.type == SESSION_MSG_STOP)
+			window->running = false;
+		else if (msg.type == SESSION_MSG_START && !gstctx->started)
+			session_start(gstctx, &msg);
+		else if (msg.type == SESSION_MSG_RESUME && gstctx->started)
+			session_resume(gstctx);
+		else if (msg.type == SESSION_MSG_BUFFER)
+			session_show_blob(gstctx, &msg, passfd);
+		else if (msg.type == SESSION_MSG_REGION)
+			session_take_region(gstctx, &msg);
+		else if (msg.type == SESSION_MSG_FRAME)
+			session_take_frame(gstctx, &msg);
+	}
+}
+
+/*
+ * Waits on both the compositor connection and the session channel, so the
+ * receiver can start or stop us while we are otherwise idle.
+ */
+static int
+session_dispatch(GstAppContext *gstctx)
+{
+	struct display *display = gstctx->display;
+	struct window *window = gstctx->window;
+	struct pollfd fds[2];
+	int passfd;
+	int ret;
+
+	while (wl_display_prepare_read(display->display) != 0) {
+		if (wl_display_dispatch_pending(display->display) < 0)
+			return -1;
+	}
+
+	if (wl_display_flush(display->display) < 0 && errno != EAGAIN) {
+		wl_display_cancel_read(display->display);
+		return -1;
+	}
+
+	fds[0].fd = wl_display_get_fd(display->display);
+	fds[0].events = POLLIN;
+	fds[1].fd = window->session_fd;
+	fds[1].events = POLLIN;
+
+	ret = poll(fds, ARRAY_LENGTH(fds), -1);
+	if (ret < 0) {
+		wl_display_cancel_read(display->display);
+		return errno == EINTR ? 0 : -1;
+	}
+
+	if (fds[0].revents & POLLIN) {
+		if (wl_display_read_events(display->display) < 0)
+			return -1;
+	} else {
+		wl_display_cancel_read(display->display);
+		if (fds[0].revents & (POLLERR | POLLHUP))
+			return -1;
+	}
+
+	if (wl_display_dispatch_pending(display->display) < 0)
+		return -1;
+
+	if (gstctx->blob_fd >= 0 && !window->wait_for_configure) {
+		passfd = gstctx->blob_fd;
+		gstctx->blob_fd = -1;
+		session_show_blob(gstctx, &gstctx->blob_msg, passfd);
+	}
+
+	/* asked for before the window could be committed */
+	if (gstctx->frame_wanted && !gstctx->frame_with_blob)
+		session_commit_frame(gstctx);
+
+	if (fds[1].revents & (POLLIN | POLLERR | POLLHUP))
+		session_drain_channel(gstctx);
+
+	return 0;
+}
+
 /**
  * wth_receiver_weston_main
  *
  * This is the main function which will handle connection to the compositor at
  * receiver side
  *
- * @param names        void *data
- * @param value        struct window data
+ * @param names        int session_fd, int port
+ * @param value        session channel, RTP port to prepare the pipeline for
  * @return             0 on success, -1 on error
  */
 int
-wth_receiver_weston_main(struct window *window, const char *app_id, int port)
+wth_receiver_weston_main(int session_fd, int port)
 {
-	struct sigaction sigint;
+	struct session_msg msg = { .type = SESSION_MSG_READY };
+	struct window *window;
 	GstAppContext gstctx;
+	GstElement *src;
 	int ret = 0;
 	GError *gerror = NULL;
 	char pipeline[PIPELINE_SIZE];
+	uint64_t t = get_monotonic_us();
+	unsigned int kind;
 
 	memset(&gstctx, 0, sizeof(gstctx));
+	gstctx.blob_fd = -1;
 
-	sigint.sa_handler = signal_int;
-	sigemptyset(&sigint.sa_mask);
-	sigint.sa_flags = SA_RESETHAND;
-	sigaction(SIGINT, &sigint, NULL);
+	window = zalloc(sizeof *window);
+	if (!window)
+		return -1;
 
-	/* Initialization for window creation */
-	gstctx.display = create_display();
-
-	/* ToDo: fix the hardcoded value of width, height */
-	create_window(window, gstctx.display, WINDOW_WIDTH_SIZE,
-		      WINDOW_HEIGHT_SIZE, app_id);
+	window->session_fd = session_fd;
+	window->running = true;
 
 	gstctx.window = window;
-	gstctx.display->window = window;
-
-	fprintf(stderr, "display %p\n", gstctx.display);
-	fprintf(stderr, "display->window %p\n", gstctx.display->window);
-	fprintf(stderr, "window %p\n", window);
-
-	/* Initialise damage to full surface, so the padding gets painted */
-	wl_surface_damage(window->surface, 0, 0,
-			  window->width, window->height);
-
-	if (!window->wait_for_configure)
-		redraw(window, NULL, 0);
+	gstctx.port = port;
 
 	int gargc = 2;
 	char **gargv = (char**) malloc(2 * sizeof(char*));
@@ -824,28 +1516,68 @@ wth_receiver_weston_main(struct window *window, const char *app_id, int port)
 	gargv[0] = strdup("waltham-receiver");
 	gargv[1] = strdup("--gst-debug-level=2");
 
-	/* create gstreamer pipeline */
+	/* create gstreamer pipeline, this is a no-op once a previous
+	 * session of this process did it */
 	gst_init(&gargc, &gargv);
+	session_stage_done(&msg, SESSION_STAGE_GST_INIT, &t);
 
-	const char *pipe = "rtpbin name=rtpbin udpsrc "
+	/* Initialization for window creation */
+	gstctx.display = create_display();
+	gstctx.display->window = window;
+	session_stage_done(&msg, SESSION_STAGE_DISPLAY, &t);
+
+	fprintf(stderr, "display %p\n", gstctx.display);
+	fprintf(stderr, "display->window %p\n", gstctx.display->window);
+	fprintf(stderr, "window %p\n", window);
+
+	const char *pipe = "rtpbin name=rtpbin %s "
 		"caps=\"application/x-rtp,media=(string)video,clock-rate=(int)90000,encoding-name=JPEG,payload=26\" "
-		"port=%d ! rtpbin.recv_rtp_sink_0 rtpbin. ! "
-		"rtpjpegdepay ! jpegdec ! waylandsink";
+		"! rtpbin.recv_rtp_sink_0 rtpbin. ! "
+		"rtpjpegdepay name=depay ! jpegdec name=dec ! waylandsink name=sink";
+	char source[256];
+	int off;
+
+	/* the ingest thread binds the port itself, on START */
+	if (rtp_ingest) {
+		snprintf(source, sizeof(source), "appsrc name=src");
+	} else {
+		off = snprintf(source, sizeof(source), "udpsrc name=src port=%d",
+			       port);
+		if (multicast_group)
+			off += snprintf(source + off, sizeof(source) - off,
+					" address=%s auto-multicast=true",
+					multicast_group);
+		if (multicast_group && multicast_iface)
+			snprintf(source + off, sizeof(source) - off,
+				 " multicast-iface=%s", multicast_iface);
+	}
 
 	memset(pipeline, 0x00, sizeof(pipeline));
-	snprintf(pipeline, sizeof(pipeline), pipe, port);
+	snprintf(pipeline, sizeof(pipeline), pipe, source);
 
 	fprintf(stdout, "Using pipeline %s\n", pipeline);
 
 	/* parse the pipeline */
 	gstctx.pipeline = gst_parse_launch(pipeline, &gerror);
 	if (!gstctx.pipeline) {
-		struct client *client = to_client(window->receiver_surf);
-
 		fprintf(stderr, "Could not create gstreamer pipeline.\n");
-		client->pid_destroying = true;
-		exit(EXIT_FAILURE);
+		destroy_display(gstctx.display);
+		free(window);
+		free(gargv);
+		return -1;
+	}
+	/* no socket before START, see session_source_open() */
+	src = gst_bin_get_by_name(GST_BIN(gstctx.pipeline), "src");
+	gst_element_set_locked_state(src, TRUE);
+	gst_object_unref(src);
+
+	/* not fatal, the stream shows up all the same */
+	if (latency_accounting) {
+		gstctx.latency = latency_probe_attach(gstctx.pipeline);
+		if (!gstctx.latency)
+			fprintf(stderr, "No latency accounting for this pipeline\n");
 	}
+	session_stage_done(&msg, SESSION_STAGE_PIPELINE, &t);
 
 	gstctx.bus = gst_element_get_bus(gstctx.pipeline);
 	gst_bus_add_signal_watch(gstctx.bus);
@@ -856,22 +1588,36 @@ wth_receiver_weston_main(struct window *window, const char *app_id, int port)
 	gst_bus_set_sync_handler(gstctx.bus, bus_sync_handler, &gstctx, NULL);
 	gst_object_unref(gstctx.bus);
 
-	gst_element_set_state(gstctx.pipeline, GST_STATE_PLAYING);
+	gst_element_set_state(gstctx.pipeline, GST_STATE_PAUSED);
+	session_stage_done(&msg, SESSION_STAGE_PAUSED, &t);
 
-	while (running && ret != -1)
-		ret = wl_display_dispatch(gstctx.display->display);
+	/* warm, wait for the receiver to hand us a surface */
+	session_post(window, &msg);
 
+	while (window->running && ret != -1)
+		ret = session_dispatch(&gstctx);
+
+	rtp_ingest_destroy(gstctx.ingest);
 	gst_element_set_state(gstctx.pipeline, GST_STATE_NULL);
+	latency_probe_detach(gstctx.latency);
 	gst_object_unref(gstctx.pipeline);
 
-	destroy_window(window);
+	if (gstctx.blob_fd >= 0)
+		close(gstctx.blob_fd);
+	blob_slots_destroy(&gstctx);
+	for (kind = 0; kind < SESSION_REGION_COUNT; kind++)
+		region_set_fini(&gstctx.regions[kind]);
+
+	if (gstctx.frame_cb)
+		wl_callback_destroy(gstctx.frame_cb);
+	if (gstctx.started)
+		destroy_window(window);
+	else
+		free(window);
 	destroy_display(gstctx.display);
 	free(gargv);
 
 	fprintf(stdout, "Exiting, closed down gstreamer pipeline\n");
-	/* note, we do a exit here because wth_receiver_weston_main() isn't
-	 * really C's main() and we fork() before calling this. Doing a return
-	 * will not correctly signal the parent that the child process exited
-	 */
-	exit(EXIT_SUCCESS);
+
+	return ret < 0 ? -1 : 0;
 }
@@ -0,0 +1,568 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the RTP ingest of the session pipelines  **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#include <gst/app/gstappsrc.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-ingest.h"
+#include "wth-receiver-latency.h"
+#include "wth-receiver-socket.h"
+
+#ifndef UDP_GRO
+#define UDP_GRO			104
+#endif
+
+#define INGEST_BATCH		32
+#define INGEST_SLOT_SIZE	65536		/* largest GRO datagram */
+#define INGEST_COPY_MAX		(8 * 1024)	/* copied out, not handed off */
+#define INGEST_RCVBUF		(2 * 1024 * 1024)
+#define INGEST_RCVBUF_MAX	(32 * 1024 * 1024)
+#define INGEST_QUEUE_BYTES	(4 * 1024 * 1024)
+#define INGEST_CMSG_SIZE	(CMSG_SPACE(sizeof(int)) + \
+				 CMSG_SPACE(sizeof(uint32_t)) + \
+				 CMSG_SPACE(sizeof(struct scm_timestamping)))
+
+struct rtp_ingest {
+    GstElement *appsrc;
+    int fd;
+    int stop_fd;                  /* eventfd, readable once stopping */
+    pthread_t thread;
+    struct rtp_ingest_config config;
+    bool timestamps;              /* SO_TIMESTAMPING, for latency accounting */
+    int64_t realtime_offset;      /* ns, CLOCK_REALTIME - CLOCK_MONOTONIC */
+
+    int full;                     /* appsrc queue over its limit, atomic */
+    int rcvbuf;                   /* requested, the kernel doubles it */
+    uint32_t overflows;           /* last SO_RXQ_OVFL count seen */
+
+    uint64_t calls;               /* recvmmsg() calls that returned data */
+    uint64_t datagrams;
+    uint64_t packets;             /* RTP packets, GRO datagrams split */
+    uint64_t batch_max;
+    uint64_t gro_datagrams;       /* datagrams holding several packets */
+    uint64_t queue_drops;         /* packets dropped on a full appsrc */
+    uint64_t cpu_us;              /* time spent by the ingest thread */
+};
+
+/* a slot receives one datagram, mapped as long as it is not handed off */
+struct rtp_ingest_slot {
+    GstBuffer *buffer;
+    GstMapInfo map;
+};
+
+static void
+rtp_ingest_need_data(GstAppSrc *src, guint length, gpointer data)
+{
+	struct rtp_ingest *ingest = data;
+
+	__atomic_store_n(&ingest->full, 0, __ATOMIC_RELAXED);
+}
+
+static void
+rtp_ingest_enough_data(GstAppSrc *src, gpointer data)
+{
+	struct rtp_ingest *ingest = data;
+
+	__atomic_store_n(&ingest->full, 1, __ATOMIC_RELAXED);
+}
+
+static int
+rtp_ingest_set_rcvbuf(struct rtp_ingest *ingest, int size)
+{
+	/* SO_RCVBUFFORCE gets past net.core.rmem_max with CAP_NET_ADMIN */
+	if (setsockopt(ingest->fd, SOL_SOCKET, SO_RCVBUFFORCE,
+		       &size, sizeof size) < 0 &&
+	    setsockopt(ingest->fd, SOL_SOCKET, SO_RCVBUF,
+		       &size, sizeof size) < 0)
+		return -1;
+
+	ingest->rcvbuf = size;
+	return 0;
+}
+
+/*
+ * Sends the IGMP membership report on the chosen interface. Every receiver
+ * joining the group gets a copy of the stream, those on the same host too
+ * thanks to SO_REUSEADDR.
+ */
+static int
+rtp_ingest_join(struct rtp_ingest *ingest, const struct in_addr *group)
+{
+	struct ip_mreqn mreq;
+	int zero = 0;
+
+	memset(&mreq, 0, sizeof mreq);
+	mreq.imr_multiaddr = *group;
+	mreq.imr_address.s_addr = htonl(INADDR_ANY);
+	if (ingest->config.iface) {
+		mreq.imr_ifindex = if_nametoindex(ingest->config.iface);
+		if (!mreq.imr_ifindex) {
+			fprintf(stderr, "rtp ingest: no interface %s\n",
+				ingest->config.iface);
+			return -1;
+		}
+	}
+
+	if (setsockopt(ingest->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+		       &mreq, sizeof mreq) < 0) {
+		fprintf(stderr, "rtp ingest: failed to join %s: %s\n",
+			ingest->config.group, strerror(errno));
+		return -1;
+	}
+
+	/* only the group joined here, not those of other sockets */
+	setsockopt(ingest->fd, IPPROTO_IP, IP_MULTICAST_ALL, &zero, sizeof zero);
+
+	return 0;
+}
+
+static int
+rtp_ingest_open(struct rtp_ingest *ingest)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int flags;
+
+	ingest->fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (ingest->fd < 0)
+		return -1;
+
+	/* as udpsrc, other started sessions may hold the port already */
+	setsockopt(ingest->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+	if (setsockopt(ingest->fd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof one) < 0)
+		fprintf(stderr, "rtp ingest: no SO_RXQ_OVFL, drops go unnoticed\n");
+
+	/* Linux 5.0 and newer, without it every datagram comes on its own */
+	if (setsockopt(ingest->fd, IPPROTO_UDP, UDP_GRO, &one, sizeof one) < 0)
+		fprintf(stderr, "rtp ingest: no UDP_GRO\n");
+
+	/* kernel receive times of the packets, software stamps are all that
+	 * is needed to see how long they queued on the socket */
+	if (ingest->timestamps) {
+		flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+		if (setsockopt(ingest->fd, SOL_SOCKET, SO_TIMESTAMPING,
+			       &flags, sizeof flags) < 0) {
+			fprintf(stderr, "rtp ingest: no SO_TIMESTAMPING\n");
+			ingest->timestamps = false;
+		}
+	}
+
+	if (ingest->config.busy_poll)
+		socket_set_busy_poll(ingest->fd, ingest->config.busy_poll);
+
+	if (rtp_ingest_set_rcvbuf(ingest, INGEST_RCVBUF) < 0)
+		fprintf(stderr, "rtp ingest: failed to size the receive buffer\n");
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(ingest->config.port);
+
+	/* bound to the group, other traffic to the port is none of ours */
+	if (ingest->config.group &&
+	    inet_pton(AF_INET, ingest->config.group, &addr.sin_addr) != 1) {
+		fprintf(stderr, "rtp ingest: bad multicast group %s\n",
+			ingest->config.group);
+		close(ingest->fd);
+		return -1;
+	}
+
+	if (bind(ingest->fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+		fprintf(stderr, "rtp ingest: failed to bind port %d: %s\n",
+			ingest->config.port, strerror(errno));
+		close(ingest->fd);
+		return -1;
+	}
+
+	if (ingest->config.group &&
+	    rtp_ingest_join(ingest, &addr.sin_addr) < 0) {
+		close(ingest->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * A drop count that went up means the thread did not keep up with a
+ * burst, typically a key frame. Give the next burst more room.
+ */
+static void
+rtp_ingest_account_overflow(struct rtp_ingest *ingest, uint32_t overflows)
+{
+	uint32_t dropped = overflows - ingest->overflows;
+
+	if (!dropped)
+		return;
+
+	ingest->overflows = overflows;
+
+	if (ingest->rcvbuf < INGEST_RCVBUF_MAX &&
+	    rtp_ingest_set_rcvbuf(ingest, ingest->rcvbuf * 2) == 0)
+		fprintf(stderr, "rtp ingest: kernel dropped %u packets, receive "
+			"buffer now %d bytes\n", dropped, ingest->rcvbuf);
+	else
+		fprintf(stderr, "rtp ingest: kernel dropped %u packets\n",
+			dropped);
+}
+
+static int64_t
+rtp_ingest_clock_ns(clockid_t id)
+{
+	struct timespec ts;
+
+	clock_gettime(id, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* GRO segment size and kernel receive time, CLOCK_MONOTONIC, of a datagram */
+static void
+rtp_ingest_parse_cmsg(struct rtp_ingest *ingest, struct msghdr *hdr,
+		      int *gso_size, uint64_t *rx_ns)
+{
+	struct scm_timestamping stamps;
+	struct cmsghdr *cmsg;
+	int64_t ns;
+
+	*gso_size = 0;
+	*rx_ns = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if (cmsg->cmsg_level == IPPROTO_UDP &&
+		    cmsg->cmsg_type == UDP_GRO) {
+			memcpy(gso_size, CMSG_DATA(cmsg), sizeof *gso_size);
+		} else if (cmsg->cmsg_level == SOL_SOCKET &&
+			   cmsg->cmsg_type == SCM_TIMESTAMPING) {
+			memcpy(&stamps, CMSG_DATA(cmsg), sizeof stamps);
+			ns = (int64_t) stamps.ts[0].tv_sec * 1000000000 +
+			     stamps.ts[0].tv_nsec - ingest->realtime_offset;
+			if (ns > 0)
+				*rx_ns = ns;
+		}
+	}
+}
+
+/*
+ * Turns the datagram of a slot into RTP packets. Small datagrams are
+ * copied so the slot can be reused right away instead of pinning 64 KiB
+ * per packet in the jitterbuffer; GRO datagrams are split into buffers
+ * sharing the slot memory, which goes with them.
+ */
+static void
+rtp_ingest_split(struct rtp_ingest *ingest, struct rtp_ingest_slot *slot,
+		 struct msghdr *hdr, size_t len, GstBufferList *list)
+{
+	guint first = gst_buffer_list_length(list);
+	GstBuffer *packet;
+	uint64_t rx_ns;
+	size_t off, size;
+	int gso_size;
+
+	ingest->datagrams++;
+	rtp_ingest_parse_cmsg(ingest, hdr, &gso_size, &rx_ns);
+
+	if (gso_size <= 0 || (size_t) gso_size >= len) {
+		ingest->packets++;
+		if (len <= INGEST_COPY_MAX) {
+			packet = gst_buffer_new_allocate(NULL, len, NULL);
+			gst_buffer_fill(packet, 0, slot->map.data, len);
+		} else {
+			gst_buffer_unmap(slot->buffer, &slot->map);
+			gst_buffer_resize(slot->buffer, 0, len);
+			packet = slot->buffer;
+			slot->buffer = NULL;
+		}
+		gst_buffer_list_add(list, packet);
+	} else {
+		ingest->gro_datagrams++;
+		gst_buffer_unmap(slot->buffer, &slot->map);
+
+		for (off = 0; off < len; off += gso_size) {
+			size = len - off < (size_t) gso_size ?
+			       len - off : (size_t) gso_size;
+			packet = gst_buffer_copy_region(slot->buffer,
+							GST_BUFFER_COPY_MEMORY,
+							off, size);
+			gst_buffer_list_add(list, packet);
+			ingest->packets++;
+		}
+
+		gst_buffer_unref(slot->buffer);
+		slot->buffer = NULL;
+	}
+
+	/* the segments of a GRO datagram share the time of the first one */
+	if (!rx_ns)
+		return;
+
+	for (; first < gst_buffer_list_length(list); first++)
+		latency_stamp_buffer(gst_buffer_list_get_writable(list, first),
+				     LATENCY_STAMP_RX, rx_ns);
+}
+
+static void
+rtp_ingest_stamp(struct rtp_ingest *ingest, GstBufferList *list)
+{
+	GstClock *clock;
+	GstClockTime now;
+	GstBuffer *packet;
+	guint i;
+
+	/* what udpsrc does: the running time at which the packets came in */
+	clock = gst_element_get_clock(ingest->appsrc);
+	if (!clock)
+		return;
+
+	now = gst_clock_get_time(clock) -
+	      gst_element_get_base_time(ingest->appsrc);
+	gst_object_unref(clock);
+
+	for (i = 0; i < gst_buffer_list_length(list); i++) {
+		packet = gst_buffer_list_get_writable(list, i);
+		GST_BUFFER_PTS(packet) = now;
+		GST_BUFFER_DTS(packet) = now;
+	}
+}
+
+/* in busy-poll mode, a stream keeps the thread spinning between packets */
+static int
+rtp_ingest_wait(struct rtp_ingest *ingest, struct pollfd *fds, nfds_t count)
+{
+	uint64_t deadline;
+	int ret;
+
+	if (ingest->config.busy_poll) {
+		deadline = get_monotonic_us() + ingest->config.busy_poll;
+		do {
+			ret = poll(fds, count, 0);
+			if (ret != 0)
+				return ret;
+		} while (get_monotonic_us() < deadline);
+	}
+
+	return poll(fds, count, -1);
+}
+
+static void *
+rtp_ingest_thread(void *data)
+{
+	struct rtp_ingest *ingest = data;
+	struct rtp_ingest_slot slots[INGEST_BATCH];
+	struct mmsghdr msgs[INGEST_BATCH];
+	struct iovec iov[INGEST_BATCH];
+	char control[INGEST_BATCH][INGEST_CMSG_SIZE];
+	struct pollfd fds[2];
+	GstBufferList *list;
+	struct timespec ts;
+	struct cmsghdr *cmsg;
+	uint32_t overflows;
+	int i, n;
+
+	memset(slots, 0, sizeof slots);
+
+	fds[0].fd = ingest->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = ingest->stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if (rtp_ingest_wait(ingest, fds, ARRAY_LENGTH(fds)) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents)
+			break;
+
+		for (i = 0; i < INGEST_BATCH; i++) {
+			if (!slots[i].buffer) {
+				slots[i].buffer = gst_buffer_new_allocate(NULL,
+							INGEST_SLOT_SIZE, NULL);
+				gst_buffer_map(slots[i].buffer, &slots[i].map,
+					       GST_MAP_WRITE);
+			}
+
+			iov[i].iov_base = slots[i].map.data;
+			iov[i].iov_len = INGEST_SLOT_SIZE;
+			memset(&msgs[i].msg_hdr, 0, sizeof msgs[i].msg_hdr);
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+			msgs[i].msg_hdr.msg_control = control[i];
+			msgs[i].msg_hdr.msg_controllen = sizeof control[i];
+		}
+
+		n = recvmmsg(ingest->fd, msgs, INGEST_BATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0)
+			continue;
+
+		ingest->calls++;
+		if ((uint64_t) n > ingest->batch_max)
+			ingest->batch_max = n;
+
+		/* the drop count is the same on every datagram of a batch */
+		overflows = ingest->overflows;
+		for (cmsg = CMSG_FIRSTHDR(&msgs[n - 1].msg_hdr); cmsg;
+		     cmsg = CMSG_NXTHDR(&msgs[n - 1].msg_hdr, cmsg)) {
+			if (cmsg->cmsg_level == SOL_SOCKET &&
+			    cmsg->cmsg_type == SO_RXQ_OVFL)
+				memcpy(&overflows, CMSG_DATA(cmsg),
+				       sizeof overflows);
+		}
+		rtp_ingest_account_overflow(ingest, overflows);
+
+		if (ingest->timestamps)
+			ingest->realtime_offset =
+				rtp_ingest_clock_ns(CLOCK_REALTIME) -
+				rtp_ingest_clock_ns(CLOCK_MONOTONIC);
+
+		list = gst_buffer_list_new_sized(n);
+		for (i = 0; i < n; i++)
+			rtp_ingest_split(ingest, &slots[i], &msgs[i].msg_hdr,
+					 msgs[i].msg_len, list);
+
+		/* rtpbin catches up on the gap, the kernel would have dropped
+		 * them just the same if we had not read them */
+		if (__atomic_load_n(&ingest->full, __ATOMIC_RELAXED)) {
+			ingest->queue_drops += gst_buffer_list_length(list);
+			gst_buffer_list_unref(list);
+			continue;
+		}
+
+		rtp_ingest_stamp(ingest, list);
+		gst_app_src_push_buffer_list(GST_APP_SRC(ingest->appsrc), list);
+	}
+
+	for (i = 0; i < INGEST_BATCH; i++) {
+		if (!slots[i].buffer)
+			continue;
+		gst_buffer_unmap(slots[i].buffer, &slots[i].map);
+		gst_buffer_unref(slots[i].buffer);
+	}
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		ingest->cpu_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+
+	return NULL;
+}
+
+struct rtp_ingest *
+rtp_ingest_create(GstElement *appsrc, const struct rtp_ingest_config *config)
+{
+	GstAppSrcCallbacks callbacks = {
+		.need_data = rtp_ingest_need_data,
+		.enough_data = rtp_ingest_enough_data,
+	};
+	struct rtp_ingest *ingest;
+
+	ingest = zalloc(sizeof *ingest);
+	if (!ingest)
+		return NULL;
+
+	ingest->config = *config;
+	ingest->timestamps = config->timestamps;
+	if (rtp_ingest_open(ingest) < 0) {
+		free(ingest);
+		return NULL;
+	}
+
+	ingest->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (ingest->stop_fd < 0) {
+		close(ingest->fd);
+		free(ingest);
+		return NULL;
+	}
+
+	ingest->appsrc = gst_object_ref(appsrc);
+	g_object_set(appsrc, "is-live", TRUE, "format", GST_FORMAT_TIME,
+		     "max-bytes", (guint64) INGEST_QUEUE_BYTES, NULL);
+	gst_app_src_set_callbacks(GST_APP_SRC(appsrc), &callbacks, ingest, NULL);
+
+	if (pthread_create(&ingest->thread, NULL, rtp_ingest_thread, ingest) != 0) {
+		gst_object_unref(ingest->appsrc);
+		close(ingest->stop_fd);
+		close(ingest->fd);
+		free(ingest);
+		return NULL;
+	}
+
+	return ingest;
+}
+
+void
+rtp_ingest_destroy(struct rtp_ingest *ingest)
+{
+	GstAppSrcCallbacks none = { 0 };
+	uint64_t one = 1;
+
+	if (!ingest)
+		return;
+
+	if (write(ingest->stop_fd, &one, sizeof one) < 0)
+		fprintf(stderr, "rtp ingest: failed to stop the thread\n");
+	pthread_join(ingest->thread, NULL);
+
+	gst_app_src_set_callbacks(GST_APP_SRC(ingest->appsrc), &none, NULL, NULL);
+	gst_object_unref(ingest->appsrc);
+
+	fprintf(stdout, "rtp ingest on port %d: %" PRIu64 " packets in %" PRIu64
+		" datagrams, %" PRIu64 " of them GRO, %" PRIu64 " recvmmsg calls"
+		" (%.2f datagrams per call, max %" PRIu64 "), %u dropped by the"
+		" kernel, %" PRIu64 " on a full queue, %" PRIu64 " us of CPU\n",
+		ingest->config.port, ingest->packets, ingest->datagrams,
+		ingest->gro_datagrams, ingest->calls, ingest->calls ?
+		(double) ingest->datagrams / ingest->calls : 0.0,
+		ingest->batch_max, ingest->overflows, ingest->queue_drops,
+		ingest->cpu_us);
+
+	close(ingest->stop_fd);
+	close(ingest->fd);
+	free(ingest);
+}
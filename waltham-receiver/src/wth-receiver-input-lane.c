@@ -0,0 +1,283 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the input fast lane                     **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-session.h"
+#include "wth-receiver-input-lane.h"
+
+#define INPUT_LANE_SLOTS	64
+
+struct input_lane {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    uint64_t last_hello_ms;       /* 0 for a free slot */
+    uint32_t seq;
+};
+
+/*
+ * Registrations come in on one reactor while events are sent from all of
+ * them. The table is only locked on registration and when a client looks
+ * its lane up again, which it does once per change of the table.
+ */
+static pthread_mutex_t input_lane_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct input_lane input_lanes[INPUT_LANE_SLOTS];
+static unsigned int input_lane_generation = 1;
+static int input_lane_fd = -1;
+static struct watch input_lane_watch;
+
+static uint64_t
+input_lane_clock(void)
+{
+	return get_monotonic_us() / 1000;
+}
+
+static bool
+input_lane_same_host(const struct sockaddr_storage *a,
+		     const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in *a4 = (const struct sockaddr_in *) a;
+	const struct sockaddr_in *b4 = (const struct sockaddr_in *) b;
+
+	/* the listener is IPv4, as the Waltham one */
+	return a->ss_family == AF_INET && b->ss_family == AF_INET &&
+	       a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+}
+
+static void
+input_lane_register(const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+	uint64_t now = input_lane_clock();
+	struct input_lane *lane, *slot = NULL;
+	int i;
+
+	pthread_mutex_lock(&input_lane_mutex);
+
+	for (i = 0; i < INPUT_LANE_SLOTS; i++) {
+		lane = &input_lanes[i];
+		if (lane->last_hello_ms &&
+		    lane->addr_len == addr_len &&
+		    memcmp(&lane->addr, addr, addr_len) == 0) {
+			slot = lane;
+			break;
+		}
+
+		if (!slot && (!lane->last_hello_ms ||
+			      now - lane->last_hello_ms > INPUT_LANE_TIMEOUT_MS))
+			slot = lane;
+	}
+
+	if (slot) {
+		if (slot->addr_len != addr_len ||
+		    memcmp(&slot->addr, addr, addr_len) != 0) {
+			memcpy(&slot->addr, addr, addr_len);
+			slot->addr_len = addr_len;
+			slot->seq = 0;
+		}
+		slot->last_hello_ms = now;
+		__atomic_add_fetch(&input_lane_generation, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&input_lane_mutex);
+
+	if (!slot)
+		wth_error("Input lane table full\n");
+}
+
+static void
+input_lane_handle_data(struct watch *w, uint32_t events)
+{
+	struct input_lane_msg msg;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	ssize_t len;
+
+	for (;;) {
+		addr_len = sizeof addr;
+		len = recvfrom(w->fd, &msg, sizeof msg, MSG_DONTWAIT,
+			       (struct sockaddr *) &addr, &addr_len);
+		if (len < 0)
+			break;
+
+		if (len < (ssize_t) sizeof msg ||
+		    ntohl(msg.magic) != INPUT_LANE_MAGIC ||
+		    ntohl(msg.type) != INPUT_LANE_HELLO)
+			continue;
+
+		input_lane_register(&addr, addr_len);
+
+		/* tells the transmitter the lane is up */
+		sendto(w->fd, &msg, sizeof msg, MSG_DONTWAIT,
+		       (struct sockaddr *) &addr, addr_len);
+	}
+}
+
+int
+input_lane_init(struct receiver *srv, uint16_t port, int tos, int priority)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	/* marks the events for the qdisc and for the network */
+	if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority,
+		       sizeof priority) < 0)
+		wth_error("Failed to set SO_PRIORITY %d on the input lane\n",
+			  priority);
+	if (setsockopt(fd, IPPROTO_IP, IP_TOS, &tos, sizeof tos) < 0)
+		wth_error("Failed to set IP_TOS 0x%x on the input lane\n", tos);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		wth_error("Failed to bind the input lane to port %d\n", port);
+		close(fd);
+		return -1;
+	}
+
+	input_lane_watch.receiver = srv;
+	input_lane_watch.fd = fd;
+	input_lane_watch.cb = input_lane_handle_data;
+	if (watch_ctl(&input_lane_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	input_lane_fd = fd;
+	fprintf(stdout, "Input lane on UDP port %d, tos 0x%x, priority %d\n",
+		port, tos, priority);
+
+	return 0;
+}
+
+void
+input_lane_fini(struct receiver *srv)
+{
+	if (input_lane_fd < 0 || input_lane_watch.receiver != srv)
+		return;
+
+	watch_ctl(&input_lane_watch, EPOLL_CTL_DEL, 0);
+	close(input_lane_fd);
+	input_lane_fd = -1;
+}
+
+static void
+input_lane_lookup(struct client *c, unsigned int generation)
+{
+	struct input_lane_ref *ref = &c->lane;
+	struct input_lane *lane;
+	int i;
+
+	ref->generation = generation;
+	ref->slot = -1;
+
+	pthread_mutex_lock(&input_lane_mutex);
+
+	for (i = 0; i < INPUT_LANE_SLOTS; i++) {
+		lane = &input_lanes[i];
+		if (!lane->last_hello_ms ||
+		    !input_lane_same_host(&lane->addr, &c->peer))
+			continue;
+
+		/* the most recent registration of that host wins */
+		if (ref->slot >= 0 &&
+		    lane->last_hello_ms < input_lanes[ref->slot].last_hello_ms)
+			continue;
+
+		ref->slot = i;
+		ref->addr = lane->addr;
+		ref->addr_len = lane->addr_len;
+		ref->expires_ms = lane->last_hello_ms + INPUT_LANE_TIMEOUT_MS;
+	}
+
+	pthread_mutex_unlock(&input_lane_mutex);
+}
+
+int
+input_lane_send(struct client *c, const char *app_id,
+		const struct session_msg *msg)
+{
+	char buf[sizeof(struct input_lane_msg) + SESSION_APP_ID_MAX];
+	struct input_lane_msg *m = (struct input_lane_msg *) buf;
+	struct input_lane_ref *ref = &c->lane;
+	unsigned int generation;
+	size_t app_id_len;
+
+	if (input_lane_fd < 0 || !c->tcp)
+		return -1;
+
+	generation = __atomic_load_n(&input_lane_generation, __ATOMIC_ACQUIRE);
+	if (ref->generation != generation)
+		input_lane_lookup(c, generation);
+
+	if (ref->slot < 0 || input_lane_clock() > ref->expires_ms)
+		return -1;
+
+	app_id_len = strnlen(app_id, SESSION_APP_ID_MAX);
+
+	m->magic = htonl(INPUT_LANE_MAGIC);
+	m->seq = htonl(__atomic_fetch_add(&input_lanes[ref->slot].seq, 1,
+					  __ATOMIC_RELAXED));
+	m->type = htonl(msg->type);
+	m->serial = htonl(msg->input.serial);
+	m->time = htonl(msg->input.time);
+	m->id = htonl(msg->input.id);
+	m->button = htonl(msg->input.button);
+	m->state = htonl(msg->input.state);
+	m->x = htonl(msg->input.x);
+	m->y = htonl(msg->input.y);
+	m->app_id_len = htonl(app_id_len);
+	memcpy(buf + sizeof *m, app_id, app_id_len);
+
+	/* a full socket buffer is no reason to lose the event */
+	if (sendto(input_lane_fd, buf, sizeof *m + app_id_len, MSG_DONTWAIT,
+		   (struct sockaddr *) &ref->addr, ref->addr_len) < 0)
+		return -1;
+
+	c->receiver->stats.lane_events++;
+	return 0;
+}
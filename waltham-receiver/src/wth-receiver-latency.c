@@ -0,0 +1,352 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the latency accounting of the session   **
+**  pipelines                                                                 **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-latency.h"
+
+#define LATENCY_REPORT_US	(5 * 1000000)
+#define LATENCY_MAX_PROBES	4
+
+/* what a frame spent its time on, between two stamps */
+enum latency_part {
+    LATENCY_PART_NETWORK,       /* socket queue and ingest thread */
+    LATENCY_PART_JITTER,        /* rtpbin */
+    LATENCY_PART_DEPAY,         /* waiting for the rest of the frame */
+    LATENCY_PART_DECODE,
+    LATENCY_PART_PRESENT,       /* held by the sink until its render time */
+    LATENCY_PART_COUNT,
+};
+
+static const char * const latency_part_name[LATENCY_PART_COUNT] = {
+	[LATENCY_PART_NETWORK] = "network",
+	[LATENCY_PART_JITTER] = "jitterbuffer",
+	[LATENCY_PART_DEPAY] = "depayload",
+	[LATENCY_PART_DECODE] = "decode",
+	[LATENCY_PART_PRESENT] = "present",
+};
+
+static const char * const latency_stamp_caps[LATENCY_STAMP_COUNT] = {
+	[LATENCY_STAMP_RX] = "timestamp/x-wth-rx",
+	[LATENCY_STAMP_SRC] = "timestamp/x-wth-src",
+	[LATENCY_STAMP_DEPAY] = "timestamp/x-wth-depay",
+	[LATENCY_STAMP_DECODE] = "timestamp/x-wth-decode",
+	[LATENCY_STAMP_SINK] = "timestamp/x-wth-sink",
+};
+
+struct latency_part_stats {
+    uint64_t total_ns;
+    uint64_t max_ns;
+    unsigned int count;
+};
+
+struct latency_probe {
+    GstElement *pipeline;
+
+    GstPad *pads[LATENCY_MAX_PROBES];
+    gulong ids[LATENCY_MAX_PROBES];
+    unsigned int probe_count;
+
+    /* sink streaming thread only, until detached */
+    unsigned int frames;
+    uint64_t report_us;
+    struct latency_part_stats parts[LATENCY_PART_COUNT];
+};
+
+static GstCaps *latency_caps[LATENCY_STAMP_COUNT];
+static pthread_once_t latency_caps_once = PTHREAD_ONCE_INIT;
+
+static void
+latency_caps_init(void)
+{
+	int i;
+
+	/* shared by every session of a process, never freed */
+	for (i = 0; i < LATENCY_STAMP_COUNT; i++)
+		latency_caps[i] = gst_caps_new_empty_simple(latency_stamp_caps[i]);
+}
+
+void
+latency_stamp_buffer(GstBuffer *buffer, enum latency_stamp stamp, uint64_t ns)
+{
+	pthread_once(&latency_caps_once, latency_caps_init);
+
+	gst_buffer_add_reference_timestamp_meta(buffer, latency_caps[stamp],
+						ns, GST_CLOCK_TIME_NONE);
+}
+
+static uint64_t
+latency_buffer_stamp(GstBuffer *buffer, enum latency_stamp stamp)
+{
+	GstReferenceTimestampMeta *meta;
+
+	/* the first one is the one of the first packet of the frame */
+	meta = gst_buffer_get_reference_timestamp_meta(buffer, latency_caps[stamp]);
+
+	return meta ? meta->timestamp : 0;
+}
+
+static GstPadProbeReturn
+latency_stamp_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	enum latency_stamp stamp = GPOINTER_TO_INT(data);
+	uint64_t ns = get_monotonic_us() * 1000;
+	GstBufferList *list;
+	GstBuffer *buffer;
+	guint i;
+
+	if (info->type & GST_PAD_PROBE_TYPE_BUFFER_LIST) {
+		list = gst_buffer_list_make_writable(
+				GST_PAD_PROBE_INFO_BUFFER_LIST(info));
+		for (i = 0; i < gst_buffer_list_length(list); i++)
+			latency_stamp_buffer(gst_buffer_list_get_writable(list, i),
+					     stamp, ns);
+		GST_PAD_PROBE_INFO_DATA(info) = list;
+	} else {
+		buffer = gst_buffer_make_writable(GST_PAD_PROBE_INFO_BUFFER(info));
+		latency_stamp_buffer(buffer, stamp, ns);
+		GST_PAD_PROBE_INFO_DATA(info) = buffer;
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+/*
+ * waylandsink syncs on the clock: the frame is held until the running
+ * time of its timestamp plus the pipeline latency. What the compositor
+ * takes on top of that is not seen from here.
+ */
+static uint64_t
+latency_sync_wait(struct latency_probe *probe, GstPad *pad, GstBuffer *buffer)
+{
+	const GstSegment *segment;
+	GstClockTime running, render, now;
+	GstClock *clock;
+	GstEvent *event;
+
+	if (!GST_BUFFER_PTS_IS_VALID(buffer))
+		return 0;
+
+	event = gst_pad_get_sticky_event(pad, GST_EVENT_SEGMENT, 0);
+	if (!event)
+		return 0;
+
+	gst_event_parse_segment(event, &segment);
+	running = gst_segment_to_running_time(segment, GST_FORMAT_TIME,
+					      GST_BUFFER_PTS(buffer));
+	gst_event_unref(event);
+	if (!GST_CLOCK_TIME_IS_VALID(running))
+		return 0;
+
+	clock = gst_element_get_clock(probe->pipeline);
+	if (!clock)
+		return 0;
+
+	now = gst_clock_get_time(clock);
+	gst_object_unref(clock);
+
+	render = gst_element_get_base_time(probe->pipeline) + running +
+		 gst_pipeline_get_latency(GST_PIPELINE(probe->pipeline));
+
+	return render > now ? render - now : 0;
+}
+
+static void
+latency_account(struct latency_probe *probe, enum latency_part part,
+		uint64_t from, uint64_t to)
+{
+	struct latency_part_stats *stats = &probe->parts[part];
+
+	/* a stage whose meta did not make it through is left out */
+	if (!from || !to || to < from)
+		return;
+
+	stats->total_ns += to - from;
+	if (to - from > stats->max_ns)
+		stats->max_ns = to - from;
+	stats->count++;
+}
+
+static void
+latency_report(struct latency_probe *probe)
+{
+	struct latency_part_stats *stats;
+	char line[512];
+	int len, i;
+
+	if (!probe->frames)
+		return;
+
+	len = snprintf(line, sizeof line, "latency of %u frames, avg/max ms:",
+		       probe->frames);
+	for (i = 0; i < LATENCY_PART_COUNT; i++) {
+		stats = &probe->parts[i];
+		if (!stats->count || len >= (int) sizeof line)
+			continue;
+		len += snprintf(line + len, sizeof line - len, " %s %.2f/%.2f",
+				latency_part_name[i],
+				stats->total_ns / 1e6 / stats->count,
+				stats->max_ns / 1e6);
+	}
+	fprintf(stdout, "%s\n", line);
+
+	probe->frames = 0;
+	memset(probe->parts, 0, sizeof probe->parts);
+}
+
+static GstPadProbeReturn
+latency_sink_probe(GstPad *pad, GstPadProbeInfo *info, gpointer data)
+{
+	struct latency_probe *probe = data;
+	GstBuffer *buffer = GST_PAD_PROBE_INFO_BUFFER(info);
+	uint64_t stamps[LATENCY_STAMP_COUNT];
+	uint64_t wait;
+	int i;
+
+	if (!(info->type & GST_PAD_PROBE_TYPE_BUFFER))
+		return GST_PAD_PROBE_OK;
+
+	for (i = 0; i < LATENCY_STAMP_SINK; i++)
+		stamps[i] = latency_buffer_stamp(buffer, i);
+	stamps[LATENCY_STAMP_SINK] = get_monotonic_us() * 1000;
+
+	latency_account(probe, LATENCY_PART_NETWORK,
+			stamps[LATENCY_STAMP_RX], stamps[LATENCY_STAMP_SRC]);
+	latency_account(probe, LATENCY_PART_JITTER,
+			stamps[LATENCY_STAMP_SRC], stamps[LATENCY_STAMP_DEPAY]);
+	latency_account(probe, LATENCY_PART_DEPAY,
+			stamps[LATENCY_STAMP_DEPAY], stamps[LATENCY_STAMP_DECODE]);
+	latency_account(probe, LATENCY_PART_DECODE,
+			stamps[LATENCY_STAMP_DECODE], stamps[LATENCY_STAMP_SINK]);
+
+	wait = latency_sync_wait(probe, pad, buffer);
+	latency_account(probe, LATENCY_PART_PRESENT, stamps[LATENCY_STAMP_SINK],
+			stamps[LATENCY_STAMP_SINK] + wait);
+
+	probe->frames++;
+	if (stamps[LATENCY_STAMP_SINK] / 1000 - probe->report_us >= LATENCY_REPORT_US) {
+		latency_report(probe);
+		probe->report_us = stamps[LATENCY_STAMP_SINK] / 1000;
+	}
+
+	return GST_PAD_PROBE_OK;
+}
+
+static int
+latency_probe_add(struct latency_probe *probe, const char *name,
+		  const char *pad_name, GstPadProbeCallback cb, gpointer data)
+{
+	GstElement *element;
+	GstPad *pad;
+
+	element = gst_bin_get_by_name(GST_BIN(probe->pipeline), name);
+	if (!element) {
+		fprintf(stderr, "latency: no element named %s\n", name);
+		return -1;
+	}
+
+	pad = gst_element_get_static_pad(element, pad_name);
+	gst_object_unref(element);
+	if (!pad)
+		return -1;
+
+	probe->pads[probe->probe_count] = pad;
+	probe->ids[probe->probe_count] =
+		gst_pad_add_probe(pad, GST_PAD_PROBE_TYPE_BUFFER |
+				  GST_PAD_PROBE_TYPE_BUFFER_LIST, cb, data, NULL);
+	probe->probe_count++;
+
+	return 0;
+}
+
+static void
+latency_probe_remove(struct latency_probe *probe)
+{
+	unsigned int i;
+
+	for (i = 0; i < probe->probe_count; i++) {
+		gst_pad_remove_probe(probe->pads[i], probe->ids[i]);
+		gst_object_unref(probe->pads[i]);
+	}
+
+	free(probe);
+}
+
+struct latency_probe *
+latency_probe_attach(GstElement *pipeline)
+{
+	struct latency_probe *probe;
+
+	pthread_once(&latency_caps_once, latency_caps_init);
+
+	probe = zalloc(sizeof *probe);
+	if (!probe)
+		return NULL;
+
+	probe->pipeline = pipeline;
+	probe->report_us = get_monotonic_us();
+
+	if (latency_probe_add(probe, LATENCY_ELEMENT_SRC, "src",
+			      latency_stamp_probe,
+			      GINT_TO_POINTER(LATENCY_STAMP_SRC)) < 0 ||
+	    latency_probe_add(probe, LATENCY_ELEMENT_DEPAY, "sink",
+			      latency_stamp_probe,
+			      GINT_TO_POINTER(LATENCY_STAMP_DEPAY)) < 0 ||
+	    latency_probe_add(probe, LATENCY_ELEMENT_DECODER, "sink",
+			      latency_stamp_probe,
+			      GINT_TO_POINTER(LATENCY_STAMP_DECODE)) < 0 ||
+	    latency_probe_add(probe, LATENCY_ELEMENT_SINK, "sink",
+			      latency_sink_probe, probe) < 0) {
+		latency_probe_remove(probe);
+		return NULL;
+	}
+
+	return probe;
+}
+
+void
+latency_probe_detach(struct latency_probe *probe)
+{
+	if (!probe)
+		return;
+
+	latency_report(probe);
+	latency_probe_remove(probe);
+}
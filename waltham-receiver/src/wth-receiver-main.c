@@ -35,18 +35,81 @@
 
 #include <signal.h>
 #include <sys/types.h>
-#include <sys/wait.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
 
 #include "wth-receiver-comm.h"
+#include "wth-receiver-session.h"
+#include "wth-receiver-uring.h"
+#include "wth-receiver-socket.h"
+#include "wth-receiver-admission.h"
+#include "wth-receiver-input-lane.h"
 
-#define MAX_EPOLL_WATCHES 	2
 #define DEFAULT_TCP_PORT	34400
+#define DEFAULT_READ_BUDGET	(64 * 1024)
+#define DEFAULT_DISPATCH_BUDGET	16
+#define URING_ENTRIES		256
+#define MAX_REACTORS		64
+#define DEFAULT_ACCEPT_BATCH	16
+#define DEFAULT_RTT_INTERVAL	1000
+#define DEFAULT_INPUT_TOS	0xb8	/* DSCP EF */
+#define INPUT_LANE_PRIORITY	6	/* TC_PRIO_INTERACTIVE */
+#define DEFAULT_OUT_HIGH	(64 * 1024)
+#define BUSY_POLL_MIN_SPIN	8	/* us, below that the loop just blocks */
+#define BUSY_POLL_BUDGET	64	/* packets per device poll, as NAPI */
+
+/* Linux 6.9, busy polling configured per epoll instance */
+#ifndef EPIOCSPARAMS
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t __pad;
+};
+#define EPIOCSPARAMS	_IOW(0x8A, 0x01, struct epoll_params)
+#endif
 
 uint16_t tcp_port = 0;
+uint16_t rtp_port = 0;
+const char *multicast_group = NULL;
+const char *multicast_iface = NULL;
+bool tcp_listen = true;
+const char *unix_socket_path = NULL;
 const char *my_app_id = NULL;
-static bool *signal_int_handler_run_flag;
+enum session_mode session_mode = SESSION_MODE_FORK;
+unsigned int session_pool_size = 0;
+enum session_pool_refill session_pool_refill = SESSION_POOL_REFILL_EAGER;
+unsigned int session_resume_grace = 0;
+unsigned int reactor_count = 1;
+struct receiver *reactors = NULL;
+int receiver_quit_fd = -1;
+bool edge_triggered = false;
+size_t client_read_budget = DEFAULT_READ_BUDGET;
+unsigned int client_dispatch_budget = DEFAULT_DISPATCH_BUDGET;
+enum receiver_backend receiver_backend = RECEIVER_BACKEND_EPOLL;
+unsigned int accept_batch = DEFAULT_ACCEPT_BATCH;
+unsigned int rtt_probe_interval = DEFAULT_RTT_INTERVAL;
+uint16_t input_lane_port = 0;
+int input_lane_tos = DEFAULT_INPUT_TOS;
+unsigned int max_clients = 0;
+unsigned int accept_rate = 0;
+unsigned int accept_burst = 0;
+size_t out_high_watermark = DEFAULT_OUT_HIGH;
+size_t out_low_watermark = DEFAULT_OUT_HIGH / 4;
+bool rtp_ingest = false;
+bool latency_accounting = false;
+unsigned int busy_poll_us = 0;
+struct socket_profile socket_profile = {
+	.nodelay = true,
+	.quickack = true,
+	.fastopen = 16,
+};
 
 /** Print out the application help
  */
@@ -56,17 +119,143 @@ usage(void)
 	printf("Usage: waltham receiver [options]\n");
 	printf("Options:\n");
 	printf("  -p --port number          TCP port number\n");
+	printf("  -u --unix-socket path     Also accept transmitters on an AF_UNIX\n");
+	printf("                            socket bound to path\n");
+	printf("  -T --no-tcp               Only accept transmitters on the AF_UNIX\n");
+	printf("                            socket, the port still sets the RTP port\n");
+	printf("  -o --rtp-port number      UDP port the RTP streams arrive on\n");
+	printf("                            (default: the TCP port number)\n");
+	printf("  -M --multicast grp[@if]   Receive the RTP streams from the IPv4\n");
+	printf("                            multicast group grp, joined on\n");
+	printf("                            interface if\n");
 	printf("  -i --app_id               Specify an app_id\n");
+	printf("  -m --session-mode mode    Run each surface stream in a 'fork'ed\n");
+	printf("                            child (default) or in a 'thread'\n");
+	printf("  -n --pool-size number     Keep number of pre-warmed session\n");
+	printf("                            workers around (default 0)\n");
+	printf("  -r --pool-refill policy   Replace pooled workers 'eager'ly\n");
+	printf("                            (default), 'lazy' after a session\n");
+	printf("                            ended, or 'none'\n");
+	printf("  -g --resume-grace ms      Keep the sessions of a transmitter that\n");
+	printf("                            disconnected running for ms, for it\n");
+	printf("                            to take them over again when it\n");
+	printf("                            reconnects (default 0, off)\n");
+	printf("  -t --reactors number      Serve transmitters from number event\n");
+	printf("                            loop threads (default 1)\n");
+	printf("  -e --edge-triggered       Poll clients edge-triggered, reading\n");
+	printf("                            each up to a budget per turn\n");
+	printf("  -b --read-budget bytes    Bytes read from one client per turn\n");
+	printf("                            in edge-triggered mode (default %d)\n",
+	       DEFAULT_READ_BUDGET);
+	printf("  -d --dispatch-budget n    Reads dispatched for one client per\n");
+	printf("                            turn in edge-triggered mode (default %d)\n",
+	       DEFAULT_DISPATCH_BUDGET);
+	printf("  -k --backend backend      Wait for events with 'epoll' (default)\n");
+	printf("                            or 'io_uring'\n");
+	printf("  -s --socket-profile list  TCP options of the connections, comma\n");
+	printf("                            separated key=value: nodelay, quickack\n");
+	printf("                            (0 or 1, default 1), sndbuf, rcvbuf\n");
+	printf("                            (bytes), user-timeout (ms),\n");
+	printf("                            notsent-lowat (bytes), 0 for the\n");
+	printf("                            kernel default (default), fastopen\n");
+	printf("                            (queue length, default 16, 0 off)\n");
+	printf("  -a --accept-batch number  Connections accepted at once before\n");
+	printf("                            serving the others (default %d)\n",
+	       DEFAULT_ACCEPT_BATCH);
+	printf("  -c --max-clients number   Turn down connections beyond number\n");
+	printf("                            clients (default 0, no limit)\n");
+	printf("  -R --accept-rate r[/b]    Turn down sources connecting more than\n");
+	printf("                            r times per second, in bursts of b\n");
+	printf("                            (default r), 0 for no limit (default)\n");
+	printf("  -P --rtt-interval ms      Sample the round trip time of every\n");
+	printf("                            transmitter every ms (default %d),\n",
+	       DEFAULT_RTT_INTERVAL);
+	printf("                            0 for never\n");
+	printf("  -I --input-port number    Let transmitters register on UDP port\n");
+	printf("                            number to get seat events over their\n");
+	printf("                            own socket (default 0, off)\n");
+	printf("  -Q --input-tos value      IP_TOS of the seat events sent on the\n");
+	printf("                            input port (default 0x%x)\n",
+	       DEFAULT_INPUT_TOS);
+	printf("  -w --watermarks high[/lo] Bytes queued for a transmitter before\n");
+	printf("                            motion events are merged, until its\n");
+	printf("                            socket drains below lo (default %d/%d),\n",
+	       DEFAULT_OUT_HIGH, DEFAULT_OUT_HIGH / 4);
+	printf("                            0 for no limit\n");
+	printf("  -G --rtp-ingest           Read the RTP streams in batches from\n");
+	printf("                            a thread of each session instead of\n");
+	printf("                            with udpsrc\n");
+	printf("  -L --latency              Print where the frames of every session\n");
+	printf("                            spend their time, from the network to\n");
+	printf("                            the sink\n");
+	printf("  -B --busy-poll usecs      Busy poll the Waltham and RTP sockets\n");
+	printf("                            and spin up to usecs for events\n");
+	printf("                            before sleeping, trading CPU for\n");
+	printf("                            latency (default 0, off)\n");
 	printf("  -h --help                 Usage\n");
 }
 
 static struct option long_options[] = {
 	{"port",     required_argument,  0,  'p'},
+	{"unix-socket", required_argument, 0, 'u'},
+	{"no-tcp",   no_argument,        0,  'T'},
+	{"rtp-port", required_argument,  0,  'o'},
+	{"multicast", required_argument, 0,  'M'},
 	{"app_id",   required_argument,  NULL,  'i'},
+	{"session-mode", required_argument, 0, 'm'},
+	{"pool-size", required_argument, 0, 'n'},
+	{"pool-refill", required_argument, 0, 'r'},
+	{"resume-grace", required_argument, 0, 'g'},
+	{"reactors", required_argument, 0, 't'},
+	{"edge-triggered", no_argument, 0, 'e'},
+	{"read-budget", required_argument, 0, 'b'},
+	{"dispatch-budget", required_argument, 0, 'd'},
+	{"backend", required_argument, 0, 'k'},
+	{"socket-profile", required_argument, 0, 's'},
+	{"accept-batch", required_argument, 0, 'a'},
+	{"max-clients", required_argument, 0, 'c'},
+	{"accept-rate", required_argument, 0, 'R'},
+	{"rtt-interval", required_argument, 0, 'P'},
+	{"input-port", required_argument, 0, 'I'},
+	{"input-tos", required_argument, 0, 'Q'},
+	{"watermarks", required_argument, 0, 'w'},
+	{"rtp-ingest", no_argument, 0, 'G'},
+	{"latency", no_argument, 0, 'L'},
+	{"busy-poll", required_argument, 0, 'B'},
 	{"help",     no_argument,    0,  'h'},
 	{0,          0,              0,   0}
 };
 
+/*
+ * group[@iface], the group has to be IPv4 multicast. The strings end up in
+ * the pipeline description of every session.
+ */
+static int
+parse_multicast(char *arg)
+{
+	struct in_addr group;
+	char *iface;
+
+	iface = strchr(arg, '@');
+	if (iface) {
+		*iface++ = '\0';
+		if (!*iface || strlen(iface) >= IFNAMSIZ) {
+			wth_error("Bad multicast interface '%s'\n", iface);
+			return -1;
+		}
+		multicast_iface = iface;
+	}
+
+	if (inet_pton(AF_INET, arg, &group) != 1 ||
+	    !IN_MULTICAST(ntohl(group.s_addr))) {
+		wth_error("Bad multicast group '%s'\n", arg);
+		return -1;
+	}
+
+	multicast_group = arg;
+	return 0;
+}
+
 /**
  * parse_args
  *
@@ -83,8 +272,9 @@ parse_args(int argc, char *argv[])
 {
 	int c = -1;
 	int long_index = 0;
+	int ret;
 
-	while ((c = getopt_long(argc, argv, "i:p:vh",
+	while ((c = getopt_long(argc, argv, "a:b:B:c:d:eg:Gi:I:k:Lm:M:n:o:p:P:Q:r:R:s:t:Tu:w:vh",
 					long_options,
 					&long_index)) != -1) {
 		switch (c) {
@@ -94,6 +284,133 @@ parse_args(int argc, char *argv[])
 			case 'p':
 				tcp_port = (uint16_t) atoi(optarg);
 				break;
+			case 'o':
+				rtp_port = (uint16_t) atoi(optarg);
+				break;
+			case 'M':
+				if (parse_multicast(optarg) < 0)
+					return -1;
+				break;
+			case 'u':
+				unix_socket_path = optarg;
+				break;
+			case 'T':
+				tcp_listen = false;
+				break;
+			case 'm':
+				if (strcmp(optarg, "fork") == 0) {
+					session_mode = SESSION_MODE_FORK;
+				} else if (strcmp(optarg, "thread") == 0) {
+					session_mode = SESSION_MODE_THREAD;
+				} else {
+					wth_error("Unknown session mode '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 'n':
+				session_pool_size = (unsigned int) atoi(optarg);
+				break;
+			case 'r':
+				if (strcmp(optarg, "eager") == 0) {
+					session_pool_refill = SESSION_POOL_REFILL_EAGER;
+				} else if (strcmp(optarg, "lazy") == 0) {
+					session_pool_refill = SESSION_POOL_REFILL_LAZY;
+				} else if (strcmp(optarg, "none") == 0) {
+					session_pool_refill = SESSION_POOL_REFILL_NONE;
+				} else {
+					wth_error("Unknown pool refill policy '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 'g':
+				session_resume_grace = (unsigned int) atoi(optarg);
+				break;
+			case 't':
+				reactor_count = (unsigned int) atoi(optarg);
+				if (reactor_count < 1 || reactor_count > MAX_REACTORS) {
+					wth_error("Reactor count must be within 1..%d\n",
+						  MAX_REACTORS);
+					return -1;
+				}
+				break;
+			case 'e':
+				edge_triggered = true;
+				break;
+			case 'b':
+				client_read_budget = (size_t) atoi(optarg);
+				if (client_read_budget == 0) {
+					wth_error("Read budget must be positive\n");
+					return -1;
+				}
+				break;
+			case 'd':
+				client_dispatch_budget = (unsigned int) atoi(optarg);
+				if (client_dispatch_budget == 0) {
+					wth_error("Dispatch budget must be positive\n");
+					return -1;
+				}
+				break;
+			case 'k':
+				if (strcmp(optarg, "epoll") == 0) {
+					receiver_backend = RECEIVER_BACKEND_EPOLL;
+				} else if (strcmp(optarg, "io_uring") == 0) {
+					receiver_backend = RECEIVER_BACKEND_IO_URING;
+				} else {
+					wth_error("Unknown backend '%s'\n", optarg);
+					return -1;
+				}
+				break;
+			case 's':
+				if (socket_profile_parse(&socket_profile, optarg) < 0)
+					return -1;
+				break;
+			case 'a':
+				accept_batch = (unsigned int) atoi(optarg);
+				if (accept_batch == 0) {
+					wth_error("Accept batch must be positive\n");
+					return -1;
+				}
+				break;
+			case 'c':
+				max_clients = (unsigned int) atoi(optarg);
+				break;
+			case 'R':
+				if (sscanf(optarg, "%u/%u", &accept_rate,
+					   &accept_burst) < 1) {
+					wth_error("Bad accept rate '%s'\n", optarg);
+					return -1;
+				}
+				if (accept_burst == 0)
+					accept_burst = accept_rate;
+				break;
+			case 'P':
+				rtt_probe_interval = (unsigned int) atoi(optarg);
+				break;
+			case 'I':
+				input_lane_port = (uint16_t) atoi(optarg);
+				break;
+			case 'Q':
+				input_lane_tos = (int) strtol(optarg, NULL, 0);
+				break;
+			case 'G':
+				rtp_ingest = true;
+				break;
+			case 'B':
+				busy_poll_us = (unsigned int) atoi(optarg);
+				break;
+			case 'L':
+				latency_accounting = true;
+				break;
+			case 'w':
+				ret = sscanf(optarg, "%zu/%zu", &out_high_watermark,
+					     &out_low_watermark);
+				if (ret == 1)
+					out_low_watermark = out_high_watermark / 4;
+				if (ret < 1 || out_low_watermark > out_high_watermark) {
+					wth_error("Bad watermarks '%s'\n", optarg);
+					return -1;
+				}
+				break;
 			case 'v':
 				printf("No verbose logs for release mode");
 				break;
@@ -110,24 +427,26 @@ parse_args(int argc, char *argv[])
 		tcp_port = DEFAULT_TCP_PORT;
 	}
 
+	if (rtp_port == 0)
+		rtp_port = tcp_port;
 
-	return 0;
-}
+	if (!tcp_listen && !unix_socket_path) {
+		wth_error("--no-tcp needs a --unix-socket to listen on\n");
+		return -1;
+	}
 
-static int
-watch_ctl(struct watch *w, int op, uint32_t events)
-{
-	struct epoll_event ee;
+	/* keep the backlog of a slow transmitter in userspace, where its
+	 * motion events can still be merged, rather than in the kernel */
+	if (out_high_watermark && !socket_profile.notsent_lowat)
+		socket_profile.notsent_lowat = out_low_watermark;
 
-	ee.events = events;
-	ee.data.ptr = w;
-	return epoll_ctl(w->receiver->epoll_fd, op, w->fd, &ee);
+	return 0;
 }
 
 /**
 * listen_socket_handle_data
 *
-* Handles all incoming events on socket
+* Handles all incoming events on socket, TCP or AF_UNIX
 *
 * @param names        struct watch *w ,uint32_t events
 * @param value        pointer to watch connection it holds receiver information, Incoming events information
@@ -136,7 +455,7 @@ watch_ctl(struct watch *w, int op, uint32_t events)
 static void
 listen_socket_handle_data(struct watch *w, uint32_t events)
 {
-	struct receiver *srv = container_of(w, struct receiver, listen_watch);
+	struct receiver *srv = w->receiver;
 
 	if (events & EPOLLERR) {
 		wth_error("Listening socket errored out.\n");
@@ -151,50 +470,155 @@ listen_socket_handle_data(struct watch *w, uint32_t events)
 	}
 
 	if (events & EPOLLIN) {
-		receiver_accept_client(srv);
+		receiver_accept_client(srv, w->fd);
 	}
 }
 
+/**
+* quit_handle_data
+*
+* Stops the reactor once SIGINT was received. The eventfd is never read, so
+* it stays readable and every reactor gets to see it.
+*
+* @param names        struct watch *w ,uint32_t events
+* @param value        pointer to the quit watch of a reactor, Incoming events information
+* @return             none
+*/
+static void
+quit_handle_data(struct watch *w, uint32_t events)
+{
+	struct receiver *srv = container_of(w, struct receiver, quit_watch);
+
+	srv->running = false;
+}
+
 static void
-receiver_clean_up_child(pid_t pid, struct receiver *srv)
+receiver_account_iteration(struct receiver *srv, uint64_t busy_us)
 {
-	struct client *client;
-
-	/* client represents connection with the transmitter, so removing it
-	 * from the client list isn't what need to happen. Mark the
-	 * pid_destroying as to give it a chance for next time */
-	wl_list_for_each(client, &srv->client_list, link) {
-		if (client->pid == pid) {
-			client->pid_destroying = false;
-		}
-	}
+	struct receiver_stats *stats = &srv->stats;
+
+	stats->iterations++;
+	if (busy_us > stats->busy_max_us)
+		stats->busy_max_us = busy_us;
+
+	if (stats->flush_iter > stats->flush_max_iter)
+		stats->flush_max_iter = stats->flush_iter;
+	stats->flush_iter = 0;
+
+	if (!stats->teardown_pending)
+		return;
+
+	stats->teardown_pending = false;
+	stats->teardown_count++;
+	stats->teardown_total_us += busy_us;
+	if (busy_us > stats->teardown_max_us)
+		stats->teardown_max_us = busy_us;
 }
 
 static void
-wait_for_children(struct receiver *srv, pid_t pid)
+receiver_print_stats(struct receiver *srv)
 {
-	pid_t w;
-	int status;
-	int options = WUNTRACED | WCONTINUED;
-
-	do {
-		w = waitpid(pid, &status, options);
-		if (w == -1) {
-			fprintf(stderr, "err no children to wait for!\n");
-		}
+	struct receiver_stats *stats = &srv->stats;
 
-		if (WIFEXITED(status)) {
-			if (w > 0) {
-				receiver_clean_up_child(w, srv);
+	fprintf(stdout, "reactor %u: %" PRIu64 " iterations, longest stall %" PRIu64 " us\n",
+		srv->index, stats->iterations, stats->busy_max_us);
+	fprintf(stdout, "reactor %u: %" PRIu64 " teardowns, stall max %" PRIu64
+		" us avg %" PRIu64 " us\n", srv->index, stats->teardown_count,
+		stats->teardown_max_us, stats->teardown_count ?
+		stats->teardown_total_us / stats->teardown_count : 0);
+	fprintf(stdout, "reactor %u: %" PRIu64 " flushes, %.2f per iteration,"
+		" max %" PRIu64 ", %" PRIu64 " hit a full socket\n", srv->index,
+		stats->flush_calls, stats->iterations ?
+		(double) stats->flush_calls / stats->iterations : 0.0,
+		stats->flush_max_iter, stats->flush_eagain);
+	fprintf(stdout, "reactor %u: %s, %" PRIu64 " waits, %.2f events per wait\n",
+		srv->index, srv->uring ? "io_uring" : "epoll", stats->waits,
+		stats->waits ? (double) stats->events / stats->waits : 0.0);
+	fprintf(stdout, "reactor %u: %" PRIu64 " timers fired in %" PRIu64
+		" wakeups\n", srv->index, stats->timers_fired,
+		stats->timer_wakeups);
+	fprintf(stdout, "reactor %u: %" PRIu64 " connections accepted, at most %"
+		PRIu64 " at once, %" PRIu64 " turned down when full, %" PRIu64
+		" for their rate\n", srv->index, stats->accepted,
+		stats->accept_batch_max, stats->rejected_full,
+		stats->rejected_rate);
+	if (busy_poll_us)
+		fprintf(stdout, "reactor %u: %" PRIu64 " waits found events"
+			" spinning, %" PRIu64 " went to sleep\n", srv->index,
+			stats->spin_hits, stats->spin_misses);
+	if (input_lane_port)
+		fprintf(stdout, "reactor %u: %" PRIu64 " input events sent over"
+			" the input lane\n", srv->index, stats->lane_events);
+	if (out_high_watermark)
+		fprintf(stdout, "reactor %u: %" PRIu64 " clients went over the"
+			" high watermark, %" PRIu64 " motion events merged\n",
+			srv->index, stats->congestion_events,
+			stats->coalesced_events);
+	if (stats->blob_frames || stats->blob_dropped)
+		fprintf(stdout, "reactor %u: %" PRIu64 " blob frames handed over,"
+			" %" PRIu64 " KiB copied in, %" PRIu64 " without a"
+			" session, %.1f%% of their pixels damaged\n",
+			srv->index, stats->blob_frames,
+			stats->blob_bytes / 1024, stats->blob_dropped,
+			stats->blob_frame_bytes ? 100.0 *
+			stats->blob_damaged_bytes / stats->blob_frame_bytes :
+			0.0);
+	if (stats->frames_shown || stats->frames_unpaced)
+		fprintf(stdout, "reactor %u: %" PRIu64 " frame callbacks done"
+			" once shown, %" PRIu64 " paced without a session\n",
+			srv->index, stats->frames_shown, stats->frames_unpaced);
+	if (edge_triggered)
+		fprintf(stdout, "reactor %u: %" PRIu64 " turns cut short by the"
+			" read budget\n", srv->index, stats->budget_requeues);
+}
+
+static int
+receiver_wait(struct receiver *srv, struct epoll_event *ee, int count,
+	      int timeout)
+{
+	if (srv->uring)
+		return uring_wait(srv->uring, ee, count, timeout);
+
+	return epoll_wait(srv->epoll_fd, ee, count, timeout);
+}
+
+/*
+ * Busy-poll mode: check for events without sleeping for up to the spin
+ * budget before blocking. A spin that comes back empty halves the budget,
+ * so an idle reactor soon blocks right away; events found while spinning
+ * restore the full budget, events that woke us up double it again.
+ */
+static int
+receiver_spin_wait(struct receiver *srv, struct epoll_event *ee, int count)
+{
+	uint64_t deadline;
+	int ret;
+
+	if (srv->spin_us >= BUSY_POLL_MIN_SPIN) {
+		deadline = get_monotonic_us() + srv->spin_us;
+		do {
+			ret = receiver_wait(srv, ee, count, 0);
+			if (ret != 0) {
+				srv->stats.spin_hits++;
+				srv->spin_us = busy_poll_us;
+				return ret;
 			}
-		} else if (WIFSIGNALED(status)) {
-			// FIXME should remove the client here, and identify with the pid
-		} else if (WIFSTOPPED(status)) {
-		} else if (WIFCONTINUED(status)) {
-		}
+		} while (get_monotonic_us() < deadline);
+
+		srv->spin_us /= 2;
+	}
+
+	srv->stats.spin_misses++;
+	ret = receiver_wait(srv, ee, count, -1);
+	if (ret > 0) {
+		srv->spin_us = srv->spin_us ? srv->spin_us * 2 : BUSY_POLL_MIN_SPIN;
+		if (srv->spin_us > busy_poll_us)
+			srv->spin_us = busy_poll_us;
+	}
 
-	} while (!WIFEXITED(status) && !WIFSIGNALED(status));
+	return ret;
 }
+
 /**
 * receiver_mainloop
 *
@@ -211,57 +635,66 @@ receiver_mainloop(struct receiver *srv)
 {
 	struct epoll_event ee[MAX_EPOLL_WATCHES];
 	struct watch *w;
+	uint64_t busy_start;
+	int timeout;
 	int count;
 	int i;
 
 	srv->running = true;
+	busy_start = get_monotonic_us();
+
+	srv->batch = ee;
 
 	while (srv->running) {
-		/* Run any idle tasks at this point. */
-		bool should_wait_for_children = false;
-		struct client *client;
+		/* Clients cut short by their read budget get their next turn
+		 * after everyone who had events in this iteration.
+		 */
+		receiver_service_ready(srv);
 
+		/* Run any idle tasks at this point. */
 		receiver_flush_clients(srv);
 
-		wl_list_for_each(client, &srv->client_list, link) {
-			if (client->pid > 0 && client->pid_destroying) {
-				should_wait_for_children = true;
-				break;
-			}
-		}
-
-		/*
-		 * wait_for_children() will block and wait for children that
-		 * died out/terminated correctly as the remote that end sent
-		 * the destroy surface request. pid_destroying is the one that
-		 * allows to make that distinction and will be set by the
-		 * destroy surface handler.
-		 *
-		 * 'children' is just one. A new child will be started when the
-		 * remote side sents a request to create a surface and will be
-		 * killed in the handler that destroys the surface.
+		/* Children normally get reaped when their pidfd fires, this
+		 * only catches the ones we could not get a pidfd for. Nothing
+		 * in here blocks: a surface going away must not stall the
+		 * other transmitters.
 		 */
-		if (should_wait_for_children)
-			wait_for_children(srv, client->pid);
+		session_reap_children(srv);
 
+		receiver_account_iteration(srv, get_monotonic_us() - busy_start);
 
-		/* Wait for events or signals */
-		count = epoll_wait(srv->epoll_fd,
-				ee, ARRAY_LENGTH(ee), -1);
+		/* Wait for events or signals, unless there is input left */
+		timeout = wl_list_empty(&srv->ready_list) ? -1 : 0;
+		if (timeout && busy_poll_us)
+			count = receiver_spin_wait(srv, ee, ARRAY_LENGTH(ee));
+		else
+			count = receiver_wait(srv, ee, ARRAY_LENGTH(ee), timeout);
 		if (count < 0 && errno != EINTR) {
-			perror("Error with epoll_wait");
+			perror("Error waiting for events");
 			break;
 		}
 
+		srv->stats.waits++;
+		if (count > 0)
+			srv->stats.events += count;
+
+		busy_start = get_monotonic_us();
+
 		/* Handle all fds, both the listening socket
-		 * (see listen_socket_handle_data()) and clients
-		 * (see connection_handle_data()).
+		 * (see listen_socket_handle_data()), clients
+		 * (see connection_handle_data()) and sessions.
 		 */
+		srv->batch_count = count;
 		for (i = 0; i < count; i++) {
+			/* removed by an earlier callback of this batch */
 			w = ee[i].data.ptr;
-			w->cb(w, ee[i].events);
+			if (w)
+				w->cb(w, ee[i].events);
 		}
+		srv->batch_count = 0;
 	}
+
+	srv->batch = NULL;
 }
 
 static int
@@ -271,7 +704,9 @@ receiver_listen(uint16_t tcp_port)
 	int reuse = 1;
 	struct sockaddr_in addr;
 
-	fd = socket(AF_INET, SOCK_STREAM, 0);
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
 
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
@@ -280,6 +715,21 @@ receiver_listen(uint16_t tcp_port)
 
 	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
 
+	/* inherited by the accepted connections */
+	if (socket_profile_apply_listen(&socket_profile, fd) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	/* every reactor binds its own socket to the port, the kernel then
+	 * spreads incoming connections over them */
+	if (reactor_count > 1 &&
+	    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof reuse) < 0) {
+		wth_error("Failed to set SO_REUSEPORT on port %d", tcp_port);
+		close(fd);
+		return -1;
+	}
+
 	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
 		wth_error("Failed to bind to port %d", tcp_port);
 		close(fd);
@@ -295,22 +745,235 @@ receiver_listen(uint16_t tcp_port)
 	return fd;
 }
 
+/*
+ * Co-located transmitters skip the TCP/IP stack. There is no SO_REUSEPORT
+ * for AF_UNIX, so only reactor 0 listens here.
+ */
+static int
+receiver_listen_unix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		wth_error("Socket path '%s' is too long\n", path);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	/* left behind by a receiver that did not shut down cleanly */
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		wth_error("Failed to bind to %s", path);
+		close(fd);
+		return -1;
+	}
+
+	if (listen(fd, 1024) < 0) {
+		wth_error("Failed to listen to %s", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Nothing here is fatal: without the kernel's help the loop still spins
+ * before sleeping, only the device queue is not polled from it.
+ */
+static void
+receiver_busy_poll_init(struct receiver *srv)
+{
+	struct epoll_params params = {
+		.busy_poll_usecs = busy_poll_us,
+		.busy_poll_budget = BUSY_POLL_BUDGET,
+		.prefer_busy_poll = 1,
+	};
+
+	srv->spin_us = busy_poll_us;
+
+	/* warnings only once, every reactor would run into the same */
+	if (!srv->uring && ioctl(srv->epoll_fd, EPIOCSPARAMS, &params) < 0 &&
+	    srv->index == 0)
+		wth_error("No epoll busy polling (Linux 6.9), spinning only: %s\n",
+			  strerror(errno));
+
+	if (srv->listen_fd >= 0 &&
+	    socket_set_busy_poll(srv->listen_fd, busy_poll_us) < 0 &&
+	    srv->index == 0)
+		wth_error("Busy polling refused on the sockets, raise "
+			  "net.core.busy_read or run with CAP_NET_ADMIN\n");
+}
+
+/**
+* receiver_init
+*
+* Sets up one reactor: its epoll instance, its own listening socket and the
+* watch on the shared quit eventfd
+*
+* @param names        struct receiver *srv
+*                     unsigned int index
+* @param value        reactor to set up
+*                     number of the reactor
+* @return             0 on success, -1 on error
+*/
+static int
+receiver_init(struct receiver *srv, unsigned int index)
+{
+	srv->index = index;
+	srv->listen_fd = -1;
+	srv->unix_fd = -1;
+
+	wl_list_init(&srv->client_list);
+	wl_list_init(&srv->dirty_list);
+	wl_list_init(&srv->ready_list);
+	wl_list_init(&srv->session_table);
+	wl_list_init(&srv->pool_list);
+	wl_list_init(&srv->parked_list);
+
+	if (admission_init(srv) < 0) {
+		perror("Error setting up admission control");
+		return -1;
+	}
+
+	if (receiver_backend == RECEIVER_BACKEND_IO_URING) {
+		srv->uring = uring_create(srv, URING_ENTRIES);
+		if (!srv->uring)
+			return -1;
+	} else {
+		srv->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if (srv->epoll_fd == -1) {
+			perror("Error on epoll_create1");
+			return -1;
+		}
+	}
+
+	if (tcp_listen) {
+		srv->listen_fd = receiver_listen(tcp_port);
+		if (srv->listen_fd < 0) {
+			perror("Error setting up listening socket");
+			return -1;
+		}
+
+		srv->listen_watch.receiver = srv;
+		srv->listen_watch.cb = listen_socket_handle_data;
+		srv->listen_watch.fd = srv->listen_fd;
+		if (srv->uring) {
+			if (uring_accept_start(srv->uring) < 0) {
+				perror("Error setting up accepting");
+				return -1;
+			}
+		} else if (watch_ctl(&srv->listen_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+			perror("Error setting up listen polling");
+			return -1;
+		}
+	}
+
+	if (unix_socket_path && index == 0) {
+		srv->unix_fd = receiver_listen_unix(unix_socket_path);
+		if (srv->unix_fd < 0) {
+			perror("Error setting up unix socket");
+			return -1;
+		}
+
+		srv->unix_watch.receiver = srv;
+		srv->unix_watch.cb = listen_socket_handle_data;
+		srv->unix_watch.fd = srv->unix_fd;
+		if (watch_ctl(&srv->unix_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+			perror("Error setting up unix socket polling");
+			return -1;
+		}
+
+		fprintf(stdout, "Listening on unix socket %s\n",
+			unix_socket_path);
+	}
+
+	if (busy_poll_us)
+		receiver_busy_poll_init(srv);
+
+	if (timer_wheel_create(srv) < 0) {
+		perror("Error setting up timers");
+		return -1;
+	}
+
+	srv->quit_watch.receiver = srv;
+	srv->quit_watch.cb = quit_handle_data;
+	srv->quit_watch.fd = receiver_quit_fd;
+	if (watch_ctl(&srv->quit_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+		perror("Error setting up quit polling");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void
+receiver_fini(struct receiver *srv)
+{
+	struct client *c;
+
+	/* destroy all things */
+	wl_list_last_until_empty(c, &srv->client_list, link)
+		client_destroy(c);
+
+	session_table_release(srv);
+	receiver_print_stats(srv);
+	timer_wheel_destroy(srv);
+
+	if (srv->listen_fd >= 0)
+		close(srv->listen_fd);
+	if (srv->unix_fd >= 0)
+		close(srv->unix_fd);
+	if (srv->epoll_fd >= 0)
+		close(srv->epoll_fd);
+	if (srv->uring)
+		uring_destroy(srv->uring);
+
+	admission_fini(srv);
+	input_lane_fini(srv);
+}
+
+static void *
+receiver_thread(void *data)
+{
+	struct receiver *srv = data;
+
+	receiver_mainloop(srv);
+
+	return NULL;
+}
 
 static void
-signal_int_handler(int signum)
+receiver_quit(void)
 {
-	if (!*signal_int_handler_run_flag)
-		abort();
+	uint64_t one = 1;
+	ssize_t ret;
+
+	ret = write(receiver_quit_fd, &one, sizeof one);
+	(void) ret;
+}
 
-	*signal_int_handler_run_flag = false;
+static void
+signal_int_handler(int signum)
+{
+	receiver_quit();
 }
 
 static void
-set_sigint_handler(bool *running)
+set_sigint_handler(void)
 {
 	struct sigaction sigint;
 
-	signal_int_handler_run_flag = running;
 	sigint.sa_handler = signal_int_handler;
 	sigemptyset(&sigint.sa_mask);
 	sigint.sa_flags = SA_RESETHAND;
@@ -322,7 +985,8 @@ set_sigint_handler(bool *running)
  *
  * waltham receiver main function, it accepts tcp port number as argument.
  * Establishes connection on the port and listen to port for incoming connection
- * request from waltham clients
+ * request from waltham clients. Reactor 0 runs on the main thread, the other
+ * reactors get a thread each.
  *
  * @param names        argv - argument list and argc -argument count
  * @param value        tcp port number as argument
@@ -330,46 +994,85 @@ set_sigint_handler(bool *running)
  */
 int main(int argc, char *argv[])
 {
-	struct receiver srv = { 0 };
-	struct client *c;
+	unsigned int i;
 
 	/* Get command line arguments */
 	if (parse_args(argc, argv) != 0) {
 		return -1;
 	}
 
-	set_sigint_handler(&srv.running);
+	receiver_quit_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (receiver_quit_fd < 0) {
+		perror("Error on eventfd");
+		exit(1);
+	}
 
-	wl_list_init(&srv.client_list);
+	set_sigint_handler();
 
-	srv.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
-	if (srv.epoll_fd == -1) {
-		perror("Error on epoll_create1");
+	reactors = calloc(reactor_count, sizeof *reactors);
+	if (!reactors) {
+		perror("Error allocating reactors");
 		exit(1);
 	}
 
-	srv.listen_fd = receiver_listen(tcp_port);
-	if (srv.listen_fd < 0) {
-		perror("Error setting up listening socket");
-		exit(1);
+	for (i = 0; i < reactor_count; i++) {
+		reactors[i].epoll_fd = -1;
+		reactors[i].listen_fd = -1;
+		reactors[i].unix_fd = -1;
 	}
 
-	srv.listen_watch.receiver = &srv;
-	srv.listen_watch.cb = listen_socket_handle_data;
-	srv.listen_watch.fd = srv.listen_fd;
-	if (watch_ctl(&srv.listen_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
-		perror("Error setting up listen polling");
+	for (i = 0; i < reactor_count; i++) {
+		if (receiver_init(&reactors[i], i) < 0)
+			exit(1);
+	}
+
+	if (input_lane_port &&
+	    input_lane_init(&reactors[0], input_lane_port, input_lane_tos,
+			    INPUT_LANE_PRIORITY) < 0) {
+		perror("Error setting up the input lane");
 		exit(1);
 	}
 
-	receiver_mainloop(&srv);
+	if (tcp_listen)
+		socket_profile_report(&socket_profile, reactors[0].listen_fd);
 
-	/* destroy all things */
-	wl_list_last_until_empty(c, &srv.client_list, link)
-		client_destroy(c);
+	/* warm up the workers before the first transmitter shows up, and
+	 * before there are other threads around to fork from */
+	for (i = 0; i < reactor_count; i++)
+		session_pool_fill(&reactors[i]);
+
+	for (i = 1; i < reactor_count; i++) {
+		if (pthread_create(&reactors[i].thread, NULL,
+				   receiver_thread, &reactors[i]) != 0) {
+			wth_error("Failed to start reactor %u\n", i);
+			reactor_count = i;
+			break;
+		}
+	}
+
+	if (reactor_count > 1 && tcp_listen)
+		fprintf(stdout, "Serving port %d from %u reactors\n",
+			tcp_port, reactor_count);
+	if (multicast_group)
+		fprintf(stdout, "Receiving RTP from group %s port %d on %s\n",
+			multicast_group, rtp_port,
+			multicast_iface ? multicast_iface : "the default interface");
+
+	receiver_mainloop(&reactors[0]);
+
+	/* reactor 0 may have stopped on its own, take the others down too */
+	receiver_quit();
+	for (i = 1; i < reactor_count; i++)
+		pthread_join(reactors[i].thread, NULL);
+
+	for (i = 0; i < reactor_count; i++)
+		receiver_fini(&reactors[i]);
+
+	free(reactors);
+	close(receiver_quit_fd);
 
-	close(srv.listen_fd);
-	close(srv.epoll_fd);
+	if (unix_socket_path)
+		unlink(unix_socket_path);
 
 	return 0;
 }
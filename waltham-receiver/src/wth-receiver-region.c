@@ -0,0 +1,560 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the rectangle sets                      **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "wth-receiver-region.h"
+
+#define REGION_MIN_SIZE		8
+
+enum region_op {
+    REGION_OP_UNION,
+    REGION_OP_INTERSECT,
+    REGION_OP_SUBTRACT,
+};
+
+void
+region_set_init(struct region_set *set)
+{
+	memset(set, 0, sizeof *set);
+}
+
+void
+region_set_fini(struct region_set *set)
+{
+	free(set->boxes);
+	region_set_init(set);
+}
+
+void
+region_set_clear(struct region_set *set)
+{
+	memset(&set->extents, 0, sizeof set->extents);
+	set->count = 0;
+}
+
+static int
+region_set_reserve(struct region_set *set, uint32_t count)
+{
+	struct region_box *boxes;
+	uint32_t size;
+
+	if (count <= set->size)
+		return 0;
+
+	size = set->size ? set->size : REGION_MIN_SIZE;
+	while (size < count) {
+		if (size > UINT32_MAX / 2 / sizeof *boxes)
+			return -1;
+		size *= 2;
+	}
+
+	boxes = realloc(set->boxes, size * sizeof *boxes);
+	if (!boxes)
+		return -1;
+
+	set->boxes = boxes;
+	set->size = size;
+	return 0;
+}
+
+static void
+region_set_update_extents(struct region_set *set)
+{
+	struct region_box *ext = &set->extents;
+	uint32_t i;
+
+	if (!set->count) {
+		memset(ext, 0, sizeof *ext);
+		return;
+	}
+
+	/* the bands give the vertical extent away */
+	ext->y1 = set->boxes[0].y1;
+	ext->y2 = set->boxes[set->count - 1].y2;
+	ext->x1 = set->boxes[0].x1;
+	ext->x2 = set->boxes[0].x2;
+	for (i = 1; i < set->count; i++) {
+		if (set->boxes[i].x1 < ext->x1)
+			ext->x1 = set->boxes[i].x1;
+		if (set->boxes[i].x2 > ext->x2)
+			ext->x2 = set->boxes[i].x2;
+	}
+}
+
+int
+region_set_copy(struct region_set *dst, const struct region_set *src)
+{
+	if (dst == src)
+		return 0;
+
+	if (region_set_reserve(dst, src->count) < 0)
+		return -1;
+
+	if (src->count)
+		memcpy(dst->boxes, src->boxes, src->count * sizeof *src->boxes);
+	dst->count = src->count;
+	dst->extents = src->extents;
+	return 0;
+}
+
+/* a set holding a single box, without any allocation, as an operand */
+static void
+region_set_init_box(struct region_set *set, struct region_box *box,
+		    int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	int64_t x2 = (int64_t) x + width;
+	int64_t y2 = (int64_t) y + height;
+
+	box->x1 = x;
+	box->y1 = y;
+	box->x2 = x2 > INT32_MAX ? INT32_MAX : x2;
+	box->y2 = y2 > INT32_MAX ? INT32_MAX : y2;
+
+	set->boxes = box;
+	set->size = 1;
+	if (width <= 0 || height <= 0 || box->x1 >= box->x2 ||
+	    box->y1 >= box->y2) {
+		set->count = 0;
+		memset(&set->extents, 0, sizeof set->extents);
+	} else {
+		set->count = 1;
+		set->extents = *box;
+	}
+}
+
+static bool
+region_box_contains(const struct region_box *outer,
+		    const struct region_box *inner)
+{
+	return outer->x1 <= inner->x1 && outer->y1 <= inner->y1 &&
+	       outer->x2 >= inner->x2 && outer->y2 >= inner->y2;
+}
+
+static bool
+region_box_overlaps(const struct region_box *a, const struct region_box *b)
+{
+	return a->x1 < b->x2 && b->x1 < a->x2 && a->y1 < b->y2 && b->y1 < a->y2;
+}
+
+/* index of the first box past the band starting at i */
+static uint32_t
+region_band_end(const struct region_box *boxes, uint32_t count, uint32_t i)
+{
+	int32_t y1 = boxes[i].y1;
+
+	while (i < count && boxes[i].y1 == y1)
+		i++;
+
+	return i;
+}
+
+static void
+region_emit(struct region_set *out, int32_t x1, int32_t x2,
+	    int32_t y1, int32_t y2)
+{
+	struct region_box *box = &out->boxes[out->count++];
+
+	box->x1 = x1;
+	box->y1 = y1;
+	box->x2 = x2;
+	box->y2 = y2;
+}
+
+/*
+ * Appends the band [y1, y2) made of the x spans of a and b, combined by
+ * op. Neither operand has more spans than boxes, so na + nb boxes are
+ * always enough for the result.
+ */
+static int
+region_op_band(struct region_set *out, enum region_op op,
+	       const struct region_box *a, uint32_t na,
+	       const struct region_box *b, uint32_t nb,
+	       int32_t y1, int32_t y2)
+{
+	struct region_box span = { 0 };
+	bool have = false;
+	uint32_t i = 0, j = 0, k;
+	int32_t x1, x2;
+
+	if (na + nb < na || region_set_reserve(out, out->count + na + nb) < 0)
+		return -1;
+
+	switch (op) {
+	case REGION_OP_UNION:
+		while (i < na || j < nb) {
+			const struct region_box *s;
+
+			if (j >= nb || (i < na && a[i].x1 <= b[j].x1))
+				s = &a[i++];
+			else
+				s = &b[j++];
+
+			if (have && s->x1 <= span.x2) {
+				if (s->x2 > span.x2)
+					span.x2 = s->x2;
+				continue;
+			}
+			if (have)
+				region_emit(out, span.x1, span.x2, y1, y2);
+			span = *s;
+			have = true;
+		}
+		if (have)
+			region_emit(out, span.x1, span.x2, y1, y2);
+		break;
+
+	case REGION_OP_INTERSECT:
+		while (i < na && j < nb) {
+			x1 = a[i].x1 > b[j].x1 ? a[i].x1 : b[j].x1;
+			x2 = a[i].x2 < b[j].x2 ? a[i].x2 : b[j].x2;
+			if (x1 < x2)
+				region_emit(out, x1, x2, y1, y2);
+
+			if (a[i].x2 < b[j].x2)
+				i++;
+			else
+				j++;
+		}
+		break;
+
+	case REGION_OP_SUBTRACT:
+		for (i = 0; i < na; i++) {
+			x1 = a[i].x1;
+			x2 = a[i].x2;
+
+			/* spans of b left of this one are left of the next */
+			while (j < nb && b[j].x2 <= x1)
+				j++;
+
+			for (k = j; k < nb && b[k].x1 < x2; k++) {
+				if (b[k].x1 > x1)
+					region_emit(out, x1, b[k].x1, y1, y2);
+				x1 = b[k].x2;
+				if (x1 >= x2)
+					break;
+			}
+			if (x1 < x2)
+				region_emit(out, x1, x2, y1, y2);
+		}
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Merges the band just appended at index band into the previous one when
+ * they touch and have the same spans, which keeps the sets canonical.
+ */
+static void
+region_coalesce(struct region_set *out, uint32_t *prev, uint32_t band)
+{
+	uint32_t n = out->count - band;
+	uint32_t i;
+
+	if (!n)
+		return;
+
+	if (*prev == UINT32_MAX || band - *prev != n ||
+	    out->boxes[*prev].y2 != out->boxes[band].y1) {
+		*prev = band;
+		return;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (out->boxes[*prev + i].x1 != out->boxes[band + i].x1 ||
+		    out->boxes[*prev + i].x2 != out->boxes[band + i].x2) {
+			*prev = band;
+			return;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		out->boxes[*prev + i].y2 = out->boxes[band].y2;
+	out->count = band;
+}
+
+/*
+ * Sweeps both sets from top to bottom, cutting them at every band edge of
+ * either, and combines the spans of each slice. A slice is at most one
+ * band of each set, so the cost is linear in the number of boxes.
+ */
+static int
+region_set_op(struct region_set *dst, const struct region_set *a,
+	      const struct region_set *b, enum region_op op)
+{
+	struct region_set out;
+	uint32_t ia = 0, ib = 0, ea, eb, prev = UINT32_MAX;
+	int32_t y, ynext;
+	bool a_on, b_on;
+
+	region_set_init(&out);
+
+	if (!a->count)
+		y = b->extents.y1;
+	else if (!b->count || a->extents.y1 < b->extents.y1)
+		y = a->extents.y1;
+	else
+		y = b->extents.y1;
+
+	for (;;) {
+		while (ia < a->count && a->boxes[ia].y2 <= y)
+			ia = region_band_end(a->boxes, a->count, ia);
+		while (ib < b->count && b->boxes[ib].y2 <= y)
+			ib = region_band_end(b->boxes, b->count, ib);
+
+		/* nothing left that can add to the result */
+		if (ia >= a->count &&
+		    (op != REGION_OP_UNION || ib >= b->count))
+			break;
+		if (ib >= b->count && op == REGION_OP_INTERSECT)
+			break;
+
+		a_on = ia < a->count && a->boxes[ia].y1 <= y;
+		b_on = ib < b->count && b->boxes[ib].y1 <= y;
+
+		ynext = INT32_MAX;
+		if (ia < a->count)
+			ynext = a_on ? a->boxes[ia].y2 : a->boxes[ia].y1;
+		if (ib < b->count) {
+			int32_t yb = b_on ? b->boxes[ib].y2 : b->boxes[ib].y1;
+
+			if (yb < ynext)
+				ynext = yb;
+		}
+
+		if (a_on || b_on) {
+			uint32_t band = out.count;
+
+			ea = a_on ? region_band_end(a->boxes, a->count, ia) : ia;
+			eb = b_on ? region_band_end(b->boxes, b->count, ib) : ib;
+
+			if (region_op_band(&out, op, a->boxes + ia, ea - ia,
+					   b->boxes + ib, eb - ib,
+					   y, ynext) < 0) {
+				region_set_fini(&out);
+				return -1;
+			}
+			region_coalesce(&out, &prev, band);
+		}
+
+		y = ynext;
+	}
+
+	region_set_update_extents(&out);
+
+	/* the sources are not needed any more, dst may be one of them */
+	region_set_fini(dst);
+	*dst = out;
+	return 0;
+}
+
+int
+region_set_union(struct region_set *dst, const struct region_set *a,
+		 const struct region_set *b)
+{
+	/* the trivial cases cost a copy at most */
+	if (!a->count || (b->count == 1 &&
+			  region_box_contains(&b->extents, &a->extents)))
+		return region_set_copy(dst, b);
+	if (!b->count || (a->count == 1 &&
+			  region_box_contains(&a->extents, &b->extents)))
+		return region_set_copy(dst, a);
+
+	return region_set_op(dst, a, b, REGION_OP_UNION);
+}
+
+int
+region_set_intersect(struct region_set *dst, const struct region_set *a,
+		     const struct region_set *b)
+{
+	if (!a->count || !b->count ||
+	    !region_box_overlaps(&a->extents, &b->extents)) {
+		region_set_clear(dst);
+		return 0;
+	}
+	if (a->count == 1 && region_box_contains(&a->extents, &b->extents))
+		return region_set_copy(dst, b);
+	if (b->count == 1 && region_box_contains(&b->extents, &a->extents))
+		return region_set_copy(dst, a);
+
+	return region_set_op(dst, a, b, REGION_OP_INTERSECT);
+}
+
+int
+region_set_subtract(struct region_set *dst, const struct region_set *a,
+		    const struct region_set *b)
+{
+	if (!a->count || (b->count == 1 &&
+			  region_box_contains(&b->extents, &a->extents))) {
+		region_set_clear(dst);
+		return 0;
+	}
+	if (!b->count || !region_box_overlaps(&a->extents, &b->extents))
+		return region_set_copy(dst, a);
+
+	return region_set_op(dst, a, b, REGION_OP_SUBTRACT);
+}
+
+int
+region_set_union_rect(struct region_set *set, int32_t x, int32_t y,
+		      int32_t width, int32_t height)
+{
+	struct region_set rect;
+	struct region_box box;
+
+	region_set_init_box(&rect, &box, x, y, width, height);
+	return region_set_union(set, set, &rect);
+}
+
+int
+region_set_subtract_rect(struct region_set *set, int32_t x, int32_t y,
+			 int32_t width, int32_t height)
+{
+	struct region_set rect;
+	struct region_box box;
+
+	region_set_init_box(&rect, &box, x, y, width, height);
+	return region_set_subtract(set, set, &rect);
+}
+
+static int32_t
+region_clamp(int64_t v)
+{
+	if (v > INT32_MAX)
+		return INT32_MAX;
+	if (v < INT32_MIN)
+		return INT32_MIN;
+	return v;
+}
+
+/*
+ * Drops the boxes emptied by clipping, then merges the bands made alike
+ * by the spans that went away.
+ */
+static void
+region_set_normalize(struct region_set *set)
+{
+	uint32_t i, n = 0, band, prev = UINT32_MAX;
+
+	for (i = 0; i < set->count; i++) {
+		if (set->boxes[i].x1 < set->boxes[i].x2 &&
+		    set->boxes[i].y1 < set->boxes[i].y2)
+			set->boxes[n++] = set->boxes[i];
+	}
+
+	/* boxes only ever move to lower indices, compacting in place is fine */
+	set->count = 0;
+	for (i = 0; i < n; i = band) {
+		uint32_t start = set->count;
+
+		band = region_band_end(set->boxes, n, i);
+		memmove(&set->boxes[start], &set->boxes[i],
+			(band - i) * sizeof *set->boxes);
+		set->count += band - i;
+		region_coalesce(set, &prev, start);
+	}
+
+	region_set_update_extents(set);
+}
+
+void
+region_set_translate(struct region_set *set, int32_t dx, int32_t dy)
+{
+	struct region_box *box;
+	int64_t x1, y1, x2, y2;
+	bool clipped = false;
+	uint32_t i;
+
+	for (i = 0; i < set->count; i++) {
+		box = &set->boxes[i];
+		x1 = (int64_t) box->x1 + dx;
+		x2 = (int64_t) box->x2 + dx;
+		y1 = (int64_t) box->y1 + dy;
+		y2 = (int64_t) box->y2 + dy;
+
+		box->x1 = region_clamp(x1);
+		box->x2 = region_clamp(x2);
+		box->y1 = region_clamp(y1);
+		box->y2 = region_clamp(y2);
+		if (box->x1 != x1 || box->x2 != x2 ||
+		    box->y1 != y1 || box->y2 != y2)
+			clipped = true;
+	}
+
+	if (clipped) {
+		region_set_normalize(set);
+	} else if (set->count) {
+		set->extents.x1 += dx;
+		set->extents.x2 += dx;
+		set->extents.y1 += dy;
+		set->extents.y2 += dy;
+	}
+}
+
+bool
+region_set_contains_point(const struct region_set *set, int32_t x, int32_t y)
+{
+	uint32_t lo = 0, hi = set->count, mid, i;
+
+	if (!set->count || x < set->extents.x1 || x >= set->extents.x2 ||
+	    y < set->extents.y1 || y >= set->extents.y2)
+		return false;
+
+	/* first box not entirely above y, then walk its band */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (set->boxes[mid].y2 <= y)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo >= set->count || set->boxes[lo].y1 > y)
+		return false;
+
+	for (i = lo; i < set->count && set->boxes[i].y1 == set->boxes[lo].y1; i++) {
+		if (x < set->boxes[i].x1)
+			return false;
+		if (x < set->boxes[i].x2)
+			return true;
+	}
+
+	return false;
+}
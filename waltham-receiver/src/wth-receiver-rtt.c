@@ -0,0 +1,119 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the round trip time sampling            **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-rtt.h"
+
+extern unsigned int rtt_probe_interval;
+
+static int
+rtt_compare(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+rtt_probe_report(struct rtt_probe *probe)
+{
+	uint32_t sorted[RTT_WINDOW];
+	unsigned int n, i;
+	uint64_t sum = 0;
+
+	n = probe->count < RTT_WINDOW ? probe->count : RTT_WINDOW;
+	if (n == 0)
+		return;
+
+	/* the window is small, sorting a copy beats keeping a histogram */
+	memcpy(sorted, probe->samples, n * sizeof sorted[0]);
+	qsort(sorted, n, sizeof sorted[0], rtt_compare);
+	for (i = 0; i < n; i++)
+		sum += sorted[i];
+
+	fprintf(stdout, "Client %p rtt over %u samples: min %u us, avg %" PRIu64
+		" us, p99 %u us\n", probe->client, n, sorted[0], sum / n,
+		sorted[(n * 99 - 1) / 100]);
+}
+
+static void
+rtt_probe_sample(struct timer *t)
+{
+	struct rtt_probe *probe = container_of(t, struct rtt_probe, timer);
+	struct tcp_info info;
+	socklen_t len = sizeof info;
+
+	if (getsockopt(probe->client->conn_watch.fd, IPPROTO_TCP, TCP_INFO,
+		       &info, &len) < 0)
+		return;
+
+	/* no ACK seen yet, there is nothing to sample */
+	if (info.tcpi_rtt == 0)
+		return;
+
+	probe->samples[probe->count % RTT_WINDOW] = info.tcpi_rtt;
+	probe->count++;
+
+	if (probe->count % RTT_WINDOW == 0)
+		rtt_probe_report(probe);
+}
+
+void
+rtt_probe_start(struct rtt_probe *probe, struct client *c)
+{
+	probe->client = c;
+	probe->count = 0;
+	timer_init(&probe->timer, c->receiver, rtt_probe_sample);
+
+	if (rtt_probe_interval && c->tcp)
+		timer_arm(&probe->timer, rtt_probe_interval, rtt_probe_interval);
+}
+
+void
+rtt_probe_stop(struct rtt_probe *probe)
+{
+	timer_cancel(&probe->timer);
+
+	if (probe->count % RTT_WINDOW)
+		rtt_probe_report(probe);
+}
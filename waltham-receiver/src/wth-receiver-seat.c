@@ -260,7 +260,7 @@ seat_get_pointer(struct wthp_seat *wthp_seat, struct wthp_pointer *wthp_pointer)
 	struct seat *seat = wth_object_get_user_data((struct wth_object *)wthp_seat);
 	struct pointer *pointer;
 
-	pointer = zalloc(sizeof *pointer);
+	pointer = arena_zalloc(&seat->client->arena, ARENA_POINTER);
 	if (!pointer) {
 		client_post_out_of_memory(seat->client);
 		return;
@@ -283,7 +283,7 @@ seat_get_touch(struct wthp_seat *wthp_seat, struct wthp_touch *wthp_touch)
 
 	fprintf(stdout, "wthp_seat %p get_touch(%p)\n", wthp_seat, wthp_touch);
 
-	touch = zalloc(sizeof(*touch));
+	touch = arena_zalloc(&seat->client->arena, ARENA_TOUCH);
 	if (!touch) {
 		client_post_out_of_memory(seat->client);
 		return;
@@ -339,7 +339,7 @@ client_bind_seat(struct client *c, struct wthp_seat *obj)
 {
 	struct seat *seat;
 
-	seat = zalloc(sizeof *seat);
+	seat = arena_zalloc(&c->arena, ARENA_SEAT);
 	if (!seat) {
 		client_post_out_of_memory(c);
 		return;
@@ -0,0 +1,1215 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Streaming sessions, one per ivi surface                       **
+**                                                                            **
+*******************************************************************************/
+
+#include <dirent.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <inttypes.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-seat.h"
+#include "wth-receiver-buffer.h"
+#include "wth-receiver-surface.h"
+#include "wth-receiver-session.h"
+#include "wth-receiver-input-lane.h"
+#include "os-compatibility.h"
+
+extern enum session_mode session_mode;
+
+extern uint16_t rtp_port;
+extern unsigned int session_pool_size;
+extern enum session_pool_refill session_pool_refill;
+extern unsigned int session_resume_grace;
+
+struct session_worker_args {
+    int fd;
+    int port;
+};
+
+static const char *const session_state_names[SESSION_STATE_COUNT] = {
+	[SESSION_STATE_STARTING] = "starting",
+	[SESSION_STATE_RUNNING] = "running",
+	[SESSION_STATE_DRAINING] = "draining",
+	[SESSION_STATE_DEAD] = "dead",
+};
+
+static void
+session_set_state(struct session *session, enum session_state state)
+{
+	if (session->state == state)
+		return;
+
+	fprintf(stdout, "session %p: %s -> %s\n", session,
+		session_state_names[session->state], session_state_names[state]);
+	session->state = state;
+}
+
+static int
+session_pidfd_open(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+static void
+session_close_channel(struct session *session)
+{
+	if (session->fd < 0)
+		return;
+
+	watch_ctl(&session->watch, EPOLL_CTL_DEL, 0);
+	close(session->fd);
+	session->fd = -1;
+}
+
+static void
+session_close_pidfd(struct session *session)
+{
+	if (session->pid_watch.fd < 0)
+		return;
+
+	watch_ctl(&session->pid_watch, EPOLL_CTL_DEL, 0);
+	close(session->pid_watch.fd);
+	session->pid_watch.fd = -1;
+}
+
+static void
+session_free(struct session *session)
+{
+	struct receiver *srv = session->receiver;
+
+	if (session->mode == SESSION_MODE_FORK && !session->reaped &&
+	    session->pid > 0 && session->pid_watch.fd < 0)
+		srv->unwatched_children--;
+
+	session_close_channel(session);
+	session_close_pidfd(session);
+	timer_cancel(&session->park_timer);
+
+	wl_list_remove(&session->link);
+	wl_list_remove(&session->table_link);
+	free(session);
+}
+
+/*
+ * A worker is gone once its child has been reaped, or for a thread once it
+ * closed its end of the channel. A session nobody refers to any more goes
+ * away with it, one still attached to a surface waits for session_destroy().
+ */
+static void
+session_check_dead(struct session *session)
+{
+	bool gone;
+
+	if (session->mode == SESSION_MODE_FORK)
+		gone = session->reaped;
+	else
+		gone = session->fd < 0;
+
+	if (!gone)
+		return;
+
+	session_set_state(session, SESSION_STATE_DEAD);
+	session->receiver->stats.teardown_pending = true;
+
+	if (!session->surface)
+		session_free(session);
+}
+
+/* returns true once the child has been reaped */
+static bool
+session_reap(struct session *session)
+{
+	struct receiver *srv = session->receiver;
+	int status;
+	pid_t ret;
+
+	do {
+		ret = waitpid(session->pid, &status, WNOHANG);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret == 0)
+		return false;
+
+	if (ret < 0) {
+		wth_error("Failed to wait for child %d: %s\n",
+			  session->pid, strerror(errno));
+	} else if (WIFEXITED(status)) {
+		fprintf(stdout, "child %d exited with status %d\n",
+			session->pid, WEXITSTATUS(status));
+	} else if (WIFSIGNALED(status)) {
+		fprintf(stdout, "child %d killed by signal %d\n",
+			session->pid, WTERMSIG(status));
+	}
+
+	if (session->pid_watch.fd < 0)
+		srv->unwatched_children--;
+	else
+		session_close_pidfd(session);
+
+	session->reaped = true;
+	session_check_dead(session);
+
+	return true;
+}
+
+static void
+session_handle_exit(struct watch *w, uint32_t events)
+{
+	struct session *session = container_of(w, struct session, pid_watch);
+
+	session_reap(session);
+}
+
+static void
+session_watch_child(struct session *session)
+{
+	struct receiver *srv = session->receiver;
+
+	session->pid_watch.receiver = srv;
+	session->pid_watch.cb = session_handle_exit;
+	session->pid_watch.fd = session_pidfd_open(session->pid);
+	if (session->pid_watch.fd < 0) {
+		fprintf(stderr, "pidfd_open() failed for child %d, "
+			"falling back to polling: %s\n", session->pid,
+			strerror(errno));
+		srv->unwatched_children++;
+		return;
+	}
+
+	if (watch_ctl(&session->pid_watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+		close(session->pid_watch.fd);
+		session->pid_watch.fd = -1;
+		srv->unwatched_children++;
+	}
+}
+
+/**
+* session_reap_children
+*
+* Polls, without blocking, the children that could not be given a pidfd.
+* Children with a pidfd are reaped from the main loop, so this costs
+* nothing as long as pidfds are available.
+*
+* @param names        struct receiver *srv
+* @param value        receiver owning the children
+* @return             none
+*/
+void
+session_reap_children(struct receiver *srv)
+{
+	struct session *session, *tmp;
+
+	if (!srv->unwatched_children)
+		return;
+
+	wl_list_for_each_safe(session, tmp, &srv->session_table, table_link) {
+		if (session->mode == SESSION_MODE_FORK && !session->reaped &&
+		    session->pid_watch.fd < 0)
+			session_reap(session);
+	}
+}
+
+void
+session_table_release(struct receiver *srv)
+{
+	struct session_msg msg = { .type = SESSION_MSG_STOP };
+	unsigned int count[SESSION_STATE_COUNT] = { 0 };
+	struct session *session;
+
+	wl_list_for_each(session, &srv->session_table, table_link)
+		count[session->state]++;
+
+	fprintf(stdout, "reactor %u sessions left: %u starting, %u running, "
+		"%u draining, %u dead\n", srv->index,
+		count[SESSION_STATE_STARTING], count[SESSION_STATE_RUNNING],
+		count[SESSION_STATE_DRAINING], count[SESSION_STATE_DEAD]);
+
+	wl_list_last_until_empty(session, &srv->session_table, table_link) {
+		/* idle and parked workers still wait for a surface */
+		if (session->fd >= 0 &&
+		    (session->state == SESSION_STATE_STARTING ||
+		     session->state == SESSION_STATE_RUNNING))
+			session_msg_send(session->fd, &msg);
+		session_free(session);
+	}
+
+	srv->pool_count = 0;
+}
+
+int
+session_msg_send(int fd, const struct session_msg *msg)
+{
+	ssize_t len;
+
+	do {
+		len = send(fd, msg, sizeof *msg, MSG_NOSIGNAL);
+	} while (len < 0 && errno == EINTR);
+
+	return len == sizeof *msg ? 0 : -1;
+}
+
+static int
+session_msg_send_fd(int fd, const struct session_msg *msg, int passfd)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = (void *) msg,
+		.iov_len = sizeof *msg,
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof control.buf,
+	};
+	struct cmsghdr *cmsg;
+	ssize_t len;
+
+	memset(&control, 0, sizeof control);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+
+	do {
+		len = sendmsg(fd, &mh, MSG_NOSIGNAL);
+	} while (len < 0 && errno == EINTR);
+
+	return len == sizeof *msg ? 0 : -1;
+}
+
+/* returns 1 when a message was read, 0 on end of channel, -1 on error */
+int
+session_msg_recv_fd(int fd, struct session_msg *msg, int *passfd, int flags)
+{
+	union {
+		char buf[CMSG_SPACE(sizeof(int))];
+		struct cmsghdr align;
+	} control;
+	struct iovec iov = {
+		.iov_base = msg,
+		.iov_len = sizeof *msg,
+	};
+	struct msghdr mh = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof control.buf,
+	};
+	struct cmsghdr *cmsg;
+	int received = -1;
+	ssize_t len;
+
+	if (passfd)
+		*passfd = -1;
+
+	do {
+		len = recvmsg(fd, &mh, flags | MSG_CMSG_CLOEXEC);
+	} while (len < 0 && errno == EINTR);
+
+	if (len < 0)
+		return -1;
+	if (len == 0)
+		return 0;
+
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS &&
+		    cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+			memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if (len != sizeof *msg) {
+		if (received >= 0)
+			close(received);
+		errno = EPROTO;
+		return -1;
+	}
+
+	if (passfd)
+		*passfd = received;
+	else if (received >= 0)
+		close(received);
+
+	return 1;
+}
+
+int
+session_msg_recv(int fd, struct session_msg *msg)
+{
+	return session_msg_recv_fd(fd, msg, NULL, 0);
+}
+
+/**
+* session_stage_done
+*
+* Used by the worker to time its startup stages, records the time elapsed
+* since *since in the timings of msg and restarts the clock
+*
+* @param names        struct session_msg *msg
+*                     enum session_stage stage
+*                     uint64_t *since
+* @param value        msg   - SESSION_MSG_READY or SESSION_MSG_STARTED
+*                     stage - stage that just completed
+*                     since - start of the stage, in microseconds
+* @return             none
+*/
+void
+session_stage_done(struct session_msg *msg, enum session_stage stage,
+		   uint64_t *since)
+{
+	uint64_t now = get_monotonic_us();
+
+	msg->timings.stage_us[stage] = (uint32_t) (now - *since);
+	*since = now;
+}
+
+static void
+session_send_input(struct session *session, const struct session_msg *msg)
+{
+	struct window *window = session->surface->shm_window;
+	unsigned int nargs;
+
+	switch (msg->type) {
+	case SESSION_MSG_POINTER_ENTER:
+		waltham_pointer_enter(window, msg->input.serial,
+				      msg->input.x, msg->input.y);
+		nargs = 4;
+		break;
+	case SESSION_MSG_POINTER_LEAVE:
+		waltham_pointer_leave(window, msg->input.serial);
+		nargs = 2;
+		break;
+	case SESSION_MSG_POINTER_MOTION:
+		waltham_pointer_motion(window, msg->input.time,
+				       msg->input.x, msg->input.y);
+		nargs = 3;
+		break;
+	case SESSION_MSG_POINTER_BUTTON:
+		waltham_pointer_button(window, msg->input.serial,
+				       msg->input.time, msg->input.button,
+				       msg->input.state);
+		nargs = 4;
+		break;
+	case SESSION_MSG_POINTER_AXIS:
+		waltham_pointer_axis(window, msg->input.time,
+				     msg->input.button, msg->input.x);
+		nargs = 3;
+		break;
+	case SESSION_MSG_TOUCH_DOWN:
+		waltham_touch_down(window, msg->input.serial, msg->input.time,
+				   msg->input.id, msg->input.x, msg->input.y);
+		nargs = 6;
+		break;
+	case SESSION_MSG_TOUCH_UP:
+		waltham_touch_up(window, msg->input.serial, msg->input.time,
+				 msg->input.id);
+		nargs = 4;
+		break;
+	case SESSION_MSG_TOUCH_MOTION:
+		waltham_touch_motion(window, msg->input.time, msg->input.id,
+				     msg->input.x, msg->input.y);
+		nargs = 4;
+		break;
+	case SESSION_MSG_TOUCH_FRAME:
+		waltham_touch_frame(window);
+		nargs = 0;
+		break;
+	case SESSION_MSG_TOUCH_CANCEL:
+		waltham_touch_cancel(window);
+		nargs = 0;
+		break;
+	default:
+		wth_error("session %p: unexpected message %u\n",
+			  session, msg->type);
+		return;
+	}
+
+	client_account_output(session->client, CLIENT_MSG_BYTES(nargs));
+}
+
+static void
+session_send_motion(struct session *session, uint32_t type,
+		    const struct session_motion *motion)
+{
+	struct session_msg msg = { .type = type };
+
+	msg.input.time = motion->time;
+	msg.input.id = motion->id;
+	msg.input.x = motion->x;
+	msg.input.y = motion->y;
+	session_send_input(session, &msg);
+}
+
+void
+session_release_input(struct session *session)
+{
+	struct session_msg frame = { .type = SESSION_MSG_TOUCH_FRAME };
+	unsigned int i;
+
+	if (session->pointer_held)
+		session_send_motion(session, SESSION_MSG_POINTER_MOTION,
+				    &session->held_pointer);
+
+	for (i = 0; i < session->touch_held; i++)
+		session_send_motion(session, SESSION_MSG_TOUCH_MOTION,
+				    &session->held_touch[i]);
+
+	if (session->frame_held)
+		session_send_input(session, &frame);
+
+	session->pointer_held = false;
+	session->touch_held = 0;
+	session->frame_held = false;
+}
+
+/*
+ * While the client is congested only the latest position matters: a
+ * pointer motion replaces the held one, a touch motion the held one of
+ * the same touch point, and touch frames in between collapse into one.
+ */
+static bool
+session_hold_input(struct session *session, const struct session_msg *msg)
+{
+	struct receiver_stats *stats = &session->receiver->stats;
+	struct session_motion *motion;
+	unsigned int i;
+
+	switch (msg->type) {
+	case SESSION_MSG_POINTER_MOTION:
+		if (session->pointer_held)
+			stats->coalesced_events++;
+		motion = &session->held_pointer;
+		session->pointer_held = true;
+		break;
+	case SESSION_MSG_TOUCH_MOTION:
+		for (i = 0; i < session->touch_held; i++) {
+			if (session->held_touch[i].id == msg->input.id)
+				break;
+		}
+		if (i == SESSION_TOUCH_SLOTS)
+			return false;
+		if (i < session->touch_held)
+			stats->coalesced_events++;
+		else
+			session->touch_held++;
+		motion = &session->held_touch[i];
+		break;
+	case SESSION_MSG_TOUCH_FRAME:
+		if (!session->touch_held)
+			return false;
+		if (session->frame_held)
+			stats->coalesced_events++;
+		session->frame_held = true;
+		return true;
+	default:
+		return false;
+	}
+
+	motion->time = msg->input.time;
+	motion->id = msg->input.id;
+	motion->x = msg->input.x;
+	motion->y = msg->input.y;
+	return true;
+}
+
+static void
+session_relay_input(struct session *session, const struct session_msg *msg)
+{
+	/* seat events skip the Waltham connection when the transmitter
+	 * registered an input lane */
+	if (msg->type >= SESSION_MSG_POINTER_ENTER &&
+	    input_lane_send(session->client, session->app_id, msg) == 0)
+		return;
+
+	if (session->client->congested && session_hold_input(session, msg))
+		return;
+
+	/* what was held happened before this event */
+	session_release_input(session);
+	session_send_input(session, msg);
+}
+
+static void
+session_print_timings(struct session *session, const struct session_msg *msg)
+{
+	const uint32_t *us = msg->timings.stage_us;
+
+	if (msg->type == SESSION_MSG_READY) {
+		fprintf(stdout, "session %p warm: gst_init %u us, display %u us, "
+			"pipeline %u us, paused %u us\n", session,
+			us[SESSION_STAGE_GST_INIT], us[SESSION_STAGE_DISPLAY],
+			us[SESSION_STAGE_PIPELINE], us[SESSION_STAGE_PAUSED]);
+	} else {
+		fprintf(stdout, "session %p started: window %u us, playing %u us, "
+			"%" PRIu64 " us since surface creation\n", session,
+			us[SESSION_STAGE_WINDOW], us[SESSION_STAGE_PLAYING],
+			get_monotonic_us() - session->start_us);
+	}
+}
+
+static void
+session_handle_data(struct watch *w, uint32_t events)
+{
+	struct session *session = container_of(w, struct session, watch);
+	struct session_msg msg;
+	int ret;
+
+	if (events & EPOLLIN) {
+		while ((ret = session_msg_recv(session->fd, &msg)) > 0) {
+			switch (msg.type) {
+			case SESSION_MSG_READY:
+				session->warm = true;
+				session_print_timings(session, &msg);
+				break;
+			case SESSION_MSG_STARTED:
+				session_print_timings(session, &msg);
+				if (session->state == SESSION_STATE_STARTING)
+					session_set_state(session,
+							  SESSION_STATE_RUNNING);
+				break;
+			case SESSION_MSG_RESUMED:
+				fprintf(stdout, "session %p resumed, first frame %"
+					PRIu64 " us after the transmitter "
+					"reconnected\n", session,
+					get_monotonic_us() - session->resume_us);
+				break;
+			case SESSION_MSG_FRAME_DONE:
+				if (session->surface) {
+					surface_frame_done(session->surface,
+							   msg.frame.seq,
+							   msg.frame.time);
+					client_mark_dirty(session->client);
+				}
+				break;
+			default:
+				if (session->surface) {
+					session_relay_input(session, &msg);
+					client_mark_dirty(session->client);
+				}
+				break;
+			}
+		}
+
+		if (ret == 0 || (ret < 0 && errno != EAGAIN)) {
+			fprintf(stdout, "session %p: worker went away\n", session);
+			goto gone;
+		}
+	}
+
+	if (events & (EPOLLERR | EPOLLHUP)) {
+		fprintf(stdout, "session %p: worker hung up\n", session);
+		goto gone;
+	}
+
+	return;
+
+gone:
+	/* an idle worker that died is not replaced, whatever killed it
+	 * would likely kill the next one too */
+	if (session->parked) {
+		session->parked = false;
+		timer_cancel(&session->park_timer);
+		wl_list_remove(&session->link);
+		wl_list_init(&session->link);
+	} else if (session->state == SESSION_STATE_STARTING &&
+		   !session->surface) {
+		wl_list_remove(&session->link);
+		wl_list_init(&session->link);
+		session->receiver->pool_count--;
+	}
+
+	if (session->state != SESSION_STATE_DEAD &&
+	    session->state != SESSION_STATE_DRAINING)
+		session_set_state(session, SESSION_STATE_DRAINING);
+
+	session_close_channel(session);
+	session_check_dead(session);
+}
+
+static void *
+session_worker_thread(void *data)
+{
+	struct session_worker_args *args = data;
+
+	wth_receiver_weston_main(args->fd, args->port);
+
+	close(args->fd);
+	free(args);
+
+	return NULL;
+}
+
+static int
+session_close_range(unsigned int first, unsigned int last)
+{
+#ifdef SYS_close_range
+	return syscall(SYS_close_range, first, last, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+/*
+ * The child only needs its end of the session channel. Everything else it
+ * inherited belongs to the receiver, and in particular it must never keep
+ * a Waltham socket open, whichever reactor it belongs to. Other reactors
+ * may have been changing their lists at the time of the fork(), so the
+ * descriptors are closed by number instead of by walking those.
+ */
+static void
+session_close_inherited_fds(int keep)
+{
+	struct dirent *ent;
+	DIR *dir;
+	long max;
+	int fd;
+
+	if ((keep == 3 || session_close_range(3, keep - 1) == 0) &&
+	    session_close_range(keep + 1, ~0U) == 0)
+		return;
+
+	/* no close_range() before Linux 5.9 */
+	dir = opendir("/proc/self/fd");
+	if (!dir) {
+		max = sysconf(_SC_OPEN_MAX);
+		for (fd = 3; fd < max; fd++) {
+			if (fd != keep)
+				close(fd);
+		}
+		return;
+	}
+
+	while ((ent = readdir(dir))) {
+		fd = atoi(ent->d_name);
+		if (fd < 3 || fd == keep || fd == dirfd(dir))
+			continue;
+		close(fd);
+	}
+
+	closedir(dir);
+}
+
+static int
+session_start_fork(struct session *session, struct session_worker_args *args)
+{
+	pid_t cpid;
+	int ret;
+
+	cpid = fork();
+	if (cpid == -1) {
+		wth_error("Failed to fork()\n");
+		return -1;
+	}
+
+	if (cpid == 0) {
+		session_close_inherited_fds(args->fd);
+
+		/* the receiver's SIGINT handler is meaningless in here */
+		signal(SIGINT, SIG_DFL);
+
+		ret = wth_receiver_weston_main(args->fd, args->port);
+		_exit(ret < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+	/* this is parent, the child is reaped from the main loop once its
+	 * pidfd becomes readable, without blocking anyone else.
+	 */
+	session->pid = cpid;
+	session_watch_child(session);
+
+	close(args->fd);
+	free(args);
+
+	return 0;
+}
+
+static int
+session_start_thread(struct session *session, struct session_worker_args *args)
+{
+	pthread_attr_t attr;
+	int ret;
+
+	/* the worker cleans up after itself, nobody joins it */
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&session->thread, &attr,
+			     session_worker_thread, args);
+	pthread_attr_destroy(&attr);
+
+	if (ret != 0) {
+		wth_error("Failed to create session thread: %s\n",
+			  strerror(ret));
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+session_present(struct session *session, struct buffer *buffer,
+		const struct blob_damage *damage)
+{
+	struct session_msg msg = { .type = SESSION_MSG_BUFFER };
+
+	/* a worker still starting gets the buffer after its START */
+	if (session->fd < 0 ||
+	    (session->state != SESSION_STATE_STARTING &&
+	     session->state != SESSION_STATE_RUNNING))
+		return -1;
+
+	msg.buffer.width = buffer->width;
+	msg.buffer.height = buffer->height;
+	msg.buffer.stride = buffer->stride;
+	msg.buffer.format = buffer->format;
+	msg.buffer.size = buffer->data_sz;
+	msg.buffer.damage = *damage;
+
+	return session_msg_send_fd(session->fd, &msg, buffer->fd);
+}
+
+static int32_t
+session_scale_coord(int32_t v, int32_t scale)
+{
+	int64_t scaled = (int64_t) v * scale;
+
+	if (scaled > INT32_MAX)
+		return INT32_MAX;
+	if (scaled < INT32_MIN)
+		return INT32_MIN;
+	return scaled;
+}
+
+int
+session_set_region(struct session *session, enum session_region kind,
+		   const struct region_set *set, int32_t scale)
+{
+	struct session_msg msg = { .type = SESSION_MSG_REGION };
+	const struct region_box *boxes;
+	struct region_box *box;
+	uint32_t count, sent = 0, i;
+
+	if (session->fd < 0 ||
+	    (session->state != SESSION_STATE_STARTING &&
+	     session->state != SESSION_STATE_RUNNING))
+		return -1;
+
+	msg.region.kind = kind;
+	msg.region.flags = SESSION_REGION_FIRST;
+
+	if (!set) {
+		msg.region.flags |= SESSION_REGION_LAST | SESSION_REGION_INFINITE;
+		return session_msg_send(session->fd, &msg);
+	}
+
+	/* the channel is not meant for thousands of messages at once: less
+	 * of the opaque region is still opaque, more input region still
+	 * gets all the input */
+	boxes = set->boxes;
+	count = set->count;
+	if (count > SESSION_REGION_MAX_BOXES) {
+		if (kind == SESSION_REGION_INPUT) {
+			boxes = &set->extents;
+			count = 1;
+		} else {
+			count = SESSION_REGION_MAX_BOXES;
+		}
+	}
+
+	do {
+		msg.region.count = count - sent < SESSION_REGION_BOXES ?
+				   count - sent : SESSION_REGION_BOXES;
+		for (i = 0; i < msg.region.count; i++) {
+			box = &msg.region.boxes[i];
+			box->x1 = session_scale_coord(boxes[sent + i].x1, scale);
+			box->y1 = session_scale_coord(boxes[sent + i].y1, scale);
+			box->x2 = session_scale_coord(boxes[sent + i].x2, scale);
+			box->y2 = session_scale_coord(boxes[sent + i].y2, scale);
+		}
+		sent += msg.region.count;
+		if (sent == count)
+			msg.region.flags |= SESSION_REGION_LAST;
+
+		if (session_msg_send(session->fd, &msg) < 0)
+			return -1;
+		msg.region.flags = 0;
+	} while (sent < count);
+
+	return 0;
+}
+
+int
+session_request_frame(struct session *session, uint32_t seq, bool with_buffer)
+{
+	struct session_msg msg = { .type = SESSION_MSG_FRAME };
+
+	if (session->fd < 0 ||
+	    (session->state != SESSION_STATE_STARTING &&
+	     session->state != SESSION_STATE_RUNNING))
+		return -1;
+
+	msg.frame.seq = seq;
+	msg.frame.buffer = with_buffer;
+
+	return session_msg_send(session->fd, &msg);
+}
+
+static void
+session_park_expired(struct timer *t);
+
+/*
+ * Starts a worker that warms up (gstreamer, compositor connection, pipeline
+ * in PAUSED) and then waits for SESSION_MSG_START.
+ */
+static struct session *
+session_spawn(struct receiver *srv, int port)
+{
+	struct session_worker_args *args;
+	struct session *session;
+	int sv[2];
+	int ret;
+
+	session = zalloc(sizeof *session);
+	if (!session)
+		return NULL;
+
+	args = zalloc(sizeof *args);
+	if (!args) {
+		free(session);
+		return NULL;
+	}
+
+	if (os_socketpair_cloexec(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		wth_error("Failed to create session channel: %s\n",
+			  strerror(errno));
+		free(args);
+		free(session);
+		return NULL;
+	}
+
+	session->receiver = srv;
+	session->state = SESSION_STATE_STARTING;
+	session->mode = session_mode;
+	session->fd = sv[0];
+	session->pid_watch.fd = -1;
+	wl_list_init(&session->link);
+	timer_init(&session->park_timer, srv, session_park_expired);
+
+	args->fd = sv[1];
+	args->port = port;
+
+	if (session->mode == SESSION_MODE_THREAD)
+		ret = session_start_thread(session, args);
+	else
+		ret = session_start_fork(session, args);
+
+	if (ret < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		free(args);
+		free(session);
+		return NULL;
+	}
+
+	wl_list_insert(srv->session_table.prev, &session->table_link);
+
+	session->watch.receiver = srv;
+	session->watch.fd = session->fd;
+	session->watch.cb = session_handle_data;
+	os_fd_set_nonblock(session->fd);
+	if (watch_ctl(&session->watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+		wth_error("Failed to watch session channel\n");
+		close(session->fd);
+		session->fd = -1;
+	}
+
+	return session;
+}
+
+/**
+* session_pool_fill
+*
+* Tops up the pool of pre-warmed workers to the configured size
+*
+* @param names        struct receiver *srv
+* @param value        receiver owning the pool
+* @return             none
+*/
+void
+session_pool_fill(struct receiver *srv)
+{
+	struct session *session;
+
+	while (srv->pool_count < session_pool_size) {
+		session = session_spawn(srv, rtp_port);
+		if (!session) {
+			wth_error("Failed to spawn a pooled worker\n");
+			return;
+		}
+
+		wl_list_insert(srv->pool_list.prev, &session->link);
+		srv->pool_count++;
+	}
+}
+
+/* prefer the oldest worker, it is the one most likely to be warm already */
+static struct session *
+session_pool_take(struct receiver *srv)
+{
+	struct session *session;
+
+	if (wl_list_empty(&srv->pool_list))
+		return NULL;
+
+	session = wl_container_of(srv->pool_list.next, session, link);
+	wl_list_remove(&session->link);
+	wl_list_init(&session->link);
+	srv->pool_count--;
+
+	if (!session->warm)
+		fprintf(stdout, "session %p: pooled worker still warming up\n",
+			session);
+
+	return session;
+}
+
+static bool
+session_peer_match(const struct sockaddr_storage *a,
+		   const struct sockaddr_storage *b)
+{
+	const struct sockaddr_in *a4 = (const struct sockaddr_in *) a;
+	const struct sockaddr_in *b4 = (const struct sockaddr_in *) b;
+	const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *) a;
+	const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *) b;
+
+	if (a->ss_family != b->ss_family)
+		return false;
+
+	/* the transmitter reconnects from another port */
+	switch (a->ss_family) {
+	case AF_INET:
+		return a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+	case AF_INET6:
+		return memcmp(&a6->sin6_addr, &b6->sin6_addr,
+			      sizeof a6->sin6_addr) == 0;
+	default:
+		/* AF_UNIX, local to this machine anyway */
+		return true;
+	}
+}
+
+static void
+session_unpark(struct session *session)
+{
+	session->parked = false;
+	timer_cancel(&session->park_timer);
+	wl_list_remove(&session->link);
+	wl_list_init(&session->link);
+}
+
+/* the parked list only holds the sessions of transmitters that just went
+ * away, walking it is cheaper than keeping an index up to date */
+static struct session *
+session_find_parked(struct receiver *srv, struct client *client,
+		    const char *app_id)
+{
+	struct session *session;
+
+	wl_list_for_each(session, &srv->parked_list, link) {
+		if (strcmp(session->app_id, app_id) == 0 &&
+		    session_peer_match(&session->peer, &client->peer))
+			return session;
+	}
+
+	return NULL;
+}
+
+static void
+session_attach(struct session *session, struct surface *surface)
+{
+	struct client *client = surface->ivisurf->appid->client;
+
+	session->client = client;
+	session->surface = surface;
+	wl_list_insert(&client->session_list, &session->link);
+}
+
+struct session *
+session_create(struct surface *surface, const char *app_id, int port)
+{
+	struct client *client = surface->ivisurf->appid->client;
+	struct receiver *srv = client->receiver;
+	struct session_msg msg = { .type = SESSION_MSG_START };
+	struct session *session;
+	uint64_t start_us = get_monotonic_us();
+
+	session = session_find_parked(srv, client, app_id);
+	if (session) {
+		session_unpark(session);
+		session_attach(session, surface);
+		session->resume_us = client->connect_us;
+
+		msg.type = SESSION_MSG_RESUME;
+		if (session->fd < 0 || session_msg_send(session->fd, &msg) < 0)
+			wth_error("session %p: failed to resume\n", session);
+
+		fprintf(stdout, "session %p resumed for surface %p, %" PRIu64
+			" us after the transmitter reconnected\n", session,
+			surface, start_us - client->connect_us);
+		return session;
+	}
+
+	session = session_pool_take(srv);
+	if (session && session_pool_refill == SESSION_POOL_REFILL_EAGER)
+		session_pool_fill(srv);
+
+	if (!session)
+		session = session_spawn(srv, port);
+	if (!session)
+		return NULL;
+
+	session_attach(session, surface);
+	session->start_us = start_us;
+	snprintf(session->app_id, sizeof session->app_id, "%s", app_id);
+
+	snprintf(msg.start.app_id, sizeof msg.start.app_id, "%s", app_id);
+	msg.start.port = port;
+	if (session->fd < 0 || session_msg_send(session->fd, &msg) < 0)
+		wth_error("session %p: failed to hand over the surface\n", session);
+
+	fprintf(stdout, "session %p started for surface %p (%s)\n",
+		session, surface, session->mode == SESSION_MODE_THREAD ?
+		"thread" : "fork");
+
+	return session;
+}
+
+static void
+session_detach(struct session *session)
+{
+	if (session->surface->ivisurf)
+		session->surface->ivisurf->session = NULL;
+
+	session->surface = NULL;
+	session->client = NULL;
+	session->pointer_held = false;
+	session->touch_held = 0;
+	session->frame_held = false;
+	wl_list_remove(&session->link);
+	wl_list_init(&session->link);
+}
+
+static void
+session_stop(struct session *session)
+{
+	struct session_msg msg = { .type = SESSION_MSG_STOP };
+	struct receiver *srv = session->receiver;
+
+	srv->stats.teardown_pending = true;
+
+	if (session->state == SESSION_STATE_DEAD) {
+		session_free(session);
+	} else {
+		/* a child that was not reaped yet keeps its pid, kill() cannot
+		 * hit anybody else */
+		if (session->fd < 0 || session_msg_send(session->fd, &msg) < 0) {
+			if (session->mode == SESSION_MODE_FORK &&
+			    kill(session->pid, SIGINT) < 0) {
+				fprintf(stderr, "Failed to send SIGINT to child %d\n",
+					session->pid);
+			}
+		}
+
+		session_set_state(session, SESSION_STATE_DRAINING);
+	}
+
+	if (session_pool_refill == SESSION_POOL_REFILL_LAZY && srv->running)
+		session_pool_fill(srv);
+}
+
+void
+session_destroy(struct session *session)
+{
+	session_detach(session);
+	session_stop(session);
+}
+
+static void
+session_park_expired(struct timer *t)
+{
+	struct session *session = container_of(t, struct session, park_timer);
+
+	fprintf(stdout, "session %p: transmitter did not come back\n", session);
+	session_unpark(session);
+	session_stop(session);
+}
+
+void
+session_park(struct session *session)
+{
+	struct receiver *srv = session->receiver;
+	struct client *client = session->client;
+
+	/* nothing worth keeping, or nobody left to come back to */
+	if (!session_resume_grace || !srv->running ||
+	    session->state == SESSION_STATE_DRAINING ||
+	    session->state == SESSION_STATE_DEAD) {
+		session_destroy(session);
+		return;
+	}
+
+	session->peer = client->peer;
+	session_detach(session);
+
+	session->parked = true;
+	wl_list_insert(&srv->parked_list, &session->link);
+	timer_arm(&session->park_timer, session_resume_grace, 0);
+
+	fprintf(stdout, "session %p parked for %u ms\n", session,
+		session_resume_grace);
+}
@@ -0,0 +1,244 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the socket profile of the connections   **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-socket.h"
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL	69
+#endif
+
+enum {
+	SOCKET_OPT_NODELAY,
+	SOCKET_OPT_QUICKACK,
+	SOCKET_OPT_SNDBUF,
+	SOCKET_OPT_RCVBUF,
+	SOCKET_OPT_USER_TIMEOUT,
+	SOCKET_OPT_NOTSENT_LOWAT,
+	SOCKET_OPT_FASTOPEN,
+};
+
+static char *const socket_opt_keys[] = {
+	[SOCKET_OPT_NODELAY] = "nodelay",
+	[SOCKET_OPT_QUICKACK] = "quickack",
+	[SOCKET_OPT_SNDBUF] = "sndbuf",
+	[SOCKET_OPT_RCVBUF] = "rcvbuf",
+	[SOCKET_OPT_USER_TIMEOUT] = "user-timeout",
+	[SOCKET_OPT_NOTSENT_LOWAT] = "notsent-lowat",
+	[SOCKET_OPT_FASTOPEN] = "fastopen",
+	NULL
+};
+
+static int
+socket_opt_value(const char *key, const char *value, long max, long *out)
+{
+	char *end;
+
+	if (!value) {
+		wth_error("Socket option '%s' needs a value\n", key);
+		return -1;
+	}
+
+	errno = 0;
+	*out = strtol(value, &end, 0);
+	if (errno || *end != '\0' || *out < 0 || *out > max) {
+		wth_error("Bad value '%s' for socket option '%s'\n", value, key);
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+socket_profile_parse(struct socket_profile *profile, char *opts)
+{
+	char *value;
+	long v;
+	int opt;
+
+	while (*opts != '\0') {
+		opt = getsubopt(&opts, socket_opt_keys, &value);
+		if (opt < 0) {
+			wth_error("Unknown socket option '%s'\n", value);
+			return -1;
+		}
+
+		if (socket_opt_value(socket_opt_keys[opt], value,
+				     opt <= SOCKET_OPT_QUICKACK ? 1 : 0x7fffffff,
+				     &v) < 0)
+			return -1;
+
+		switch (opt) {
+		case SOCKET_OPT_NODELAY:
+			profile->nodelay = v;
+			break;
+		case SOCKET_OPT_QUICKACK:
+			profile->quickack = v;
+			break;
+		case SOCKET_OPT_SNDBUF:
+			profile->sndbuf = v;
+			break;
+		case SOCKET_OPT_RCVBUF:
+			profile->rcvbuf = v;
+			break;
+		case SOCKET_OPT_USER_TIMEOUT:
+			profile->user_timeout = v;
+			break;
+		case SOCKET_OPT_NOTSENT_LOWAT:
+			profile->notsent_lowat = v;
+			break;
+		case SOCKET_OPT_FASTOPEN:
+			profile->fastopen = v;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int
+socket_set_int(int fd, int level, int name, int value, const char *what)
+{
+	if (setsockopt(fd, level, name, &value, sizeof value) < 0) {
+		wth_error("Failed to set %s to %d: %s\n", what, value,
+			  strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+int
+socket_profile_apply_listen(const struct socket_profile *profile, int fd)
+{
+	int ret = 0;
+
+	if (profile->sndbuf &&
+	    socket_set_int(fd, SOL_SOCKET, SO_SNDBUF, profile->sndbuf,
+			   "SO_SNDBUF") < 0)
+		ret = -1;
+	if (profile->rcvbuf &&
+	    socket_set_int(fd, SOL_SOCKET, SO_RCVBUF, profile->rcvbuf,
+			   "SO_RCVBUF") < 0)
+		ret = -1;
+	if (profile->user_timeout &&
+	    socket_set_int(fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
+			   profile->user_timeout, "TCP_USER_TIMEOUT") < 0)
+		ret = -1;
+	if (profile->notsent_lowat &&
+	    socket_set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+			   profile->notsent_lowat, "TCP_NOTSENT_LOWAT") < 0)
+		ret = -1;
+
+	/* a transmitter that was here before sends its first request along
+	 * with the SYN; without server support in net.ipv4.tcp_fastopen the
+	 * kernel falls back to a regular handshake, nothing to fail for */
+	if (profile->fastopen)
+		socket_set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, profile->fastopen,
+			       "TCP_FASTOPEN");
+
+	return ret;
+}
+
+void
+socket_profile_apply_client(const struct socket_profile *profile, int fd)
+{
+	/* Linux does not reliably carry these over from the listener */
+	if (profile->nodelay)
+		socket_set_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+	if (profile->quickack)
+		socket_profile_rearm_quickack(fd);
+}
+
+void
+socket_profile_rearm_quickack(int fd)
+{
+	int one = 1;
+
+	/* best effort, nothing to report on every read */
+	setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof one);
+}
+
+int
+socket_set_busy_poll(int fd, unsigned int usecs)
+{
+	int value = usecs;
+	int one = 1;
+	int ret = 0;
+
+	if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value, sizeof value) < 0)
+		ret = -1;
+	/* Linux 5.11 and newer */
+	if (setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof one) < 0)
+		ret = -1;
+
+	return ret;
+}
+
+static int
+socket_get_int(int fd, int level, int name)
+{
+	socklen_t len;
+	int value;
+
+	len = sizeof value;
+	if (fd < 0 || getsockopt(fd, level, name, &value, &len) < 0)
+		return -1;
+
+	return value;
+}
+
+void
+socket_profile_report(const struct socket_profile *profile, int fd)
+{
+	fprintf(stdout, "TCP socket profile: nodelay %s, quickack %s, "
+		"sndbuf %d (kernel %d), rcvbuf %d (kernel %d), "
+		"user-timeout %u ms, notsent-lowat %u, fastopen %u\n",
+		profile->nodelay ? "on" : "off",
+		profile->quickack ? "on" : "off",
+		profile->sndbuf, socket_get_int(fd, SOL_SOCKET, SO_SNDBUF),
+		profile->rcvbuf, socket_get_int(fd, SOL_SOCKET, SO_RCVBUF),
+		profile->user_timeout, profile->notsent_lowat,
+		profile->fastopen);
+}
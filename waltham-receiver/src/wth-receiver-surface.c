@@ -27,24 +27,256 @@
 #include "wth-receiver-buffer.h"
 #include "wth-receiver-seat.h"
 #include "wth-receiver-surface.h"
+#include "wth-receiver-session.h"
 
-void
-wth_receiver_weston_shm_attach(struct window *window, uint32_t data_sz, void * data,
-		int32_t width, int32_t height, int32_t stride, uint32_t format)
+/*
+ * The surface is shown by its session worker, these only keep track of
+ * the double-buffered state and hand a committed buffer over to it.
+ */
+static void
+wth_receiver_weston_shm_attach(struct window *window, struct buffer *buffer)
 {
-	/* stub */
+	window->receiver_surf->pending_buffer = buffer;
 }
 
-void
-wth_receiver_weston_shm_damage(struct window *window)
+static void
+wth_receiver_weston_shm_damage(struct window *window, bool buffer_coords,
+			       int32_t x, int32_t y, int32_t width, int32_t height)
+{
+	struct surface *surface = window->receiver_surf;
+
+	blob_damage_add(buffer_coords ? &surface->pending_buffer_damage :
+					&surface->pending_damage,
+			x, y, width, height);
+}
+
+/*
+ * Surface damage in buffer coordinates. Only the scale is worth the
+ * trouble, a transformed buffer is damaged all over.
+ */
+static void
+surface_damage_to_buffer(struct surface *surface, struct buffer *buffer,
+			 struct blob_damage *damage)
+{
+	const struct blob_damage *pending = &surface->pending_damage;
+	int32_t scale = surface->buffer_scale;
+	uint32_t i;
+
+	if (surface->buffer_transform != WL_OUTPUT_TRANSFORM_NORMAL) {
+		if (pending->count)
+			blob_damage_add(damage, 0, 0,
+					buffer->width, buffer->height);
+		return;
+	}
+
+	for (i = 0; i < pending->count; i++) {
+		/* clipped later on, only overflows need care here */
+		if (pending->rects[i].x > INT32_MAX / scale ||
+		    pending->rects[i].y > INT32_MAX / scale) {
+			continue;
+		} else if (pending->rects[i].width > INT32_MAX / scale ||
+			   pending->rects[i].height > INT32_MAX / scale) {
+			blob_damage_add(damage, 0, 0,
+					buffer->width, buffer->height);
+			continue;
+		}
+
+		blob_damage_add(damage,
+				pending->rects[i].x * scale,
+				pending->rects[i].y * scale,
+				pending->rects[i].width * scale,
+				pending->rects[i].height * scale);
+	}
+}
+
+#define SURFACE_REGIONS_ALL ((1 << SESSION_REGION_COUNT) - 1)
+
+/*
+ * Applies the opaque and input regions set since the last commit, and
+ * sends the worker whichever it does not have yet, ahead of the buffer
+ * they go with.
+ */
+static void
+surface_commit_regions(struct surface *surface)
+{
+	struct region_set tmp;
+	struct session *session;
+
+	/* the pending sets are overwritten as a whole, swapping will do */
+	if (surface->pending_regions & (1 << SESSION_REGION_OPAQUE)) {
+		tmp = surface->opaque;
+		surface->opaque = surface->pending_opaque;
+		surface->pending_opaque = tmp;
+	}
+	if (surface->pending_regions & (1 << SESSION_REGION_INPUT)) {
+		tmp = surface->input;
+		surface->input = surface->pending_input;
+		surface->pending_input = tmp;
+		surface->input_infinite = surface->pending_input_infinite;
+	}
+
+	surface->regions_unsent |= surface->pending_regions;
+	surface->pending_regions = 0;
+
+	session = surface->ivisurf ? surface->ivisurf->session : NULL;
+	if (!session)
+		return;
+
+	if ((surface->regions_unsent & (1 << SESSION_REGION_OPAQUE)) &&
+	    session_set_region(session, SESSION_REGION_OPAQUE,
+			       &surface->opaque, surface->buffer_scale) == 0)
+		surface->regions_unsent &= ~(1 << SESSION_REGION_OPAQUE);
+
+	if ((surface->regions_unsent & (1 << SESSION_REGION_INPUT)) &&
+	    session_set_region(session, SESSION_REGION_INPUT,
+			       surface->input_infinite ? NULL : &surface->input,
+			       surface->buffer_scale) == 0)
+		surface->regions_unsent &= ~(1 << SESSION_REGION_INPUT);
+}
+
+#define SURFACE_FRAME_FALLBACK_MS 16
+
+static unsigned int
+surface_send_frames(struct surface *surface, uint32_t seq, uint32_t time)
 {
-	/* stub */
+	struct frame_callback *fc, *tmp;
+	unsigned int count = 0;
+
+	wl_list_for_each_safe(fc, tmp, &surface->frames, link) {
+		/* in commit order, seq may have wrapped around */
+		if ((int32_t) (fc->seq - seq) > 0)
+			break;
+
+		wthp_callback_send_done(fc->obj, time);
+		client_account_output(surface->client, CLIENT_MSG_BYTES(1));
+		wthp_callback_free(fc->obj);
+		wl_list_remove(&fc->link);
+		arena_free(&surface->client->arena, ARENA_FRAME_CALLBACK, fc);
+		count++;
+	}
+
+	return count;
 }
 
 void
+surface_frame_done(struct surface *surface, uint32_t seq, uint32_t time)
+{
+	struct receiver *srv = surface->client->receiver;
+
+	srv->stats.frames_shown += surface_send_frames(surface, seq, time);
+}
+
+static void
+surface_frame_timer(struct timer *t)
+{
+	struct surface *surface = container_of(t, struct surface, frame_timer);
+	struct receiver *srv = surface->client->receiver;
+
+	/* same clock and unit as the timestamps of wl_callback.done */
+	srv->stats.frames_unpaced +=
+		surface_send_frames(surface, surface->frame_unpaced_seq,
+				    (uint32_t) (get_monotonic_us() / 1000));
+	client_mark_dirty(surface->client);
+}
+
+/* the frame callbacks requested since the last commit go with this one */
+static bool
+surface_commit_frames(struct surface *surface)
+{
+	struct frame_callback *fc;
+
+	if (wl_list_empty(&surface->pending_frames))
+		return false;
+
+	/* 0 is never used, the worker takes it for none */
+	if (++surface->frame_seq == 0)
+		surface->frame_seq = 1;
+
+	wl_list_for_each(fc, &surface->pending_frames, link)
+		fc->seq = surface->frame_seq;
+	wl_list_insert_list(surface->frames.prev, &surface->pending_frames);
+	wl_list_init(&surface->pending_frames);
+
+	return true;
+}
+
+/*
+ * The worker reports when the commit is shown, that paces the transmitter
+ * by the local display. A surface nothing shows yet still gets its frame
+ * callbacks done at a steady rate, rather than stalling its transmitter.
+ */
+static void
+surface_request_frame(struct surface *surface, struct session *session,
+		      bool with_buffer)
+{
+	if (session &&
+	    session_request_frame(session, surface->frame_seq, with_buffer) == 0)
+		return;
+
+	surface->frame_unpaced_seq = surface->frame_seq;
+	if (!timer_is_armed(&surface->frame_timer))
+		timer_arm(&surface->frame_timer, SURFACE_FRAME_FALLBACK_MS, 0);
+}
+
+static void
 wth_receiver_weston_shm_commit(struct window *window)
 {
-	/* stub */
+	struct surface *surface = window->receiver_surf;
+	struct receiver *srv = surface->client->receiver;
+	struct buffer *buffer = surface->pending_buffer;
+	struct blob_damage damage;
+	struct session *session;
+	bool frames;
+
+	/* the worker gets the regions in buffer coordinates */
+	if (surface->pending_scale != surface->buffer_scale)
+		surface->regions_unsent = SURFACE_REGIONS_ALL;
+
+	surface->buffer_scale = surface->pending_scale;
+	surface->buffer_transform = surface->pending_transform;
+	surface->pending_buffer = NULL;
+
+	surface_commit_regions(surface);
+	frames = surface_commit_frames(surface);
+	session = surface->ivisurf ? surface->ivisurf->session : NULL;
+
+	if (!buffer || buffer->fd < 0) {
+		surface->pending_damage.count = 0;
+		surface->pending_buffer_damage.count = 0;
+		if (frames)
+			surface_request_frame(surface, session, false);
+		return;
+	}
+
+	damage = surface->pending_buffer_damage;
+	surface_damage_to_buffer(surface, buffer, &damage);
+	surface->pending_damage.count = 0;
+	surface->pending_buffer_damage.count = 0;
+
+	/* a new buffer without any damage still has to show up */
+	if (!damage.count)
+		blob_damage_add(&damage, 0, 0, buffer->width, buffer->height);
+	blob_damage_clip(&damage, buffer->width, buffer->height);
+
+	/* the worker has to know before the buffer shows up */
+	if (frames)
+		surface_request_frame(surface, session, session != NULL);
+
+	if (!session || session_present(session, buffer, &damage) < 0) {
+		/* the next buffer has to cover for this one */
+		surface->pending_buffer_damage = damage;
+		srv->stats.blob_dropped++;
+
+		/* and the worker has to commit the frame on its own */
+		if (frames && session)
+			surface_request_frame(surface, session, false);
+		return;
+	}
+
+	srv->stats.blob_frames++;
+	srv->stats.blob_damaged_bytes += blob_damage_area(&damage) * 4;
+	srv->stats.blob_frame_bytes += (uint64_t) buffer->width *
+				       buffer->height * 4;
 }
 
 /*
@@ -53,9 +285,32 @@ wth_receiver_weston_shm_commit(struct window *window)
 void
 surface_destroy(struct surface *surface)
 {
+	struct frame_callback *fc;
+
+	/* the callbacks go away with the surface, without done */
+	timer_cancel(&surface->frame_timer);
+	wl_list_insert_list(&surface->frames, &surface->pending_frames);
+	wl_list_last_until_empty(fc, &surface->frames, link) {
+		wthp_callback_free(fc->obj);
+		wl_list_remove(&fc->link);
+		arena_free(&surface->client->arena, ARENA_FRAME_CALLBACK, fc);
+	}
+
+	if (surface->ivisurf) {
+		if (surface->ivisurf->session)
+			session_destroy(surface->ivisurf->session);
+		surface->ivisurf->surf = NULL;
+	}
+
+	region_set_fini(&surface->pending_opaque);
+	region_set_fini(&surface->pending_input);
+	region_set_fini(&surface->opaque);
+	region_set_fini(&surface->input);
+
 	wthp_surface_free(surface->obj);
 	wl_list_remove(&surface->link);
-	free(surface);
+	arena_free(&surface->client->arena, ARENA_WINDOW, surface->shm_window);
+	arena_free(&surface->client->arena, ARENA_SURFACE, surface);
 }
 
 static void
@@ -72,18 +327,20 @@ surface_handle_attach(struct wthp_surface *wthp_surface,
 		struct wthp_buffer *wthp_buff, int32_t x, int32_t y)
 {
 	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
-	struct buffer *buf = container_of(&wthp_buff, struct buffer, obj);
+	struct buffer *buf = NULL;
+
+	if (wthp_buff)
+		buf = wth_object_get_user_data((struct wth_object *)wthp_buff);
+
+	if (!surf->shm_window)
+		return;
 
-	if (surf->ivi_id != 0) {
-		wth_receiver_weston_shm_attach(surf->shm_window,
-				buf->data_sz,
-				buf->data,
-				buf->width,
-				buf->height,
-				buf->stride,
-				buf->format);
+	wth_receiver_weston_shm_attach(surf->shm_window, buf);
 
+	/* the pixels were copied when the buffer was created */
+	if (buf) {
 		wthp_buffer_send_complete(wthp_buff, 0);
+		client_account_output(surf->client, CLIENT_MSG_BYTES(1));
 	}
 }
 
@@ -93,9 +350,9 @@ surface_handle_damage(struct wthp_surface *wthp_surface,
 {
 	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
 
-	if (surf->ivi_id != 0) {
-		wth_receiver_weston_shm_damage(surf->shm_window);
-	}
+	if (surf->shm_window)
+		wth_receiver_weston_shm_damage(surf->shm_window, false,
+					       x, y, width, height);
 }
 
 static void
@@ -103,21 +360,60 @@ surface_handle_frame(struct wthp_surface *wthp_surface,
 		struct wthp_callback *callback)
 {
 	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
-	surf->cb = callback;
+	struct frame_callback *fc;
+
+	fc = arena_zalloc(&surf->client->arena, ARENA_FRAME_CALLBACK);
+	if (!fc) {
+		wthp_callback_free(callback);
+		client_post_out_of_memory(surf->client);
+		return;
+	}
+
+	fc->obj = callback;
+	wl_list_insert(surf->pending_frames.prev, &fc->link);
 }
 
 static void
 surface_handle_set_opaque_region(struct wthp_surface *wthp_surface,
-		struct wthp_region *region)
+		struct wthp_region *wthp_region)
 {
+	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
+	struct region *region;
+
+	/* no opaque region is the same as an empty one */
+	if (wthp_region) {
+		region = wth_object_get_user_data((struct wth_object *)wthp_region);
+		if (region_set_copy(&surf->pending_opaque, &region->set) < 0) {
+			client_post_out_of_memory(surf->client);
+			return;
+		}
+	} else {
+		region_set_clear(&surf->pending_opaque);
+	}
 
+	surf->pending_regions |= 1 << SESSION_REGION_OPAQUE;
 }
 
 static void
 surface_handle_set_input_region(struct wthp_surface *wthp_surface,
-		struct wthp_region *region)
+		struct wthp_region *wthp_region)
 {
+	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
+	struct region *region;
+
+	if (wthp_region) {
+		region = wth_object_get_user_data((struct wth_object *)wthp_region);
+		if (region_set_copy(&surf->pending_input, &region->set) < 0) {
+			client_post_out_of_memory(surf->client);
+			return;
+		}
+		surf->pending_input_infinite = false;
+	} else {
+		region_set_clear(&surf->pending_input);
+		surf->pending_input_infinite = true;
+	}
 
+	surf->pending_regions |= 1 << SESSION_REGION_INPUT;
 }
 
 static void
@@ -125,30 +421,44 @@ surface_handle_commit(struct wthp_surface *wthp_surface)
 {
 	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
 
-	if (surf->ivi_id != 0) {
+	if (surf->shm_window)
 		wth_receiver_weston_shm_commit(surf->shm_window);
-	}
 }
 
 static void
 surface_handle_set_buffer_transform(struct wthp_surface *wthp_surface,
 		int32_t transform)
 {
+	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
 
+	if (transform < WL_OUTPUT_TRANSFORM_NORMAL ||
+	    transform > WL_OUTPUT_TRANSFORM_FLIPPED_270)
+		return;
+
+	surf->pending_transform = transform;
 }
 
 static void
 surface_handle_set_buffer_scale(struct wthp_surface *wthp_surface,
 		int32_t scale)
 {
+	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
 
+	if (scale < 1)
+		return;
+
+	surf->pending_scale = scale;
 }
 
 static void
 surface_handle_damage_buffer(struct wthp_surface *wthp_surface,
 		int32_t x, int32_t y, int32_t width, int32_t height)
 {
+	struct surface *surf = wth_object_get_user_data((struct wth_object *)wthp_surface);
 
+	if (surf->shm_window)
+		wth_receiver_weston_shm_damage(surf->shm_window, true,
+					       x, y, width, height);
 }
 
 static const struct wthp_surface_interface surface_implementation = {
@@ -174,18 +484,34 @@ compositor_handle_create_surface(struct wthp_compositor *compositor,
 	struct surface *surface;
 	struct seat *seat, *tmp;
 
-	surface = zalloc(sizeof *surface);
+	surface = arena_zalloc(&client->arena, ARENA_SURFACE);
 	if (!surface) {
 		client_post_out_of_memory(comp->client);
 		return;
 	}
 
 	surface->obj = id;
+	surface->client = client;
+	surface->pending_scale = 1;
+	surface->buffer_scale = 1;
+	surface->pending_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	surface->buffer_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	region_set_init(&surface->pending_opaque);
+	region_set_init(&surface->pending_input);
+	region_set_init(&surface->opaque);
+	region_set_init(&surface->input);
+	surface->pending_input_infinite = true;
+	surface->input_infinite = true;
+	/* a worker taken over from an earlier surface may have others */
+	surface->regions_unsent = SURFACE_REGIONS_ALL;
+	wl_list_init(&surface->pending_frames);
+	wl_list_init(&surface->frames);
+	timer_init(&surface->frame_timer, client->receiver, surface_frame_timer);
 	wl_list_insert(&comp->client->surface_list, &surface->link);
 
 	wthp_surface_set_interface(id, &surface_implementation, surface);
 
-	surface->shm_window = calloc(1, sizeof *surface->shm_window);
+	surface->shm_window = arena_zalloc(&client->arena, ARENA_WINDOW);
 	if (!surface->shm_window)
 		return;
 
@@ -204,9 +530,10 @@ compositor_handle_create_surface(struct wthp_compositor *compositor,
 void
 region_destroy(struct region *region)
 {
+	region_set_fini(&region->set);
 	wthp_region_free(region->obj);
 	wl_list_remove(&region->link);
-	free(region);
+	arena_free(&region->client->arena, ARENA_REGION, region);
 }
 
 static void
@@ -221,6 +548,10 @@ static void
 region_handle_add(struct wthp_region *wthp_region,
 		int32_t x, int32_t y, int32_t width, int32_t height)
 {
+	struct region *region = wth_object_get_user_data((struct wth_object *)wthp_region);
+
+	if (region_set_union_rect(&region->set, x, y, width, height) < 0)
+		client_post_out_of_memory(region->client);
 }
 
 static void
@@ -228,6 +559,10 @@ region_handle_subtract(struct wthp_region *wthp_region,
 		int32_t x, int32_t y,
 		int32_t width, int32_t height)
 {
+	struct region *region = wth_object_get_user_data((struct wth_object *)wthp_region);
+
+	if (region_set_subtract_rect(&region->set, x, y, width, height) < 0)
+		client_post_out_of_memory(region->client);
 }
 
 static const struct wthp_region_interface region_implementation = {
@@ -244,7 +579,7 @@ compositor_destroy(struct compositor *comp)
 {
 	wthp_compositor_free(comp->obj);
 	wl_list_remove(&comp->link);
-	free(comp);
+	arena_free(&comp->client->arena, ARENA_COMPOSITOR, comp);
 }
 
 static void
@@ -254,13 +589,15 @@ compositor_handle_create_region(struct wthp_compositor *compositor,
 	struct compositor *comp = wth_object_get_user_data((struct wth_object *)compositor);
 	struct region *region;
 
-	region = zalloc(sizeof *region);
+	region = arena_zalloc(&comp->client->arena, ARENA_REGION);
 	if (!region) {
 		client_post_out_of_memory(comp->client);
 		return;
 	}
 
 	region->obj = id;
+	region->client = comp->client;
+	region_set_init(&region->set);
 	wl_list_insert(&comp->client->region_list, &region->link);
 
 	wthp_region_set_interface(id, &region_implementation, region);
@@ -277,7 +614,7 @@ client_bind_compositor(struct client *c, struct wthp_compositor *obj)
 
 	struct compositor *comp;
 
-	comp = zalloc(sizeof *comp);
+	comp = arena_zalloc(&c->arena, ARENA_COMPOSITOR);
 	if (!comp) {
 		client_post_out_of_memory(c);
 		return;
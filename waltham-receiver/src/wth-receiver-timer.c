@@ -0,0 +1,384 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the timer wheel of a reactor            **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-timer.h"
+
+/*
+ * 4 levels of 64 slots, 1 ms per tick: level 0 holds the timers due in the
+ * next 64 ms, level 1 the next 4 s, level 2 the next 4.5 min and level 3
+ * the next 4.6 h. Timers further out are parked at the end of level 3 and
+ * placed again when that slot is cascaded.
+ */
+#define TIMER_WHEEL_BITS	6
+#define TIMER_WHEEL_SLOTS	(1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK	(TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS	4
+#define TIMER_WHEEL_RANGE	(UINT64_C(1) << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))
+
+struct timer_wheel {
+    struct receiver *receiver;
+    struct watch watch;
+
+    uint64_t now;                 /* next tick to process */
+    uint64_t programmed;          /* tick the timerfd fires at, 0 if disarmed */
+
+    unsigned int count[TIMER_WHEEL_LEVELS];
+    struct wl_list slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+static uint64_t
+timer_wheel_clock(void)
+{
+	return get_monotonic_us() / 1000;
+}
+
+static bool
+timer_wheel_empty(struct timer_wheel *wheel)
+{
+	int level;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (wheel->count[level])
+			return false;
+	}
+
+	return true;
+}
+
+static void
+timer_wheel_insert(struct timer_wheel *wheel, struct timer *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t delta;
+	int level;
+
+	if (expires < wheel->now)
+		expires = wheel->now;
+
+	delta = expires - wheel->now;
+	if (delta >= TIMER_WHEEL_RANGE) {
+		expires = wheel->now + TIMER_WHEEL_RANGE - 1;
+		delta = TIMER_WHEEL_RANGE - 1;
+	}
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if (delta < (UINT64_C(1) << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	}
+
+	t->level = level + 1;
+	wheel->count[level]++;
+	wl_list_insert(wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) &
+					   TIMER_WHEEL_MASK].prev, &t->link);
+}
+
+static void
+timer_wheel_remove(struct timer_wheel *wheel, struct timer *t)
+{
+	wheel->count[t->level - 1]--;
+	wl_list_remove(&t->link);
+	wl_list_init(&t->link);
+	t->level = 0;
+}
+
+/*
+ * Earliest expiry of the armed timers. Within a level the first non-empty
+ * slot after the current position holds the earliest timers of that
+ * level, but a timer placed long ago on a higher level may be due before
+ * one placed recently on a lower level, so every level has to be looked at.
+ * Above level 0 the current slot has already been cascaded unless the
+ * wheel sits right on its boundary, whatever sits there then has wrapped
+ * around and is a full level period away: it is only looked at last.
+ * Parked timers are due after the end of their slot, they only need a
+ * wakeup by then to be placed again.
+ */
+static uint64_t
+timer_wheel_next_expiry(struct timer_wheel *wheel)
+{
+	uint64_t next = UINT64_MAX;
+	uint64_t base, end, expires;
+	struct wl_list *slot;
+	struct timer *t;
+	unsigned int first, off;
+	int level;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		if (!wheel->count[level])
+			continue;
+
+		base = wheel->now >> (TIMER_WHEEL_BITS * level);
+		first = (wheel->now &
+			 ((UINT64_C(1) << (TIMER_WHEEL_BITS * level)) - 1)) ? 1 : 0;
+
+		for (off = first; off <= TIMER_WHEEL_SLOTS; off++) {
+			slot = &wheel->slots[level][(base + off) & TIMER_WHEEL_MASK];
+			if (wl_list_empty(slot))
+				continue;
+
+			end = ((base + off + 1) << (TIMER_WHEEL_BITS * level)) - 1;
+			wl_list_for_each(t, slot, link) {
+				expires = t->expires < end ? t->expires : end;
+				if (expires < next)
+					next = expires;
+			}
+			break;
+		}
+	}
+
+	return next;
+}
+
+static void
+timer_wheel_program(struct timer_wheel *wheel)
+{
+	struct itimerspec its = { 0 };
+	uint64_t next;
+
+	next = timer_wheel_next_expiry(wheel);
+	if (next == UINT64_MAX) {
+		wheel->programmed = 0;
+	} else {
+		/* already due timers still need a wakeup, not a disarm */
+		if (next < wheel->now)
+			next = wheel->now;
+		wheel->programmed = next;
+		its.it_value.tv_sec = next / 1000;
+		its.it_value.tv_nsec = (next % 1000) * 1000000;
+	}
+
+	if (timerfd_settime(wheel->watch.fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+		wth_error("Failed to program the timer wheel\n");
+}
+
+static void
+timer_wheel_cascade(struct timer_wheel *wheel, int level, unsigned int idx)
+{
+	struct wl_list *slot = &wheel->slots[level][idx];
+	struct timer *t;
+
+	while (!wl_list_empty(slot)) {
+		t = wl_container_of(slot->next, t, link);
+		timer_wheel_remove(wheel, t);
+		timer_wheel_insert(wheel, t);
+	}
+}
+
+/*
+ * Processes every tick up to and including target. Cascading and firing
+ * cost O(1) per timer, stretches of ticks without anything on the lower
+ * levels are skipped.
+ */
+static void
+timer_wheel_advance(struct timer_wheel *wheel, uint64_t target)
+{
+	struct wl_list pending;
+	struct timer *t;
+	uint64_t tick, step;
+	int level;
+
+	while (wheel->now <= target) {
+		if (timer_wheel_empty(wheel)) {
+			wheel->now = target + 1;
+			break;
+		}
+
+		tick = wheel->now;
+
+		/* higher levels first, they may refill the lower ones */
+		for (level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+			if (tick & ((UINT64_C(1) << (TIMER_WHEEL_BITS * level)) - 1))
+				continue;
+			timer_wheel_cascade(wheel, level,
+					    (tick >> (TIMER_WHEEL_BITS * level)) &
+					    TIMER_WHEEL_MASK);
+		}
+
+		wl_list_init(&pending);
+		wl_list_insert_list(&pending, &wheel->slots[0][tick & TIMER_WHEEL_MASK]);
+		wl_list_init(&wheel->slots[0][tick & TIMER_WHEEL_MASK]);
+		wheel->now = tick + 1;
+
+		while (!wl_list_empty(&pending)) {
+			t = wl_container_of(pending.next, t, link);
+			timer_wheel_remove(wheel, t);
+
+			if (t->period) {
+				while (t->expires <= tick)
+					t->expires += t->period;
+				timer_wheel_insert(wheel, t);
+			}
+
+			wheel->receiver->stats.timers_fired++;
+			t->cb(t);
+		}
+
+		/* nothing due on the lowest levels, jump to the next boundary
+		 * that has to cascade something */
+		step = 1;
+		for (level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+			if (wheel->count[level])
+				break;
+			step <<= TIMER_WHEEL_BITS;
+		}
+		if (step > 1) {
+			/* but never past real time, or timers armed from now on
+			 * would be clamped to a tick in the future */
+			tick = (tick & ~(step - 1)) + step;
+			wheel->now = tick <= target ? tick : target + 1;
+		}
+	}
+}
+
+static void
+timer_wheel_handle_data(struct watch *w, uint32_t events)
+{
+	struct timer_wheel *wheel = container_of(w, struct timer_wheel, watch);
+	uint64_t expirations;
+
+	/* only there to clear the readable state */
+	if (read(w->fd, &expirations, sizeof expirations) < 0 &&
+	    errno != EAGAIN)
+		wth_error("Failed to read the timer wheel\n");
+
+	wheel->receiver->stats.timer_wakeups++;
+
+	timer_wheel_advance(wheel, timer_wheel_clock());
+	timer_wheel_program(wheel);
+}
+
+int
+timer_wheel_create(struct receiver *srv)
+{
+	struct timer_wheel *wheel;
+	int level, i;
+
+	wheel = zalloc(sizeof *wheel);
+	if (!wheel)
+		return -1;
+
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+		for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			wl_list_init(&wheel->slots[level][i]);
+
+	wheel->receiver = srv;
+	wheel->now = timer_wheel_clock();
+
+	wheel->watch.receiver = srv;
+	wheel->watch.cb = timer_wheel_handle_data;
+	wheel->watch.fd = timerfd_create(CLOCK_MONOTONIC,
+					 TFD_NONBLOCK | TFD_CLOEXEC);
+	if (wheel->watch.fd < 0) {
+		free(wheel);
+		return -1;
+	}
+
+	if (watch_ctl(&wheel->watch, EPOLL_CTL_ADD, EPOLLIN) < 0) {
+		close(wheel->watch.fd);
+		free(wheel);
+		return -1;
+	}
+
+	srv->timers = wheel;
+	return 0;
+}
+
+void
+timer_wheel_destroy(struct receiver *srv)
+{
+	struct timer_wheel *wheel = srv->timers;
+	struct timer *t;
+	int level, i;
+
+	if (!wheel)
+		return;
+
+	/* whoever still owns a timer must not find it armed */
+	for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+		for (i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			wl_list_last_until_empty(t, &wheel->slots[level][i], link)
+				timer_wheel_remove(wheel, t);
+
+	watch_ctl(&wheel->watch, EPOLL_CTL_DEL, 0);
+	close(wheel->watch.fd);
+	free(wheel);
+	srv->timers = NULL;
+}
+
+void
+timer_init(struct timer *t, struct receiver *srv, void (*cb)(struct timer *t))
+{
+	t->wheel = srv->timers;
+	t->cb = cb;
+	t->expires = 0;
+	t->period = 0;
+	t->level = 0;
+	wl_list_init(&t->link);
+}
+
+void
+timer_arm(struct timer *t, uint32_t delay, uint32_t period)
+{
+	struct timer_wheel *wheel = t->wheel;
+
+	uint64_t now = timer_wheel_clock();
+
+	if (timer_is_armed(t))
+		timer_wheel_remove(wheel, t);
+
+	/* an idle wheel is not kept up to date, catch up for free */
+	if (timer_wheel_empty(wheel) && wheel->now < now)
+		wheel->now = now;
+
+	t->expires = now + delay;
+	t->period = period;
+	timer_wheel_insert(wheel, t);
+
+	if (!wheel->programmed || t->expires < wheel->programmed)
+		timer_wheel_program(wheel);
+}
+
+void
+timer_cancel(struct timer *t)
+{
+	/* the timerfd may fire for nothing, which is cheaper than
+	 * looking for the next expiry on every cancel */
+	if (timer_is_armed(t))
+		timer_wheel_remove(t->wheel, t);
+}
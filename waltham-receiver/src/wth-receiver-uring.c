@@ -0,0 +1,551 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : This file implements the io_uring event backend              **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "wth-receiver-comm.h"
+#include "wth-receiver-uring.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+enum uring_req_type {
+    URING_REQ_POLL,
+    URING_REQ_ACCEPT,
+};
+
+/* one poll request, or the accept request, in flight on the ring */
+struct uring_req {
+    enum uring_req_type type;
+    struct watch *watch;       /* NULL once the watch went away */
+    uint32_t events;
+    bool armed;                /* the kernel still holds the request */
+    struct wl_list link;       /* struct uring::req_list */
+    struct wl_list rearm_link; /* struct uring::rearm_list */
+};
+
+struct uring {
+    struct receiver *receiver;
+    int fd;
+
+    unsigned int sq_entries;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned int sq_pending;   /* queued but not submitted yet */
+
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    struct wl_list req_list;   /* struct uring_req::link, poll requests */
+    struct wl_list rearm_list; /* struct uring_req::rearm_link */
+
+    struct uring_req accept;
+    bool accept_multishot;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		   unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int
+uring_map(struct uring *ring, struct io_uring_params *p)
+{
+	ring->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	ring->cq_ring_size = p->cq_off.cqes +
+			     p->cq_entries * sizeof(struct io_uring_cqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd,
+			     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED)
+		return -1;
+
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+				     PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd,
+				     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			return -1;
+		}
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		return -1;
+	}
+
+	ring->sq_entries = p->sq_entries;
+	ring->sq_head = (unsigned int *) ((char *) ring->sq_ring + p->sq_off.head);
+	ring->sq_tail = (unsigned int *) ((char *) ring->sq_ring + p->sq_off.tail);
+	ring->sq_mask = (unsigned int *) ((char *) ring->sq_ring + p->sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) ((char *) ring->sq_ring + p->sq_off.array);
+
+	ring->cq_head = (unsigned int *) ((char *) ring->cq_ring + p->cq_off.head);
+	ring->cq_tail = (unsigned int *) ((char *) ring->cq_ring + p->cq_off.tail);
+	ring->cq_mask = (unsigned int *) ((char *) ring->cq_ring + p->cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ring + p->cq_off.cqes);
+
+	return 0;
+}
+
+struct uring *
+uring_create(struct receiver *srv, unsigned int entries)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+
+	ring = zalloc(sizeof *ring);
+	if (!ring)
+		return NULL;
+
+	ring->receiver = srv;
+	ring->fd = -1;
+	ring->sq_ring = MAP_FAILED;
+	wl_list_init(&ring->req_list);
+	wl_list_init(&ring->rearm_list);
+
+	/* completions are only ever reaped from io_uring_enter(), the
+	 * kernel does not need to interrupt us to run task work */
+	memset(&p, 0, sizeof p);
+	p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+	ring->fd = sys_io_uring_setup(entries, &p);
+	if (ring->fd < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof p);
+		ring->fd = sys_io_uring_setup(entries, &p);
+	}
+
+	if (ring->fd < 0 || uring_map(ring, &p) < 0) {
+		wth_error("Failed to set up io_uring: %s\n", strerror(errno));
+		uring_destroy(ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+void
+uring_destroy(struct uring *ring)
+{
+	struct uring_req *req, *tmp;
+
+	wl_list_for_each_safe(req, tmp, &ring->req_list, link)
+		free(req);
+
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if (ring->sq_ring != MAP_FAILED)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+
+	free(ring);
+}
+
+static int
+uring_enter(struct uring *ring, unsigned int min_complete)
+{
+	int ret;
+
+	ret = sys_io_uring_enter(ring->fd, ring->sq_pending, min_complete,
+				 IORING_ENTER_GETEVENTS);
+	if (ret < 0)
+		return -1;
+
+	ring->sq_pending -= ret;
+	return 0;
+}
+
+/*
+ * Returns a cleared entry at the tail of the submission queue, it gets
+ * queued by uring_commit_sqe() once filled in.
+ */
+static struct io_uring_sqe *
+uring_get_sqe(struct uring *ring)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int head, tail;
+
+	tail = *ring->sq_tail;
+	head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->sq_entries) {
+		/* full, make room by submitting what we have */
+		if (uring_enter(ring, 0) < 0)
+			return NULL;
+
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (tail - head >= ring->sq_entries) {
+			errno = EBUSY;
+			return NULL;
+		}
+	}
+
+	sqe = &ring->sqes[tail & *ring->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+
+	return sqe;
+}
+
+static void
+uring_commit_sqe(struct uring *ring)
+{
+	unsigned int tail = *ring->sq_tail;
+
+	ring->sq_array[tail & *ring->sq_mask] = tail & *ring->sq_mask;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->sq_pending++;
+}
+
+/*
+ * Level-triggered watches are armed one-shot: arming checks the current
+ * state of the fd, so re-arming after every event gives epoll's level
+ * semantics. EPOLLET watches stay armed and only report new edges.
+ */
+static int
+uring_arm_poll(struct uring *ring, struct uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = req->watch->fd;
+	sqe->poll32_events = req->events & ~EPOLLET;
+	sqe->len = (req->events & EPOLLET) ? IORING_POLL_ADD_MULTI : 0;
+	sqe->user_data = (uintptr_t) req;
+	uring_commit_sqe(ring);
+
+	req->armed = true;
+	return 0;
+}
+
+static int
+uring_arm_accept(struct uring *ring)
+{
+	struct receiver *srv = ring->receiver;
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = srv->listen_fd;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = (uintptr_t) &ring->accept;
+	uring_commit_sqe(ring);
+
+	ring->accept.armed = true;
+	return 0;
+}
+
+/* the completion of the removal itself is of no interest, user_data 0 */
+static int
+uring_cancel_poll(struct uring *ring, struct uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uintptr_t) req;
+	uring_commit_sqe(ring);
+
+	return 0;
+}
+
+static void
+uring_req_free(struct uring_req *req)
+{
+	wl_list_remove(&req->link);
+	wl_list_remove(&req->rearm_link);
+	free(req);
+}
+
+/*
+ * Detaches a request from its watch. A request the kernel still holds is
+ * cancelled and freed on its last completion, which may come after the
+ * watch itself was freed.
+ */
+static void
+uring_req_release(struct uring *ring, struct uring_req *req)
+{
+	req->watch = NULL;
+	wl_list_remove(&req->rearm_link);
+	wl_list_init(&req->rearm_link);
+
+	if (!req->armed)
+		uring_req_free(req);
+	else
+		uring_cancel_poll(ring, req);
+}
+
+int
+uring_watch_ctl(struct uring *ring, struct watch *w, int op, uint32_t events)
+{
+	struct uring_req *req = w->req;
+
+	switch (op) {
+	case EPOLL_CTL_ADD:
+		req = zalloc(sizeof *req);
+		if (!req) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		req->type = URING_REQ_POLL;
+		req->watch = w;
+		req->events = events;
+		wl_list_insert(&ring->req_list, &req->link);
+		wl_list_init(&req->rearm_link);
+		w->req = req;
+
+		return uring_arm_poll(ring, req);
+	case EPOLL_CTL_MOD:
+		if (!req) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		/* waiting to be re-armed, which picks up the new events */
+		if (!req->armed) {
+			req->events = events;
+			return 0;
+		}
+
+		uring_req_release(ring, req);
+		w->req = NULL;
+		return uring_watch_ctl(ring, w, EPOLL_CTL_ADD, events);
+	case EPOLL_CTL_DEL:
+		if (!req) {
+			errno = ENOENT;
+			return -1;
+		}
+
+		uring_req_release(ring, req);
+		w->req = NULL;
+		return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+int
+uring_accept_start(struct uring *ring)
+{
+	struct receiver *srv = ring->receiver;
+
+	ring->accept.type = URING_REQ_ACCEPT;
+	ring->accept.watch = &srv->listen_watch;
+	wl_list_init(&ring->accept.link);
+	wl_list_init(&ring->accept.rearm_link);
+	ring->accept_multishot = true;
+
+	return uring_arm_accept(ring);
+}
+
+static void
+uring_complete_accept(struct uring *ring, int res)
+{
+	struct receiver *srv = ring->receiver;
+
+	if (res >= 0) {
+		receiver_adopt_client(srv, res);
+	} else if (res == -EINVAL && ring->accept_multishot) {
+		/* no multishot accept in this kernel, poll the listening
+		 * socket and accept from its watch instead */
+		wth_error("Multishot accept not supported, polling instead\n");
+		ring->accept_multishot = false;
+		uring_watch_ctl(ring, &srv->listen_watch, EPOLL_CTL_ADD, EPOLLIN);
+		return;
+	} else {
+		wth_error("Failed to accept a connection: %s\n", strerror(-res));
+	}
+
+	if (!ring->accept.armed && ring->accept_multishot)
+		uring_arm_accept(ring);
+}
+
+static void
+uring_complete(struct uring *ring, struct io_uring_cqe *cqe,
+	       struct epoll_event *ee, int *count)
+{
+	struct uring_req *req = (struct uring_req *) (uintptr_t) cqe->user_data;
+
+	if (!req)
+		return;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		req->armed = false;
+
+	if (req->type == URING_REQ_ACCEPT) {
+		uring_complete_accept(ring, cqe->res);
+		return;
+	}
+
+	if (!req->watch) {
+		if (!req->armed)
+			uring_req_free(req);
+		return;
+	}
+
+	/* the watch callbacks already know what to do with EPOLLERR */
+	ee[*count].events = cqe->res < 0 ? EPOLLERR : (uint32_t) cqe->res;
+	ee[*count].data.ptr = req->watch;
+	(*count)++;
+
+	if (!req->armed)
+		wl_list_insert(ring->rearm_list.prev, &req->rearm_link);
+}
+
+int
+uring_wait(struct uring *ring, struct epoll_event *ee, int max, int timeout)
+{
+	struct uring_req *req, *tmp;
+	unsigned int head, tail;
+	int count = 0;
+
+	/* the events handed out last time have been handled by now */
+	wl_list_for_each_safe(req, tmp, &ring->rearm_list, rearm_link) {
+		if (uring_arm_poll(ring, req) < 0)
+			break;
+
+		wl_list_remove(&req->rearm_link);
+		wl_list_init(&req->rearm_link);
+	}
+
+	head = *ring->cq_head;
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+	if (uring_enter(ring, (timeout < 0 && head == tail) ? 1 : 0) < 0)
+		return -1;
+
+	tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	while (head != tail && count < max) {
+		uring_complete(ring, &ring->cqes[head & *ring->cq_mask],
+			       ee, &count);
+		head++;
+	}
+
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+struct uring *
+uring_create(struct receiver *srv, unsigned int entries)
+{
+	wth_error("Built without io_uring support\n");
+	errno = ENOSYS;
+	return NULL;
+}
+
+void
+uring_destroy(struct uring *ring)
+{
+}
+
+int
+uring_watch_ctl(struct uring *ring, struct watch *w, int op, uint32_t events)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+uring_accept_start(struct uring *ring)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+uring_wait(struct uring *ring, struct epoll_event *ee, int max, int timeout)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
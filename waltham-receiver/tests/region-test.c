@@ -0,0 +1,493 @@
+/*
+ * Copyright © 2020 Collabora, Ltd.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/*******************************************************************************
+**                                                                            **
+**  TARGET    : linux                                                         **
+**                                                                            **
+**  PROJECT   : waltham-receiver                                              **
+**                                                                            **
+**  PURPOSE   : Unit tests of the rectangle sets. Every result is checked     **
+**  against the band invariants and, for the random cases, pixel by pixel    **
+**  against a bitmap of the same operation.                                   **
+**                                                                            **
+*******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "wth-receiver-region.h"
+
+#define GRID		48	/* of the random cases, in pixels */
+#define RANDOM_CASES	500
+
+static int failures;
+
+#define check(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n", \
+				__FILE__, __LINE__, __func__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+struct box_list {
+    const struct region_box *boxes;
+    uint32_t count;
+};
+
+#define BOXES(...) \
+	((struct box_list) { \
+		(const struct region_box[]) { __VA_ARGS__ }, \
+		sizeof ((struct region_box[]) { __VA_ARGS__ }) / \
+			sizeof (struct region_box) })
+
+#define NO_BOXES ((struct box_list) { NULL, 0 })
+
+/* the representation wth-receiver-region.h promises */
+static bool
+set_is_canonical(const struct region_set *set)
+{
+	struct region_box ext = { 0 };
+	const struct region_box *b, *p;
+	uint32_t i, band = 0, prev_band = 0, n, prev_n = 0;
+
+	for (i = 0; i < set->count; i++) {
+		b = &set->boxes[i];
+		if (b->x1 >= b->x2 || b->y1 >= b->y2)
+			return false;
+
+		if (i == 0) {
+			ext = *b;
+		} else {
+			ext.x1 = b->x1 < ext.x1 ? b->x1 : ext.x1;
+			ext.x2 = b->x2 > ext.x2 ? b->x2 : ext.x2;
+			ext.y2 = b->y2 > ext.y2 ? b->y2 : ext.y2;
+		}
+
+		if (i == band)
+			continue;
+
+		p = &set->boxes[i - 1];
+		if (b->y1 == p->y1) {
+			/* same band: same height, apart and in order */
+			if (b->y2 != p->y2 || b->x1 <= p->x2)
+				return false;
+			continue;
+		}
+
+		/* a new band, below the previous one */
+		if (b->y1 < p->y2)
+			return false;
+
+		n = i - band;
+		if (prev_n && prev_n == n &&
+		    set->boxes[prev_band].y2 == set->boxes[band].y1) {
+			uint32_t k;
+
+			/* adjacent bands with the same spans are one band */
+			for (k = 0; k < n; k++) {
+				if (set->boxes[prev_band + k].x1 !=
+				    set->boxes[band + k].x1 ||
+				    set->boxes[prev_band + k].x2 !=
+				    set->boxes[band + k].x2)
+					break;
+			}
+			if (k == n)
+				return false;
+		}
+		prev_band = band;
+		prev_n = n;
+		band = i;
+	}
+
+	/* the last band against the one before it */
+	n = set->count - band;
+	if (set->count && prev_n == n && band != prev_band &&
+	    set->boxes[prev_band].y2 == set->boxes[band].y1) {
+		uint32_t k;
+
+		for (k = 0; k < n; k++) {
+			if (set->boxes[prev_band + k].x1 !=
+			    set->boxes[band + k].x1 ||
+			    set->boxes[prev_band + k].x2 !=
+			    set->boxes[band + k].x2)
+				break;
+		}
+		if (k == n)
+			return false;
+	}
+
+	return memcmp(&ext, &set->extents, sizeof ext) == 0;
+}
+
+static bool
+set_equals(const struct region_set *set, struct box_list expected)
+{
+	if (set->count != expected.count)
+		return false;
+
+	return !set->count || memcmp(set->boxes, expected.boxes,
+				     set->count * sizeof *set->boxes) == 0;
+}
+
+static bool
+sets_equal(const struct region_set *a, const struct region_set *b)
+{
+	struct box_list list = { b->boxes, b->count };
+
+	return set_equals(a, list) &&
+		memcmp(&a->extents, &b->extents, sizeof a->extents) == 0;
+}
+
+#define check_set(set, expected) \
+	do { \
+		check(set_is_canonical(set)); \
+		check(set_equals(set, expected)); \
+	} while (0)
+
+/* a 30x30 square with a 10x10 hole in the middle */
+static void
+make_ring(struct region_set *set)
+{
+	region_set_init(set);
+	check(region_set_union_rect(set, 0, 0, 30, 30) == 0);
+	check(region_set_subtract_rect(set, 10, 10, 10, 10) == 0);
+}
+
+static void
+test_union_coalesce(void)
+{
+	struct region_set set;
+
+	region_set_init(&set);
+
+	/* side by side, then below: one box each time */
+	check(region_set_union_rect(&set, 0, 0, 10, 10) == 0);
+	check(region_set_union_rect(&set, 10, 0, 10, 10) == 0);
+	check_set(&set, BOXES({ 0, 0, 20, 10 }));
+	check(region_set_union_rect(&set, 0, 10, 20, 10) == 0);
+	check_set(&set, BOXES({ 0, 0, 20, 20 }));
+
+	/* overlapping at a corner splits into three bands */
+	check(region_set_union_rect(&set, 10, 10, 20, 20) == 0);
+	check_set(&set, BOXES({ 0, 0, 20, 10 },
+			      { 0, 10, 30, 20 },
+			      { 10, 20, 30, 30 }));
+
+	/* empty rectangles change nothing */
+	check(region_set_union_rect(&set, 50, 50, 0, 10) == 0);
+	check(region_set_union_rect(&set, 50, 50, 10, -1) == 0);
+	check(set.count == 3);
+
+	/* filling the two notches merges everything back */
+	check(region_set_union_rect(&set, 20, 0, 10, 10) == 0);
+	check(region_set_union_rect(&set, 0, 20, 10, 10) == 0);
+	check_set(&set, BOXES({ 0, 0, 30, 30 }));
+
+	region_set_fini(&set);
+}
+
+static void
+test_intersect_coalesce(void)
+{
+	struct region_set ring, rect, out;
+
+	make_ring(&ring);
+	region_set_init(&rect);
+	region_set_init(&out);
+
+	/* a column left of the hole crosses three bands of the ring */
+	check(region_set_union_rect(&rect, 0, 0, 5, 30) == 0);
+	check(region_set_intersect(&out, &ring, &rect) == 0);
+	check_set(&out, BOXES({ 0, 0, 5, 30 }));
+
+	region_set_clear(&rect);
+	check(region_set_union_rect(&rect, 0, 5, 30, 20) == 0);
+	check(region_set_intersect(&out, &ring, &rect) == 0);
+	check_set(&out, BOXES({ 0, 5, 30, 10 },
+			      { 0, 10, 10, 20 }, { 20, 10, 30, 20 },
+			      { 0, 20, 30, 25 }));
+
+	/* the hole only */
+	region_set_clear(&rect);
+	check(region_set_union_rect(&rect, 10, 10, 10, 10) == 0);
+	check(region_set_intersect(&out, &ring, &rect) == 0);
+	check_set(&out, NO_BOXES);
+	check(out.extents.x1 == 0 && out.extents.x2 == 0 &&
+	      out.extents.y1 == 0 && out.extents.y2 == 0);
+
+	region_set_fini(&ring);
+	region_set_fini(&rect);
+	region_set_fini(&out);
+}
+
+static void
+test_subtract_coalesce(void)
+{
+	struct region_set ring, set;
+
+	make_ring(&ring);
+	check_set(&ring, BOXES({ 0, 0, 30, 10 },
+			       { 0, 10, 10, 20 }, { 20, 10, 30, 20 },
+			       { 0, 20, 30, 30 }));
+
+	/* taking the right side off leaves a C, the hole opens */
+	region_set_init(&set);
+	check(region_set_copy(&set, &ring) == 0);
+	check(region_set_subtract_rect(&set, 20, 0, 10, 30) == 0);
+	check_set(&set, BOXES({ 0, 0, 20, 10 },
+			      { 0, 10, 10, 20 },
+			      { 0, 20, 20, 30 }));
+
+	/* and the bottom, the rest of the bands merge */
+	check(region_set_subtract_rect(&set, 10, 0, 10, 30) == 0);
+	check_set(&set, BOXES({ 0, 0, 10, 30 }));
+
+	check(region_set_subtract_rect(&set, -5, -5, 40, 40) == 0);
+	check_set(&set, NO_BOXES);
+
+	region_set_fini(&ring);
+	region_set_fini(&set);
+}
+
+static void
+test_translate_normalize(void)
+{
+	struct region_set set;
+
+	region_set_init(&set);
+
+	/* not clipped, only moved */
+	check(region_set_union_rect(&set, 0, 0, 10, 10) == 0);
+	region_set_translate(&set, -3, 7);
+	check_set(&set, BOXES({ -3, 7, 7, 17 }));
+
+	/* partly clipped at the edge of the range */
+	region_set_translate(&set, INT32_MAX - 5, 0);
+	check_set(&set, BOXES({ INT32_MAX - 8, 7, INT32_MAX, 17 }));
+
+	/*
+	 * The box on the left is pushed out of the range and dropped, the
+	 * first band is left with the span of the second one and the two
+	 * have to become one.
+	 */
+	region_set_clear(&set);
+	check(region_set_union_rect(&set, -100, 0, 10, 10) == 0);
+	check(region_set_union_rect(&set, 0, 0, 10, 20) == 0);
+	check(set.count == 3);
+	region_set_translate(&set, INT32_MIN + 50, 0);
+	check_set(&set, BOXES({ INT32_MIN + 50, 0, INT32_MIN + 60, 20 }));
+
+	/* all of it out of the range */
+	region_set_translate(&set, 0, INT32_MIN);
+	region_set_translate(&set, 0, INT32_MIN);
+	check_set(&set, NO_BOXES);
+
+	region_set_fini(&set);
+}
+
+static void
+test_contains_point(void)
+{
+	struct region_set ring, empty;
+
+	make_ring(&ring);
+	region_set_init(&empty);
+
+	check(region_set_contains_point(&ring, 0, 0));
+	check(region_set_contains_point(&ring, 5, 5));
+	check(region_set_contains_point(&ring, 9, 15));
+	check(region_set_contains_point(&ring, 20, 15));
+	check(region_set_contains_point(&ring, 29, 29));
+	check(!region_set_contains_point(&ring, 10, 10));
+	check(!region_set_contains_point(&ring, 15, 15));
+	check(!region_set_contains_point(&ring, 19, 19));
+	check(!region_set_contains_point(&ring, 30, 0));
+	check(!region_set_contains_point(&ring, 0, 30));
+	check(!region_set_contains_point(&ring, -1, 0));
+	check(!region_set_contains_point(&ring, 0, -1));
+	check(!region_set_contains_point(&empty, 0, 0));
+
+	region_set_fini(&ring);
+	region_set_fini(&empty);
+}
+
+typedef int (*region_op)(struct region_set *, const struct region_set *,
+			 const struct region_set *);
+
+static const struct {
+    const char *name;
+    region_op op;
+} ops[] = {
+	{ "union", region_set_union },
+	{ "intersect", region_set_intersect },
+	{ "subtract", region_set_subtract },
+};
+
+/* dst may be either operand, or both */
+static void
+test_aliasing(void)
+{
+	struct region_set a, b, ref, x;
+	unsigned int i;
+
+	make_ring(&a);
+	region_set_init(&b);
+	check(region_set_union_rect(&b, 5, 5, 40, 10) == 0);
+	check(region_set_union_rect(&b, 25, 25, 10, 10) == 0);
+	region_set_init(&ref);
+	region_set_init(&x);
+
+	for (i = 0; i < sizeof ops / sizeof ops[0]; i++) {
+		check(ops[i].op(&ref, &a, &b) == 0);
+		check(set_is_canonical(&ref));
+
+		check(region_set_copy(&x, &a) == 0);
+		check(ops[i].op(&x, &x, &b) == 0);
+		check(sets_equal(&x, &ref));
+
+		check(region_set_copy(&x, &b) == 0);
+		check(ops[i].op(&x, &a, &x) == 0);
+		check(sets_equal(&x, &ref));
+
+		check(region_set_copy(&x, &a) == 0);
+		check(ops[i].op(&x, &x, &x) == 0);
+		check(set_is_canonical(&x));
+		if (ops[i].op == region_set_subtract)
+			check(region_set_is_empty(&x));
+		else
+			check(sets_equal(&x, &a));
+	}
+
+	region_set_fini(&a);
+	region_set_fini(&b);
+	region_set_fini(&ref);
+	region_set_fini(&x);
+}
+
+static uint32_t
+test_random(uint32_t *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return *seed >> 8;
+}
+
+static void
+fill_random(struct region_set *set, bool map[GRID][GRID], uint32_t *seed)
+{
+	int n = test_random(seed) % 8 + 1;
+	int x, y, w, h, i, j;
+
+	region_set_init(set);
+	memset(map, 0, sizeof(bool) * GRID * GRID);
+
+	while (n--) {
+		x = test_random(seed) % GRID;
+		y = test_random(seed) % GRID;
+		w = test_random(seed) % (GRID - x) + 1;
+		h = test_random(seed) % (GRID - y) + 1;
+		check(region_set_union_rect(set, x, y, w, h) == 0);
+		for (j = y; j < y + h; j++)
+			for (i = x; i < x + w; i++)
+				map[j][i] = true;
+	}
+}
+
+static void
+test_random_ops(void)
+{
+	static bool ma[GRID][GRID], mb[GRID][GRID];
+	struct region_set a, b, out;
+	uint32_t seed = 1;
+	unsigned int n, i;
+	bool want;
+	int x, y, bad;
+
+	region_set_init(&out);
+
+	for (n = 0; n < RANDOM_CASES; n++) {
+		fill_random(&a, ma, &seed);
+		fill_random(&b, mb, &seed);
+		check(set_is_canonical(&a));
+		check(set_is_canonical(&b));
+
+		for (i = 0; i < sizeof ops / sizeof ops[0]; i++) {
+			check(ops[i].op(&out, &a, &b) == 0);
+			check(set_is_canonical(&out));
+
+			bad = 0;
+			for (y = -1; y <= GRID; y++) {
+				for (x = -1; x <= GRID; x++) {
+					bool in_a = x >= 0 && y >= 0 &&
+						x < GRID && y < GRID && ma[y][x];
+					bool in_b = x >= 0 && y >= 0 &&
+						x < GRID && y < GRID && mb[y][x];
+
+					if (ops[i].op == region_set_union)
+						want = in_a || in_b;
+					else if (ops[i].op == region_set_intersect)
+						want = in_a && in_b;
+					else
+						want = in_a && !in_b;
+
+					if (region_set_contains_point(&out, x, y) != want)
+						bad++;
+				}
+			}
+			if (bad)
+				fprintf(stderr, "case %u: %s wrong at %d pixels\n",
+					n, ops[i].name, bad);
+			check(bad == 0);
+		}
+
+		region_set_fini(&a);
+		region_set_fini(&b);
+	}
+
+	region_set_fini(&out);
+}
+
+int
+main(void)
+{
+	test_union_coalesce();
+	test_intersect_coalesce();
+	test_subtract_coalesce();
+	test_translate_normalize();
+	test_contains_point();
+	test_aliasing();
+	test_random_ops();
+
+	if (failures)
+		fprintf(stderr, "%d checks failed\n", failures);
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}